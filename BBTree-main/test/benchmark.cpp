@@ -11,6 +11,10 @@ using namespace btreeolc;
 #define LATENCY
 #define DRAM_CONSUMPTION
 // #define GDB
+#ifdef ZNS_EMULATED
+// nvme smart-log is not available for an emulated device
+#define GDB
+#endif
 
 /**
  * Tree index
@@ -40,6 +44,8 @@ u64 RUN_SIZE;
 
 // for work_queue use
 int _num_threads = 0;
+// pages per zone write, AUTO_BATCH_SIZE tunes it while running
+u32 _batch_size = BATCH_SIZE;
 
 void run_test(int num_thread, string load_data, string run_data,
               string workload, u64 max_load_size, u64 max_run_size) {
@@ -135,10 +141,12 @@ void run_test(int num_thread, string load_data, string run_data,
 #elif defined(COWBTREE_ON_ZNS)
   ZoneManagerPool *para =
       new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE, MAX_NUMS_ZONE, ZNS_DEVICE);
+  para->SetBatchSize(_batch_size);
   btreeolc::BTree *tree = new btreeolc::BTree(para);
 #elif defined(ZBTREE_ON_ZNS)
   ZoneManagerPool *para =
       new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE, MAX_NUMS_ZONE, ZNS_DEVICE);
+  para->SetBatchSize(_batch_size);
   BTree *device_tree = new BTree(para);
   btreeolc::ZBTree<KeyType, ValueType> *tree =
       new btreeolc::ZBTree<KeyType, ValueType>(device_tree);
@@ -265,7 +273,7 @@ void run_test(int num_thread, string load_data, string run_data,
         // read_fail++;
         // assert(r);
       } else if (ops[i] == OP_DELETE) {
-        // tree->Remove(keys[i]);
+        tree->Remove(keys[i]);
       }
 #ifdef LATENCY
       int current_op = ops[i];
@@ -398,6 +406,7 @@ void run_realistic_workload(int num_thread, string workload, u64 max_load_size,
   tr.start();
   ZoneManagerPool *para =
       new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE, MAX_NUMS_ZONE, ZNS_DEVICE);
+  para->SetBatchSize(_batch_size);
   BTree *device_tree = new BTree(para);
   btreeolc::ZBTree<KeyType, ValueType> *tree =
       new btreeolc::ZBTree<KeyType, ValueType>(device_tree);
@@ -539,10 +548,15 @@ void run_realistic_workload(int num_thread, string workload, u64 max_load_size,
 
 int main(int argc, char **argv) {
 #ifndef GDB
-  if (argc != 4) {
-    printf("Usage: %s <workload> <threads> <size>\n", argv[0]);
+  if (argc != 4 && argc != 5) {
+    printf("Usage: %s <workload> <threads> <size> [batch pages|auto]\n",
+           argv[0]);
     exit(0);
   };
+  if (argc == 5) {
+    _batch_size =
+        string(argv[4]) == "auto" ? AUTO_BATCH_SIZE : (u32)atoi(argv[4]);
+  }
 #endif
 
   printf("--------------------Test Begin---------------------\n");
@@ -12,6 +12,10 @@ using namespace btreeolc;
 // #define LATENCY
 #define DRAM_CONSUMPTION
 // #define GDB
+#ifdef ZNS_EMULATED
+// nvme smart-log is not available for an emulated device
+#define GDB
+#endif
 
 /**
  * Tree index
@@ -252,7 +256,7 @@ void run_test(int num_thread, string load_data, string run_data,
         // read_fail++;
         // assert(r);
       } else if (ops[i] == OP_DELETE) {
-        // tree->Remove(keys[i]);
+        tree->Remove(keys[i]);
       }
 #ifdef LATENCY
       latency.push_back(l.elapsed<std::chrono::nanoseconds>());
@@ -2,19 +2,27 @@
 
 #include <algorithm>
 #include <iostream>
+#include <map>
 #include <numeric>
 #include <random>
+#include <thread>
 #include <vector>
 
 #include "../zbtree/buffer.h"
+#include "../zbtree/buffer_btree.h"
+#include "../zbtree/key_search.h"
 #include "../zbtree/wal.h"
 #include "../zbtree/zbtree.h"
+#include "../zbtree/zone_gc.h"
+#include "../zns/zone_device.h"
+// the ZBTree sizes its work queue by the benchmark threads
+int _num_threads = 1;
 // namespace BTree {
 
 TEST(WALTest1, 1_WAL) {
   SingleWAL *wal = new SingleWAL(WAL_NAME.c_str());
   std::string data = "hello world";
-  wal->Append((const bytes_t *)data.c_str(), data.size());
+  wal->Append(data.c_str(), data.size());
   // wal->Flush();
   delete wal;
 
@@ -22,11 +30,1269 @@ TEST(WALTest1, 1_WAL) {
   u64 times = 10000;
   for (int i = 0; i < times; i++) {
     std::string data = "hello world:" + std::to_string(i);
-    wal2->Append((const bytes_t *)data.c_str(), data.size());
+    wal2->Append(data.c_str(), data.size());
   }
   delete wal2;
 }
 
+// every kernel the CPU has agrees with std::lower_bound, keys use all 64 bits
+TEST(KeySearchTest, 1_Kernels) {
+  std::mt19937_64 g(7);
+  for (int isa = KeySearch::SCALAR; isa <= KeySearch::AVX512; isa++) {
+    auto dense = KeySearch::Get(static_cast<KeySearch::Isa>(isa), false);
+    auto pairs = KeySearch::Get(static_cast<KeySearch::Isa>(isa), true);
+    if (dense == nullptr) continue;
+    for (unsigned n = 0; n <= 300; n++) {
+      std::vector<u64> keys(n);
+      for (auto &key : keys) key = g() | (g() & 1) << 63;
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+      std::vector<u64> interleaved;
+      for (u64 key : keys) {
+        interleaved.push_back(key);
+        interleaved.push_back(~key);
+      }
+      std::vector<u64> probes = {0, UINT64_MAX};
+      for (u64 key : keys) {
+        probes.push_back(key);
+        probes.push_back(key + 1);
+        probes.push_back(key - 1);
+      }
+      for (u64 k : probes) {
+        unsigned expected =
+            std::lower_bound(keys.begin(), keys.end(), k) - keys.begin();
+        ASSERT_EQ(dense(keys.data(), keys.size(), k), expected)
+            << "isa " << isa << " n " << n;
+        ASSERT_EQ(pairs(interleaved.data(), keys.size(), k), expected)
+            << "isa " << isa << " n " << n;
+      }
+    }
+  }
+  EXPECT_NE(KeySearch::Get(KeySearch::Best(), false), nullptr);
+}
+
+// batches merged into a leaf page upsert, and stop when the page is full
+TEST(LeafTest, 1_BatchInsertMerge) {
+  using namespace btreeolc;
+  alignas(CacheLineSize) static char page[LeafNodeSize];
+  BTreeLeaf leaf;
+  leaf.data = page;
+  std::map<Key, Value> expected;
+  std::mt19937_64 g(11);
+  while (leaf.count < LeafNodeMaxEntries) {
+    std::vector<Key> keys(1 + g() % 40);
+    for (auto &key : keys) key = g() % 1000;
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    std::vector<Value> values(keys.size());
+    for (auto &value : values) value = g();
+    int written = leaf.BatchInsert(keys.data(), values.data(), keys.size());
+    ASSERT_GT(written, 0);
+    for (int i = 0; i < written; i++) expected[keys[i]] = values[i];
+    if (written < (int)keys.size()) {
+      // only a key not in the leaf is left over
+      ASSERT_EQ(leaf.count, LeafNodeMaxEntries);
+      ASSERT_EQ(expected.count(keys[written]), 0u);
+    }
+    ASSERT_EQ(leaf.count, expected.size());
+    unsigned i = 0;
+    for (auto &[key, value] : expected) {
+      ASSERT_EQ(leaf.data.key(i), key);
+      ASSERT_EQ(leaf.data.value(i), value);
+      ASSERT_EQ(leaf.lowerBound(key), i);
+      i++;
+    }
+  }
+  Key gone[] = {expected.begin()->first, expected.rbegin()->first};
+  EXPECT_EQ(leaf.remove(gone, 2), 2);
+  EXPECT_EQ(leaf.count, LeafNodeMaxEntries - 2);
+  EXPECT_EQ(leaf.data.key(0), std::next(expected.begin())->first);
+  leaf.data = nullptr;
+}
+
+// emulated zones follow the sequential write rules of a real device
+TEST(ZoneBackendTest, 1_EmulatedZones) {
+  EmulatedBackend *zns = new EmulatedBackend(EMULATED_MEMORY_DEVICE);
+  unsigned int max_active_zones = 0;
+  unsigned int max_open_zones = 0;
+  EXPECT_EQ(zns->Open(false, true, &max_active_zones, &max_open_zones), OK());
+  EXPECT_EQ(max_active_zones, EMU_MAX_ACTIVE_ZONES);
+
+  uint64_t zone_sz = zns->GetZoneSize();
+  char *data = (char *)aligned_alloc(EMU_BLOCK_SIZE, EMU_BLOCK_SIZE);
+  char *buf = (char *)aligned_alloc(EMU_BLOCK_SIZE, EMU_BLOCK_SIZE);
+  memset(data, 'z', EMU_BLOCK_SIZE);
+
+  // only writes at the write pointer are accepted
+  EXPECT_EQ(zns->Write(data, EMU_BLOCK_SIZE, 0), EMU_BLOCK_SIZE);
+  EXPECT_EQ(zns->Write(data, EMU_BLOCK_SIZE, 0), -1);
+  EXPECT_EQ(zns->Write(data, EMU_BLOCK_SIZE, 3 * EMU_BLOCK_SIZE), -1);
+  EXPECT_EQ(zns->Read(buf, EMU_BLOCK_SIZE, 0, true), EMU_BLOCK_SIZE);
+  EXPECT_EQ(memcmp(data, buf, EMU_BLOCK_SIZE), 0);
+
+  // every written zone stays active until it is finished or reset
+  for (unsigned int i = 1; i < max_active_zones; i++) {
+    EXPECT_EQ(zns->Write(data, EMU_BLOCK_SIZE, i * zone_sz), EMU_BLOCK_SIZE);
+  }
+  EXPECT_EQ(zns->Write(data, EMU_BLOCK_SIZE, max_active_zones * zone_sz), -1);
+  EXPECT_EQ(zns->Finish(0), OK());
+  EXPECT_EQ(zns->Write(data, EMU_BLOCK_SIZE, EMU_BLOCK_SIZE), -1);
+  EXPECT_EQ(zns->Write(data, EMU_BLOCK_SIZE, max_active_zones * zone_sz),
+            EMU_BLOCK_SIZE);
+
+  bool offline = true;
+  uint64_t max_capacity = 0;
+  EXPECT_EQ(zns->Reset(0, &offline, &max_capacity), OK());
+  EXPECT_FALSE(offline);
+  auto zones = zns->ListZones();
+  EXPECT_EQ(zns->ZoneWp(zones, 0), 0);
+  EXPECT_TRUE(zns->ZoneIsWritable(zones, 0));
+  EXPECT_FALSE(zns->ZoneIsActive(zones, 0));
+  EXPECT_EQ(zns->Write(data, EMU_BLOCK_SIZE, 0), -1);
+
+  free(data);
+  free(buf);
+  delete zns;
+}
+
+// every page of a zone has one bit, used_capacity_ follows the bits
+TEST(ZoneBackendTest, 2_ValidBitmap) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZonedBlockDevice *zbd = new ZonedBlockDevice(device);
+  EXPECT_EQ(zbd->Open(false, true), OK());
+  Zone *zone = zbd->GetZone(1);
+  uint64_t start = zone->start_;
+
+  EXPECT_EQ(zone->GetValidPages(), 0);
+  EXPECT_TRUE(zone->MarkValid(start));
+  EXPECT_TRUE(zone->MarkValid(start + 65 * ZNS_PAGE_SIZE));
+  EXPECT_FALSE(zone->MarkValid(start));
+  EXPECT_EQ(zone->GetValidPages(), 2);
+  EXPECT_EQ(zone->used_capacity_, 2 * ZNS_PAGE_SIZE);
+  EXPECT_TRUE(zone->IsValid(start + 65 * ZNS_PAGE_SIZE));
+  EXPECT_FALSE(zone->IsValid(start + 64 * ZNS_PAGE_SIZE));
+
+  EXPECT_TRUE(zone->MarkInvalid(start));
+  EXPECT_FALSE(zone->MarkInvalid(start));
+  EXPECT_EQ(zone->GetValidPages(), 1);
+  EXPECT_EQ(zone->GetInvalidPages(), 1);
+  EXPECT_DOUBLE_EQ(zone->GetLiveRatio(), 0.5);
+  zone->ClearValid();
+  EXPECT_EQ(zone->GetValidPages(), 0);
+  EXPECT_FALSE(zone->IsUsed());
+
+  delete zbd;
+}
+
+// appends and reads of a file backed zone complete through the io_uring
+TEST(ZoneBackendTest, 3_AsyncIO) {
+  std::string path = "emu_async_test.zns";
+  EmulatedBackend *zns = new EmulatedBackend(path);
+  unsigned int max_active_zones = 0;
+  unsigned int max_open_zones = 0;
+  EXPECT_EQ(zns->Open(false, true, &max_active_zones, &max_open_zones), OK());
+
+  const int nr = 8;
+  char *data = (char *)aligned_alloc(EMU_BLOCK_SIZE, nr * EMU_BLOCK_SIZE);
+  char *buf = (char *)aligned_alloc(EMU_BLOCK_SIZE, nr * EMU_BLOCK_SIZE);
+  for (int i = 0; i < nr; i++) {
+    memset(data + i * EMU_BLOCK_SIZE, 'a' + i, EMU_BLOCK_SIZE);
+  }
+
+  // queue the appends back to back, then wait for all of them
+  IOHandle io[nr];
+  for (int i = 0; i < nr; i++) {
+    EXPECT_EQ(zns->SubmitWrite(data + i * EMU_BLOCK_SIZE, EMU_BLOCK_SIZE,
+                               i * EMU_BLOCK_SIZE, &io[i]),
+              0);
+  }
+  for (int i = 0; i < nr; i++) {
+    EXPECT_EQ(io[i].Wait(), EMU_BLOCK_SIZE);
+  }
+  // not at the write pointer
+  IOHandle bad;
+  EXPECT_NE(zns->SubmitWrite(data, EMU_BLOCK_SIZE, 0, &bad), 0);
+  EXPECT_EQ(bad.Wait(), -EIO);
+
+  for (int i = 0; i < nr; i++) {
+    EXPECT_EQ(zns->SubmitRead(buf + i * EMU_BLOCK_SIZE, EMU_BLOCK_SIZE,
+                              i * EMU_BLOCK_SIZE, &io[i]),
+              0);
+  }
+  for (int i = 0; i < nr; i++) {
+    EXPECT_EQ(io[i].Wait(), EMU_BLOCK_SIZE);
+  }
+  EXPECT_EQ(memcmp(data, buf, nr * EMU_BLOCK_SIZE), 0);
+
+  // readers waiting at once share the ring, each one gets its own block
+  std::vector<std::thread> readers;
+  std::atomic<int> mismatches{0};
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&, t] {
+      char *page = (char *)aligned_alloc(EMU_BLOCK_SIZE, EMU_BLOCK_SIZE);
+      for (int i = 0; i < 256; i++) {
+        int block = (t + i) % nr;
+        IOHandle read;
+        if (zns->SubmitRead(page, EMU_BLOCK_SIZE, block * EMU_BLOCK_SIZE,
+                            &read) != 0 ||
+            read.Wait() != EMU_BLOCK_SIZE || page[0] != 'a' + block) {
+          mismatches++;
+        }
+      }
+      free(page);
+    });
+  }
+  for (auto &reader : readers) reader.join();
+  EXPECT_EQ(mismatches.load(), 0);
+
+  // pieces scattered in memory go to the device back to back
+  struct iovec iov[2] = {{data + 5 * EMU_BLOCK_SIZE, EMU_BLOCK_SIZE},
+                         {data + 2 * EMU_BLOCK_SIZE, 2 * EMU_BLOCK_SIZE}};
+  IOHandle gather;
+  EXPECT_EQ(zns->SubmitWritev(iov, 2, 3 * EMU_BLOCK_SIZE, nr * EMU_BLOCK_SIZE,
+                              &gather),
+            0);
+  EXPECT_EQ(gather.Wait(), 3 * EMU_BLOCK_SIZE);
+  EXPECT_EQ(zns->Read(buf, 3 * EMU_BLOCK_SIZE, nr * EMU_BLOCK_SIZE, true),
+            3 * EMU_BLOCK_SIZE);
+  EXPECT_EQ(memcmp(buf, data + 5 * EMU_BLOCK_SIZE, EMU_BLOCK_SIZE), 0);
+  EXPECT_EQ(memcmp(buf + EMU_BLOCK_SIZE, data + 2 * EMU_BLOCK_SIZE,
+                   2 * EMU_BLOCK_SIZE),
+            0);
+
+  free(data);
+  free(buf);
+  delete zns;
+  unlink(path.c_str());
+  unlink((path + ".zones").c_str());
+}
+
+// concurrent appends to one zone land on distinct blocks
+TEST(ZoneBackendTest, 4_ZoneAppend) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZonedBlockDevice *zbd = new ZonedBlockDevice(device);
+  EXPECT_EQ(zbd->Open(false, true), OK());
+  Zone *zone = zbd->GetZone(1);
+  uint64_t start = zone->start_;
+
+  const int threads = 4;
+  const int nr = 16;
+  std::vector<uint64_t> placed(threads * nr);
+  std::vector<std::thread> writers;
+  for (int t = 0; t < threads; t++) {
+    writers.emplace_back([&, t] {
+      char *data = (char *)aligned_alloc(ZNS_PAGE_SIZE, ZNS_PAGE_SIZE);
+      for (int i = 0; i < nr; i++) {
+        memset(data, t * nr + i, ZNS_PAGE_SIZE);
+        EXPECT_EQ(zone->ZoneAppend(data, ZNS_PAGE_SIZE, &placed[t * nr + i]),
+                  OK());
+      }
+      free(data);
+    });
+  }
+  for (auto &th : writers) th.join();
+
+  std::vector<uint64_t> sorted(placed);
+  std::sort(sorted.begin(), sorted.end());
+  for (int i = 0; i < threads * nr; i++) {
+    EXPECT_EQ(sorted[i], start + i * ZNS_PAGE_SIZE);
+  }
+  EXPECT_EQ(zone->wp_, start + threads * nr * ZNS_PAGE_SIZE);
+
+  char *buf = (char *)aligned_alloc(ZNS_PAGE_SIZE, ZNS_PAGE_SIZE);
+  for (int i = 0; i < threads * nr; i++) {
+    EXPECT_EQ(zone->Read(buf, ZNS_PAGE_SIZE, placed[i]), OK());
+    EXPECT_EQ(buf[0], (char)i);
+    EXPECT_EQ(buf[ZNS_PAGE_SIZE - 1], (char)i);
+  }
+  free(buf);
+  delete zbd;
+}
+
+// zones are handed out within the active zone limit, leftovers go first
+TEST(ZoneBackendTest, 5_ZoneScheduler) {
+  std::string path = "emu_sched_test.zns";
+  std::string device = EMULATED_DEVICE_PREFIX + path;
+  unlink(path.c_str());
+  unlink((path + ".zones").c_str());
+  ZonedBlockDevice *zbd = new ZonedBlockDevice(device);
+  EXPECT_EQ(zbd->Open(false, true), OK());
+  uint32_t max_active = zbd->GetMaxActiveIOZones();
+  uint32_t free_zones = zbd->GetFreeZones();
+  EXPECT_EQ(max_active, EMU_MAX_ACTIVE_ZONES - ZENFS_META_ZONES);
+  EXPECT_EQ(free_zones, zbd->GetNrZones() - ZENFS_META_ZONES);
+
+  std::vector<Zone *> zones;
+  Zone *zone = nullptr;
+  while (zbd->AllocateEmptyZone(&zone) == OK() && zone != nullptr) {
+    zones.push_back(zone);
+  }
+  EXPECT_EQ(zones.size(), max_active);
+  EXPECT_EQ(zbd->GetActiveIOZones(), max_active);
+  EXPECT_EQ(zbd->GetFreeZones(), free_zones - max_active);
+
+  const uint32_t chunk = 1 * MB;
+  char *data = (char *)aligned_alloc(ZNS_PAGE_SIZE, chunk);
+  memset(data, 's', chunk);
+  // every zone handed out takes writes on the device
+  for (auto z : zones) {
+    EXPECT_EQ(z->Append(data, ZNS_PAGE_SIZE), OK());
+  }
+
+  // a finished zone makes room for one more
+  EXPECT_EQ(zones[0]->Finish(), OK());
+  EXPECT_EQ(zbd->GetActiveIOZones(), max_active - 1);
+  EXPECT_EQ(zbd->AllocateEmptyZone(&zone), OK());
+  ASSERT_NE(zone, nullptr);
+  EXPECT_EQ(zone->Append(data, ZNS_PAGE_SIZE), OK());
+  EXPECT_EQ(zbd->AllocateEmptyZone(&zone), OK());
+  EXPECT_EQ(zone, nullptr);
+
+  // a reset zone is free again
+  zones[0]->ClearValid();
+  EXPECT_EQ(zones[0]->Reset(), OK());
+  EXPECT_EQ(zbd->GetFreeZones(), free_zones - max_active);
+
+  // write more than half of a zone, it is finished at start up
+  uint64_t half = zones[1]->GetMaxCapacity() / 2;
+  for (uint64_t written = 0; written < half; written += chunk) {
+    EXPECT_EQ(zones[1]->Append(data, std::min<uint64_t>(chunk, half - written)),
+              OK());
+  }
+  uint64_t half_zone = zones[1]->GetZoneNr();
+  for (auto z : zones) z->Release();
+  free(data);
+  delete zbd;
+
+  zbd = new ZonedBlockDevice(device);
+  zbd->SetFinishThreshold(60);
+  EXPECT_EQ(zbd->Open(false, true), OK());
+  EXPECT_TRUE(zbd->GetZone(half_zone)->IsFull());
+  // the partially written zones are active, they are handed out first
+  uint32_t resumed = max_active - 1;
+  EXPECT_EQ(zbd->GetActiveIOZones(), resumed);
+  for (uint32_t i = 0; i < max_active; i++) {
+    EXPECT_EQ(zbd->AllocateEmptyZone(&zone), OK());
+    ASSERT_NE(zone, nullptr);
+    EXPECT_EQ(zone->IsEmpty(), i >= resumed);
+  }
+  EXPECT_EQ(zbd->AllocateEmptyZone(&zone), OK());
+  EXPECT_EQ(zone, nullptr);
+  EXPECT_EQ(zbd->GetActiveIOZones(), max_active);
+
+  delete zbd;
+  unlink(path.c_str());
+  unlink((path + ".zones").c_str());
+}
+
+// lookups see every key that stays while a writer churns the others
+TEST(PageTableTest, 1_ConcurrentReaders) {
+  PageTable<Page *> table(16);
+  Page pages[64];
+  const page_id_t stable = MAKE_PAGE_ID(1ULL, 0);
+  for (u64 i = 0; i < 64; i++) {
+    table.Insert(stable + i, &pages[i]);
+  }
+  std::atomic<bool> stop{false};
+  std::atomic<u64> misses{0};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&] {
+      while (!stop.load()) {
+        for (u64 i = 0; i < 64; i++) {
+          Page *page = nullptr;
+          if (!table.Find(stable + i, &page) || page != &pages[i]) misses++;
+        }
+      }
+    });
+  }
+  // the churn grows the table and shifts the stable keys around
+  for (u64 round = 0; round < 200; round++) {
+    for (u64 i = 0; i < 256; i++) {
+      table.Insert(MAKE_PAGE_ID(2ULL, round * 256 + i), &pages[0]);
+    }
+    for (u64 i = 0; i < 256; i++) {
+      EXPECT_TRUE(table.Erase(MAKE_PAGE_ID(2ULL, round * 256 + i)));
+    }
+  }
+  stop = true;
+  for (auto &reader : readers) reader.join();
+  EXPECT_EQ(misses.load(), 0);
+  EXPECT_EQ(table.Size(), 64);
+  EXPECT_FALSE(table.Find(MAKE_PAGE_ID(2ULL, 0)));
+  EXPECT_FALSE(table.Erase(MAKE_PAGE_ID(2ULL, 0)));
+
+  // counters added from many threads while the table grows
+  PageTable<u64> counts(16);
+  std::vector<std::thread> adders;
+  for (int t = 0; t < 4; t++) {
+    adders.emplace_back([&] {
+      for (u64 i = 0; i < 4096; i++) counts.Add(i % 1024, 1);
+    });
+  }
+  for (auto &adder : adders) adder.join();
+  u64 total = 0;
+  counts.ForEach([&](page_id_t, u64 count) {
+    EXPECT_EQ(count, 16);
+    total += count;
+  });
+  EXPECT_EQ(counts.Size(), 1024);
+  EXPECT_EQ(total, 4 * 4096);
+}
+
+static Page *NewCachedPage(page_id_t page_id) {
+  Page *page = PagePool::Grab();
+  page->page_id_ = page_id;
+  return page;
+}
+
+TEST(SieveTest, 1_HitsWithoutLock) {
+  // the hand skips the visited pages and takes the oldest other one
+  sieve_buffer cache(4);
+  for (u64 i = 1; i <= 4; i++) {
+    EXPECT_EQ(cache.evict_and_insert(i, NewCachedPage(i)), nullptr);
+  }
+  EXPECT_NE(cache.fetch(1), nullptr);
+  EXPECT_NE(cache.fetch(2), nullptr);
+  Page *victim = cache.evict_and_insert(5, NewCachedPage(5));
+#ifdef TINYLFU_ADMISSION
+  // 4 leaves the window, it was read no more often than 3
+  ASSERT_NE(victim, nullptr);
+  EXPECT_EQ(victim->GetPageId(), 4);
+  DESTROY_PAGE(victim);
+  EXPECT_NE(cache.fetch(5), nullptr);
+  EXPECT_NE(cache.fetch(5), nullptr);
+  victim = cache.evict_and_insert(6, NewCachedPage(6));
+#endif
+  ASSERT_NE(victim, nullptr);
+  EXPECT_EQ(victim->GetPageId(), 3);
+  DESTROY_PAGE(victim);
+  EXPECT_FALSE(cache.find(3));
+  EXPECT_EQ(cache.size(), 4);
+  // a second reader missed on a cached page, the first copy leaves
+  Page *first = cache.fetch(1);
+  Page *copy = NewCachedPage(1);
+  EXPECT_EQ(cache.evict_and_insert(1, copy), first);
+  EXPECT_EQ(cache.fetch(1), copy);
+  EXPECT_EQ(cache.size(), 4);
+  DESTROY_PAGE(first);
+
+  // readers of a few hot pages while a writer churns the rest
+  sieve_buffer shared(256);
+  const page_id_t hot = 64;
+  for (u64 i = 0; i < hot; i++) {
+    shared.evict_and_insert(i, NewCachedPage(i));
+  }
+  std::atomic<bool> stop{false};
+  std::atomic<u64> wrong{0};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&] {
+      while (!stop.load()) {
+        for (u64 i = 0; i < hot; i++) {
+          Page *page = shared.fetch(i);
+          if (page != nullptr && page->GetPageId() != i) wrong++;
+        }
+      }
+    });
+  }
+  // a reader may still look at an evicted page, the buffer pins against that
+  std::vector<Page *> evicted;
+  for (u64 i = hot; i < hot + 8192; i++) {
+    Page *page = shared.evict_and_insert(i, NewCachedPage(i));
+    if (page != nullptr) evicted.push_back(page);
+    if (i % 2 && (page = shared.evict(i - 1)) != nullptr) {
+      evicted.push_back(page);
+    }
+  }
+  stop = true;
+  for (auto &reader : readers) reader.join();
+  EXPECT_EQ(wrong.load(), 0);
+  EXPECT_LE(shared.size(), 256);
+  for (auto page : evicted) {
+    DESTROY_PAGE(page);
+  }
+}
+
+// pages read once by a scan do not push out the pages read again and again
+TEST(SieveTest, 2_ScanResistance) {
+#ifdef TINYLFU_ADMISSION
+  sieve_buffer cache(64);
+  const page_id_t hot = 32;
+  for (u64 i = 0; i < hot; i++) {
+    EXPECT_EQ(cache.evict_and_insert(i, NewCachedPage(i)), nullptr);
+  }
+  for (int round = 0; round < 4; round++) {
+    for (u64 i = 0; i < hot; i++) {
+      EXPECT_NE(cache.fetch(i), nullptr);
+    }
+  }
+  for (u64 i = hot; i < hot + 1024; i++) {
+    Page *victim = cache.evict_and_insert(i, NewCachedPage(i));
+    if (victim != nullptr) {
+      EXPECT_GE(victim->GetPageId(), hot);
+      DESTROY_PAGE(victim);
+    }
+  }
+  for (u64 i = 0; i < hot; i++) {
+    EXPECT_TRUE(cache.find(i));
+  }
+  EXPECT_EQ(cache.size(), 64);
+#endif
+}
+
+TEST(PagePoolTest, 1_RecycleFrames) {
+  Page *page = PagePool::Grab();
+  ASSERT_NE(page, nullptr);
+  EXPECT_EQ((uintptr_t)page->GetData() % PAGE_SIZE, 0);
+  char *data = page->GetData();
+  page->page_id_ = 7;
+  page->Pin();
+  DESTROY_PAGE(page);
+  // the frame comes back with a fresh descriptor
+  page = PagePool::Grab();
+  EXPECT_EQ(page->GetData(), data);
+  EXPECT_EQ(page->GetPageId(), INVALID_PAGE_ID);
+  EXPECT_EQ(page->GetPinCount(), 0);
+  DESTROY_PAGE(page);
+
+  // pages grabbed by short lived threads and released by this one are
+  // reused instead of carved again
+  u64 carved = PagePool::GetCarvedPages();
+  for (int round = 0; round < 16; round++) {
+    std::vector<Page *> pages;
+    std::thread([&] {
+      for (int i = 0; i < 256; i++) pages.push_back(PagePool::Grab());
+    }).join();
+    for (auto p : pages) {
+      ASSERT_NE(p, nullptr);
+      DESTROY_PAGE(p);
+    }
+  }
+  EXPECT_LE(PagePool::GetCarvedPages() - carved, 2 * PAGE_POOL_SLAB_PAGES);
+}
+
+// a retired page outlives the readers that entered an epoch before
+TEST(EpochTest, 1_GracePeriod) {
+  static std::atomic<int> freed{0};
+  std::atomic<int> step{0};
+  std::thread reader([&] {
+    EpochGuard guard;
+    step = 1;
+    while (step.load() != 2) std::this_thread::yield();
+  });
+  while (step.load() != 1) std::this_thread::yield();
+
+  int object = 0;
+  Epoch::Retire(&object, [](void *) { freed++; });
+  Page *page = PagePool::Grab();
+  Epoch::Retire(page);
+  u64 retired = Epoch::GetRetiredPages();
+  for (int i = 0; i < 8; i++) Epoch::Reclaim();
+  EXPECT_EQ(freed.load(), 0);
+  EXPECT_GE(Epoch::GetRetiredPages(), 2u);
+
+  step = 2;
+  reader.join();
+  for (int i = 0; i < 8; i++) Epoch::Reclaim();
+  EXPECT_EQ(freed.load(), 1);
+  // the page went back to the pool with the object
+  EXPECT_LE(Epoch::GetRetiredPages(), retired - 2);
+}
+
+// the tree comes back from the leaves on the device, without a snapshot
+TEST(RecoveryTest, 1_RestartFromZones) {
+  std::string path = "emu_recovery_test.zns";
+  std::string device = EMULATED_DEVICE_PREFIX + path;
+  unlink(path.c_str());
+  unlink((path + ".zones").c_str());
+  const u64 nums = 100000;
+  std::vector<u64> keys(nums);
+  std::iota(keys.begin(), keys.end(), 1);
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(7));
+
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  btreeolc::BTree *tree = new btreeolc::BTree(zmp);
+  for (auto k : keys) tree->Insert(k, k);
+  // rewrite a part, the stale copies stay on the device
+  for (u64 k = 1; k <= nums; k += 3) tree->Insert(k, k * 2);
+  zmp->FlushAllPages();
+  delete tree;
+  delete zmp;
+
+  zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE, MAX_NUMS_ZONE,
+                            device.c_str());
+  tree = new btreeolc::BTree(zmp, true);
+  auto rewritten = [](u64 k) { return (k - 1) % 3 == 0 ? k * 2 : k; };
+  for (u64 k = 1; k <= nums; k++) {
+    u64 v = 0;
+    ASSERT_TRUE(tree->Get(k, v)) << k;
+    EXPECT_EQ(v, rewritten(k));
+  }
+  u64 out[100];
+  EXPECT_EQ(tree->Scan(nums - 49, 100, out), 50);
+  EXPECT_EQ(out[49], rewritten(nums));
+  // the recovered tree takes writes, they win at the next restart
+  for (u64 k = nums + 1; k <= nums + 1000; k++) tree->Insert(k, k);
+  for (u64 k = 2; k <= nums; k += 3) tree->Insert(k, k * 5);
+  zmp->FlushAllPages();
+  delete tree;
+  delete zmp;
+
+  zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE, MAX_NUMS_ZONE,
+                            device.c_str());
+  tree = new btreeolc::BTree(zmp, true);
+  for (u64 k = 1; k <= nums + 1000; k++) {
+    u64 v = 0;
+    ASSERT_TRUE(tree->Get(k, v)) << k;
+    if (k > nums) {
+      EXPECT_EQ(v, k);
+    } else {
+      EXPECT_EQ(v, k % 3 == 2 ? k * 5 : rewritten(k));
+    }
+  }
+  delete tree;
+  delete zmp;
+  unlink(path.c_str());
+  unlink((path + ".zones").c_str());
+}
+
+// deletes merge the leaves, their pages turn into garbage and the merged
+// ranges win at restart
+TEST(RemoveTest, 1_MergeLeaves) {
+  std::string path = "emu_remove_test.zns";
+  std::string device = EMULATED_DEVICE_PREFIX + path;
+  unlink(path.c_str());
+  unlink((path + ".zones").c_str());
+  const u64 nums = 100000;
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  btreeolc::BTree *tree = new btreeolc::BTree(zmp);
+  for (u64 k = 1; k <= nums; k++) tree->Insert(k, k);
+  zmp->FlushAllPages();
+  SpaceStats before;
+  zmp->GetSpaceStats(&before);
+
+  for (u64 k = 1; k <= nums; k += 2) EXPECT_TRUE(tree->Remove(k)) << k;
+  EXPECT_FALSE(tree->Remove(1));
+  EXPECT_FALSE(tree->Remove(nums + 1));
+  // keep every 16th key, a batch spans many leaves
+  std::vector<u64> batch;
+  for (u64 k = 2; k <= nums; k += 2) {
+    if (k % 16 != 0) batch.push_back(k);
+  }
+  batch.push_back(batch.back());
+  EXPECT_EQ(tree->BatchRemove(batch.data(), batch.size()), batch.size() - 1);
+  EXPECT_EQ(tree->BatchRemove(batch.data(), batch.size()), 0);
+
+  auto kept = [](u64 k) { return k % 16 == 0; };
+  for (u64 k = 1; k <= nums; k++) {
+    u64 v = 0;
+    ASSERT_EQ(tree->Get(k, v), kept(k)) << k;
+    if (kept(k)) {
+      EXPECT_EQ(v, k);
+    }
+  }
+  u64 out[10];
+  ASSERT_EQ(tree->Scan(16, 10, out), 10);
+  for (int i = 0; i < 10; i++) EXPECT_EQ(out[i], 16 * (i + 1));
+  zmp->FlushAllPages();
+  SpaceStats after;
+  zmp->GetSpaceStats(&after);
+  EXPECT_LT(after.valid_pages * 4, before.valid_pages);
+  delete tree;
+  delete zmp;
+
+  zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE, MAX_NUMS_ZONE,
+                            device.c_str());
+  tree = new btreeolc::BTree(zmp, true);
+  for (u64 k = 1; k <= nums; k++) {
+    u64 v = 0;
+    ASSERT_EQ(tree->Get(k, v), kept(k)) << k;
+  }
+  delete tree;
+  delete zmp;
+  unlink(path.c_str());
+  unlink((path + ".zones").c_str());
+}
+
+// readers never miss a key while other threads delete and merge around it
+TEST(RemoveTest, 2_ConcurrentRemove) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  btreeolc::BTree *tree = new btreeolc::BTree(zmp);
+  const u64 nums = 100000;
+  const u64 threads = 4;
+  for (u64 k = 1; k <= nums; k++) tree->Insert(k, k);
+
+  std::atomic<u64> missed{0};
+  std::vector<std::thread> workers;
+  for (u64 t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      for (u64 k = 1 + t; k <= nums; k += threads) {
+        if (k % 32 == 0) continue;
+        if (!tree->Remove(k)) missed++;
+      }
+    });
+    workers.emplace_back([&, t] {
+      std::mt19937 g(t);
+      std::uniform_int_distribution<u64> dist(1, nums / 32);
+      for (int i = 0; i < 100000; i++) {
+        u64 v = 0;
+        u64 k = dist(g) * 32;
+        if (!tree->Get(k, v) || v != k) missed++;
+      }
+    });
+  }
+  for (auto &worker : workers) worker.join();
+  EXPECT_EQ(missed.load(), 0);
+  for (u64 k = 1; k <= nums; k++) {
+    u64 v = 0;
+    ASSERT_EQ(tree->Get(k, v), k % 32 == 0) << k;
+  }
+  delete tree;
+  delete zmp;
+}
+
+// deletes are buffered as tombstones and reach the device tree with the batches
+TEST(RemoveTest, 3_BufferedTombstones) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  btreeolc::BTree *tree = new btreeolc::BTree(zmp);
+  auto *zbtree = new btreeolc::ZBTree<u64, u64>(tree);
+  const u64 nums = 200000;
+  for (u64 k = 1; k <= nums; k++) zbtree->Insert(k, k);
+  zbtree->FlushAll();
+  // the tombstones fill the buffer several times over
+  for (u64 k = 1; k <= nums; k += 2) zbtree->Remove(k);
+  for (u64 k = 1; k <= nums; k++) {
+    u64 v = 0;
+    ASSERT_EQ(zbtree->Get(k, v), k % 2 == 0) << k;
+  }
+  u64 out[10];
+  ASSERT_EQ(zbtree->Scan(1, 10, out), 10);
+  for (int i = 0; i < 10; i++) EXPECT_EQ(out[i], 2 * (i + 1));
+  ASSERT_EQ(zbtree->Scan(nums - 3, 10, out), 2);
+  EXPECT_EQ(out[1], nums);
+
+  zbtree->FlushAll();
+  for (u64 k = 1; k <= nums; k++) {
+    u64 v = 0;
+    ASSERT_EQ(tree->Get(k, v), k % 2 == 0) << k;
+  }
+  zbtree->Insert(1, 1);
+  u64 v = 0;
+  EXPECT_TRUE(zbtree->Get(1, v));
+  EXPECT_EQ(v, 1);
+  delete zbtree;
+  delete tree;
+  delete zmp;
+}
+
+// a scan goes on under the next inner node and never sees a leaf half written
+TEST(ScanTest, 1_AcrossInnerNodes) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  btreeolc::BTree *tree = new btreeolc::BTree(zmp);
+  const u64 nums = 100000;
+  u64 out[nums];
+  u64 keys[nums];
+  EXPECT_EQ(tree->Scan(1, 10, out, keys), 0);
+  for (u64 k = 2; k <= 2 * nums; k += 2) tree->Insert(k, k);
+  ASSERT_EQ(tree->Scan(1, nums, out, keys), nums);
+  for (u64 i = 0; i < nums; i++) {
+    ASSERT_EQ(keys[i], 2 * (i + 1));
+    ASSERT_EQ(out[i], 2 * (i + 1));
+  }
+
+  // the odd keys split the leaves under the scans, the even keys stay
+  std::atomic<u64> broken{0};
+  std::vector<std::thread> workers;
+  workers.emplace_back([&] {
+    for (u64 k = 1; k < 2 * nums; k += 2) tree->Insert(k, k);
+  });
+  for (int t = 0; t < 2; t++) {
+    workers.emplace_back([&, t] {
+      std::mt19937 g(t);
+      std::uniform_int_distribution<u64> dist(1, nums);
+      std::vector<u64> out(5000), keys(5000);
+      for (int i = 0; i < 200; i++) {
+        u64 n = tree->Scan(dist(g), 5000, out.data(), keys.data());
+        for (u64 j = 1; j < n; j++) {
+          if (keys[j] <= keys[j - 1] || keys[j] - keys[j - 1] > 2) broken++;
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) worker.join();
+  EXPECT_EQ(broken.load(), 0);
+  delete tree;
+  delete zmp;
+
+  // the buffer tree of the ZBTree the same way
+  zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE, MAX_NUMS_ZONE,
+                            device.c_str());
+  tree = new btreeolc::BTree(zmp);
+  auto *zbtree = new btreeolc::ZBTree<u64, u64>(tree);
+  const u64 buffered = 40000;
+  for (u64 k = 1; k <= buffered; k++) zbtree->Insert(k, k);
+  ASSERT_EQ(zbtree->Scan(1, buffered, out), buffered);
+  for (u64 i = 0; i < buffered; i++) ASSERT_EQ(out[i], i + 1);
+  delete zbtree;
+  delete tree;
+  delete zmp;
+}
+
+// the newest copy of a key wins the merge, values need not equal the keys
+TEST(ScanTest, 2_MergeSources) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  btreeolc::BTree *tree = new btreeolc::BTree(zmp);
+  auto *zbtree = new btreeolc::ZBTree<u64, u64>(tree);
+  const u64 nums = 100000;
+  for (u64 k = 1; k <= nums; k++) zbtree->Insert(k, k * 10);
+  zbtree->FlushAll();
+  for (u64 k = 3; k <= nums; k += 3) zbtree->Insert(k, k * 10 + 1);
+  for (u64 k = 5; k <= nums; k += 5) zbtree->Remove(k);
+
+  const int range = 3 * SCAN_CHUNK + 7;
+  u64 out[range];
+  u64 keys[range];
+  u64 from = nums / 2;
+  ASSERT_EQ(zbtree->Scan(from, range, out, keys), range);
+  u64 k = from;
+  for (int i = 0; i < range; i++, k++) {
+    if (k % 5 == 0) k++;
+    ASSERT_EQ(keys[i], k);
+    EXPECT_EQ(out[i], k % 3 == 0 ? k * 10 + 1 : k * 10) << k;
+  }
+  // the end of the key space
+  EXPECT_EQ(zbtree->Scan(nums - 2, range, out, keys), 2);
+  EXPECT_EQ(keys[1], nums - 1);
+  delete zbtree;
+  delete tree;
+  delete zmp;
+}
+
+// the flushes of a writer move the entries and the tombstones to the older
+// sources while the scans run, a scan neither skips nor brings back a key
+TEST(ScanTest, 3_ScanDuringFlush) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  btreeolc::BTree *tree = new btreeolc::BTree(zmp);
+  auto *zbtree = new btreeolc::ZBTree<u64, u64>(tree);
+  const u64 nums = 100000;
+  for (u64 k = 1; k <= nums; k++) zbtree->Insert(k, k * 1000);
+  zbtree->FlushAll();
+  // the tombstones still hide the values on the device
+  for (u64 k = 5; k <= nums; k += 5) zbtree->Remove(k);
+
+  std::atomic<bool> stop{false};
+  std::thread writer([&]() {
+    for (u64 round = 1; round <= 3; round++) {
+      for (u64 k = 1; k <= nums; k++) {
+        if (k % 5 != 0) zbtree->Insert(k, k * 1000 + round);
+      }
+    }
+    stop = true;
+  });
+  const int range = 3 * SCAN_CHUNK + 7;
+  u64 out[range];
+  u64 keys[range];
+  std::mt19937 g(1024);
+  std::uniform_int_distribution<u64> dist(1, nums - 2 * range);
+  u64 scans = 0;
+  while (!stop || scans == 0) {
+    u64 k = dist(g);
+    ASSERT_EQ(zbtree->Scan(k, range, out, keys), range);
+    for (int i = 0; i < range; i++, k++) {
+      if (k % 5 == 0) k++;
+      ASSERT_EQ(keys[i], k);
+      EXPECT_EQ(out[i] / 1000, k);
+    }
+    scans++;
+  }
+  writer.join();
+  delete zbtree;
+  delete tree;
+  delete zmp;
+}
+
+// copy-on-write updates write more than the device holds
+TEST(ZoneGCTest, 1_UpdateBeyondDevice) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  btreeolc::BTree *btree = new btreeolc::BTree(zmp);
+  u64 device_bytes = (u64)EMU_NR_ZONES * EMU_ZONE_SIZE_MB * 1024 * 1024;
+
+  int key_nums = 200000;
+  std::vector<u64> keys(key_nums);
+  std::iota(keys.begin(), keys.end(), 1);
+  for (const auto &key : keys) {
+    btree->Insert(key, key);
+  }
+
+  std::mt19937 g(1024);
+  std::uniform_int_distribution<u64> dist(1, key_nums);
+  u64 updates = 2 * device_bytes / PAGE_SIZE;
+  for (u64 i = 0; i < updates; i++) {
+    u64 key = dist(g);
+    EXPECT_FALSE(btree->Insert(key, key + i));
+    keys[key - 1] = key + i;
+  }
+
+  for (int i = 0; i < key_nums; i++) {
+    ValueType value = -1;
+    EXPECT_TRUE(btree->Get(i + 1, value));
+    EXPECT_EQ(keys[i], value);
+  }
+  EXPECT_GT(zmp->cleaner_->GetCollectedZones(), 0);
+
+  SpaceStats total;
+  zmp->GetSpaceStats(&total);
+  EXPECT_GT(total.valid_pages, 0);
+  EXPECT_GT(total.invalid_pages, 0);
+  EXPECT_LT(total.valid_pages * PAGE_SIZE, device_bytes);
+  EXPECT_LT(total.live_ratio, 1.0);
+
+  delete btree;
+  delete zmp;
+}
+
+// a rewritten page moves to the zone buffers of its temperature
+TEST(ZoneGCTest, 2_HotColdPlacement) {
+  EXPECT_EQ(HeatToTemperature(0), 0);
+  EXPECT_EQ(HeatToTemperature(HOT_LEAF_HEAT - 1), 0);
+  EXPECT_EQ(HeatToTemperature(UINT32_MAX), NR_TEMPERATURES - 1);
+
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  u32 hot = NR_TEMPERATURES - 1;
+  page_id_t page_id = INVALID_PAGE_ID;
+  Page *page = zmp->NewPage(&page_id, 1, 0);
+  ASSERT_NE(page, nullptr);
+  EXPECT_EQ(zmp->GetZone(page_id)->temperature_, 0);
+  memset(page->GetData(), 'c', PAGE_SIZE);
+  zmp->UnpinPage(page_id, true);
+
+  // still in the FIFO, rewritten in place
+  page_id_t same = page_id;
+  page = zmp->UpdatePage(&same, hot);
+  EXPECT_EQ(same, page_id);
+  zmp->UnpinPage(same, true);
+
+  zmp->FlushAllPages();
+  page_id_t old_page_id = zmp->ResolvePageId(page_id);
+  page = zmp->UpdatePage(&page_id, hot);
+  ASSERT_NE(page, nullptr);
+  EXPECT_NE(page_id, old_page_id);
+  EXPECT_EQ(zmp->GetZone(page_id)->temperature_, hot);
+  EXPECT_EQ(page->GetData()[0], 'c');
+  EXPECT_EQ(page->GetData()[PAGE_SIZE - 1], 'c');
+  zmp->UnpinPage(page_id, true);
+  Zone *zone = zmp->LookupZone(GET_ZONE_ID(old_page_id));
+  EXPECT_FALSE(zone->IsValid(GET_ZONE_OFFSET(old_page_id) * PAGE_SIZE));
+
+  delete zmp;
+}
+
+// pages handed to the flusher are read from memory until they are written
+TEST(FlushTest, 1_StagedPagesStayReadable) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  const u64 nums = 4096;
+  std::vector<page_id_t> page_ids(nums);
+  std::atomic<u64> written{0};
+  std::atomic<u64> wrong{0};
+  auto fill = [](u64 i) { return (char)(i % 251 + 1); };
+  std::thread reader([&] {
+    std::mt19937 g(3);
+    while (written.load() < nums) {
+      u64 n = written.load();
+      if (n == 0) continue;
+      u64 i = g() % n;
+      Page *page = zmp->FetchPage(page_ids[i]);
+      if (page->GetData()[0] != fill(i) ||
+          page->GetData()[PAGE_SIZE - 1] != fill(i)) {
+        wrong++;
+      }
+      zmp->UnpinPage(page_ids[i], false);
+    }
+  });
+  for (u64 i = 0; i < nums; i++) {
+    Page *page = zmp->NewPage(&page_ids[i], 1, 0);
+    ASSERT_NE(page, nullptr);
+    memset(page->GetData(), fill(i), PAGE_SIZE);
+    zmp->UnpinPage(page_ids[i], true);
+    written++;
+  }
+  reader.join();
+  EXPECT_EQ(wrong.load(), 0);
+
+  zmp->FlushAllPages();
+  for (auto zbf : zmp->zone_buffers_) {
+    EXPECT_EQ(zbf->page_table_.Size(), 0);
+  }
+  for (u64 i = 0; i < nums; i++) {
+    Page *page = zmp->FetchPage(page_ids[i]);
+    EXPECT_EQ(page->GetData()[0], fill(i));
+    zmp->UnpinPage(page_ids[i], false);
+  }
+  delete zmp;
+}
+
+TEST(FlushTest, 2_BatchSize) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  ZoneManager *zbf = zmp->zone_buffers_[0];
+  EXPECT_EQ(zbf->GetBatchSize(), BATCH_SIZE);
+  zmp->SetBatchSize(1 << 20);
+  EXPECT_EQ(zbf->GetBatchSize(), MAX_BATCH_SIZE);
+  // batches larger than the FIFO of a zone buffer
+  zmp->SetBatchSize(4 * MAX_CACHED_PAGES_PER_ZONE);
+  EXPECT_EQ(zbf->GetBatchSize(), 4 * MAX_CACHED_PAGES_PER_ZONE);
+
+  const u64 nums = 4096;
+  std::vector<page_id_t> page_ids(nums);
+  auto write = [&](u64 begin, u64 end) {
+    for (u64 i = begin; i < end; i++) {
+      Page *page = zmp->NewPage(&page_ids[i], 1, 0);
+      ASSERT_NE(page, nullptr);
+      memset(page->GetData(), (char)(i % 251 + 1), PAGE_SIZE);
+      zmp->UnpinPage(page_ids[i], true);
+    }
+  };
+  write(0, nums / 2);
+  // tuned while writing, never beyond a sixteenth of a zone
+  zmp->SetBatchSize(AUTO_BATCH_SIZE);
+  u64 zone_pages = EMU_ZONE_SIZE_MB * 1024 * 1024 / PAGE_SIZE;
+  write(nums / 2, nums);
+  EXPECT_GE(zbf->GetBatchSize(), 1);
+  EXPECT_LE(zbf->GetBatchSize(), std::max<u64>(zone_pages / 16, 1));
+
+  zmp->FlushAllPages();
+  for (u64 i = 0; i < nums; i++) {
+    Page *page = zmp->FetchPage(page_ids[i]);
+    EXPECT_EQ(page->GetData()[PAGE_SIZE - 1], (char)(i % 251 + 1));
+    zmp->UnpinPage(page_ids[i], false);
+  }
+  delete zmp;
+}
+
+// writers switch the zones of two zone buffers while they look up the zone
+// table, every page id is given out once and maps to its zone buffer
+TEST(ZoneSwitchTest, 1_ConcurrentPageIds) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZoneManagerPool *zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE,
+                                             MAX_NUMS_ZONE, device.c_str());
+  const int nr_threads = 4;
+  // a zone buffer fills about six zones
+  const u64 nums = 768;
+  // the page id of every write, the data names the write
+  std::vector<page_id_t> page_ids(nr_threads * nums);
+  std::vector<std::thread> writers;
+  for (int t = 0; t < nr_threads; t++) {
+    writers.emplace_back([&, t]() {
+      alignas(PAGE_SIZE) char data[PAGE_SIZE] = {};
+      for (u64 i = 0; i < nums; i++) {
+        u32 index = (t + i) % 2;
+        u64 write = t * nums + i;
+        memcpy(data, &write, sizeof(write));
+        page_id_t page_id = INVALID_PAGE_ID;
+        Page *page = zmp->zone_buffers_[index]->NewPage(&page_id, 1, false,
+                                                        data);
+        ASSERT_NE(page, nullptr);
+        // the zone is mapped before its first page id is out
+        ASSERT_EQ(zmp->BufferIndex(GET_ZONE_ID(page_id)), index);
+        zmp->UnpinPage(page_id, true);
+        page_ids[write] = page_id;
+      }
+    });
+  }
+  for (auto &writer : writers) writer.join();
+  zmp->FlushAllPages();
+
+  std::vector<page_id_t> sorted = page_ids;
+  std::sort(sorted.begin(), sorted.end());
+  EXPECT_EQ(std::adjacent_find(sorted.begin(), sorted.end()), sorted.end());
+  for (u64 write = 0; write < page_ids.size(); write++) {
+    page_id_t page_id = page_ids[write];
+    EXPECT_EQ(zmp->BufferIndex(GET_ZONE_ID(page_id)),
+              (write / nums + write % nums) % 2);
+#ifndef ZONE_APPEND
+    Zone *zone = zmp->LookupZone(GET_ZONE_ID(page_id));
+    u64 offset = GET_ZONE_OFFSET(page_id) * PAGE_SIZE;
+    EXPECT_GE(offset, zone->start_);
+    EXPECT_LT(offset, zone->start_ + zone->GetMaxCapacity());
+#endif
+    Page *page = zmp->FetchPage(page_id);
+    ASSERT_NE(page, nullptr);
+    u64 stored = 0;
+    memcpy(&stored, page->GetData(), sizeof(stored));
+    EXPECT_EQ(stored, write);
+    zmp->UnpinPage(page_id, false);
+  }
+  delete zmp;
+}
+
+// reads missing the cache of one zone buffer move the budget to it
+TEST(GovernorTest, 1_ReadCacheGrows) {
+  std::string device = EMULATED_DEVICE_PREFIX EMULATED_MEMORY_DEVICE;
+  ZoneManagerPool *zmp =
+      new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE, MAX_NUMS_ZONE,
+                          device.c_str(), 2 * 1024 * 1024);
+  MemoryGovernor &governor = zmp->governor_;
+  auto total = [&]() {
+    u64 pages = 0;
+    for (u32 i = 0; i < zmp->num_instances_; i++) {
+      pages += governor.GetCapacity(i, FIFO_PART) +
+               governor.GetCapacity(i, READ_CACHE_PART);
+    }
+    return pages;
+  };
+  EXPECT_LE(governor.GetBudget(), 2 * 1024 * 1024 / PAGE_SIZE);
+  EXPECT_EQ(total(), governor.GetBudget());
+
+  const u64 nums = 4096;
+  std::vector<page_id_t> page_ids(nums);
+  for (u64 i = 0; i < nums; i++) {
+    Page *page = zmp->NewPage(&page_ids[i], 1, 0);
+    ASSERT_NE(page, nullptr);
+    memset(page->GetData(), (char)(i % 251 + 1), PAGE_SIZE);
+    zmp->UnpinPage(page_ids[i], true);
+  }
+  zmp->FlushAllPages();
+
+  // loop over more pages of buffer 0 than its read cache holds
+  ZoneManager *hot = zmp->zone_buffers_[0];
+#ifdef ADAPTIVE_BUFFER_SPLIT
+  u64 before = governor.GetCapacity(0, READ_CACHE_PART);
+#endif
+  for (int round = 0; round < 4; round++) {
+    for (u64 i = 0; i < nums; i++) {
+      if (zmp->GetZone(page_ids[i]) != hot) continue;
+      Page *page = zmp->FetchPage(page_ids[i]);
+      ASSERT_NE(page, nullptr);
+      EXPECT_EQ(page->GetData()[0], (char)(i % 251 + 1));
+      zmp->UnpinPage(page_ids[i], false);
+    }
+  }
+#ifdef ADAPTIVE_BUFFER_SPLIT
+  EXPECT_GT(governor.GetCapacity(0, READ_CACHE_PART), before);
+  EXPECT_LE(governor.GetCapacity(0, READ_CACHE_PART),
+            governor.GetMaxCapacity(READ_CACHE_PART));
+#ifdef USE_LRU_BUFFER
+  EXPECT_EQ(hot->lru_buffer_.capacity(),
+            governor.GetCapacity(0, READ_CACHE_PART));
+#else
+  EXPECT_EQ(hot->sieve_.capacity(), governor.GetCapacity(0, READ_CACHE_PART));
+#endif
+#endif
+  EXPECT_EQ(total(), governor.GetBudget());
+  delete zmp;
+}
+
+// a pool striped over two devices writes to both and restarts from both
+TEST(StripingTest, 1_TwoDevices) {
+  std::string paths[2] = {"emu_stripe_test0.zns", "emu_stripe_test1.zns"};
+  std::string devices;
+  for (auto &path : paths) {
+    unlink(path.c_str());
+    unlink((path + ".zones").c_str());
+    if (!devices.empty()) devices += ",";
+    devices += EMULATED_DEVICE_PREFIX + path;
+  }
+  // the FIFOs may grow into the whole budget, less than the leaves
+  ZoneManagerPool *zmp =
+      new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE, MAX_NUMS_ZONE,
+                          devices.c_str(), 2 * 1024 * 1024);
+  ASSERT_EQ(zmp->GetNrDevices(), 2);
+  u32 on_device[2] = {0, 0};
+  for (auto zbf : zmp->zone_buffers_) {
+    on_device[GET_DEVICE_ID(zbf->zone_id_)]++;
+  }
+  EXPECT_EQ(on_device[0], on_device[1]);
+
+  btreeolc::BTree *tree = new btreeolc::BTree(zmp);
+  u64 device_bytes = (u64)EMU_NR_ZONES * EMU_ZONE_SIZE_MB * 1024 * 1024;
+  const u64 nums = 100000;
+  std::vector<u64> values(nums + 1);
+  for (u64 k = 1; k <= nums; k++) {
+    tree->Insert(k, k);
+    values[k] = k;
+  }
+  // more than both devices hold, their zones get collected
+  std::mt19937 g(9);
+  std::uniform_int_distribution<u64> dist(1, nums);
+  for (u64 i = 0; i < 4 * device_bytes / PAGE_SIZE; i++) {
+    u64 k = dist(g);
+    tree->Insert(k, k + i);
+    values[k] = k + i;
+  }
+  EXPECT_GT(zmp->cleaner_->GetCollectedZones(), 0);
+  SpaceStats total;
+  std::vector<SpaceStats> zones;
+  zmp->GetSpaceStats(&total, &zones);
+  u64 valid[2] = {0, 0};
+  for (auto &stats : zones) {
+    valid[GET_DEVICE_ID(stats.zone_id)] += stats.valid_pages;
+  }
+  EXPECT_GT(valid[0], 0);
+  EXPECT_GT(valid[1], 0);
+  zmp->FlushAllPages();
+  delete tree;
+  delete zmp;
+
+  zmp = new ZoneManagerPool(MAX_CACHED_PAGES_PER_ZONE, MAX_NUMS_ZONE,
+                            devices.c_str());
+  tree = new btreeolc::BTree(zmp, true);
+  for (u64 k = 1; k <= nums; k++) {
+    u64 v = 0;
+    ASSERT_TRUE(tree->Get(k, v)) << k;
+    EXPECT_EQ(v, values[k]);
+  }
+  delete tree;
+  delete zmp;
+  for (auto &path : paths) {
+    unlink(path.c_str());
+    unlink((path + ".zones").c_str());
+  }
+}
+
+// the device and the provisional flag do not take bits from the zone number
+TEST(StripingTest, 2_PageIdBits) {
+  const u64 last_zone = (1ULL << ZONE_NR_BITS) - 1;
+  const u64 last_offset = (1ULL << ZONE_OFFSET_BITS) - 1;
+  for (u64 device = 0; device < MAX_NR_DEVICES; device++) {
+    for (u64 zone_nr : {u64(0), u64(4096), last_zone}) {
+      zns_id_t zid = MAKE_ZONE_ID(device, zone_nr);
+      for (u64 offset : {u64(0), u64(12345), last_offset}) {
+        page_id_t page_id = MAKE_PAGE_ID(zid, offset);
+        EXPECT_NE(page_id, INVALID_PAGE_ID);
+        EXPECT_EQ(GET_ZONE_ID(page_id), zid);
+        EXPECT_EQ(GET_ZONE_OFFSET(page_id), offset);
+        EXPECT_EQ(GET_DEVICE_ID(GET_ZONE_ID(page_id)), device);
+        EXPECT_EQ(GET_ZONE_NR(GET_ZONE_ID(page_id)), zone_nr);
+        EXPECT_FALSE(IS_PROVISIONAL(page_id));
+      }
+    }
+  }
+  page_id_t provisional = MAKE_PAGE_ID(PROVISIONAL_ZONE_BASE + 3, 7);
+  EXPECT_TRUE(IS_PROVISIONAL(provisional));
+  EXPECT_EQ(GET_ZONE_ID(provisional), PROVISIONAL_ZONE_BASE + 3);
+  EXPECT_EQ(GET_ZONE_OFFSET(provisional), 7u);
+}
+
 // Sequential insert
 TEST(BTreeCRUDTest1, 1_InsertSeq) {
   DiskManager *disk = new DiskManager(FILE_NAME.c_str());
@@ -1,5 +1,10 @@
 #include "buffer.h"
 
+#include <chrono>
+#include <thread>  // NOLINT
+
+#include "zone_gc.h"
+
 BufferPoolManager::BufferPoolManager(size_t pool_size,
                                      DiskManager* disk_manager)
     : BufferPoolManager(pool_size, 1, 0, disk_manager) {
@@ -604,7 +609,8 @@ FIFOBatchReplacer::~FIFOBatchReplacer() {
 }
 
 bool FIFOBatchReplacer::Add(frame_id_t frame_id, u32 length, char* data) {
-  if (cur_size_ == max_size_) {
+  // the governor may have shrunk it below its size
+  if (cur_size_ >= max_size_) {
     return false;
   }
   Item* item = new Item(frame_id, length, data);
@@ -618,7 +624,7 @@ bool FIFOBatchReplacer::Add(frame_id_t frame_id, u32 length, char* data) {
   return true;
 };
 
-bool FIFOBatchReplacer::IsFull() { return cur_size_ == max_size_; }
+bool FIFOBatchReplacer::IsFull() { return cur_size_ >= max_size_; }
 
 bool FIFOBatchReplacer::Victim(Item** item) {
   if (cur_size_ == 0) {
@@ -655,7 +661,8 @@ void FIFOBatchReplacer::Print() {
 
 ZoneManager::ZoneManager(Zone* zone, u64 max_size)
     : zone_(zone),
-      zone_id_(zone->GetZoneNr())
+      zone_id_(GetZoneId(zone)),
+      page_table_(2 * (max_size + BATCH_SIZE * MAX_INFLIGHT_BATCHES))
 #ifdef USE_LRU_BUFFER
       ,
       lru_buffer_(LRU_BUFFER_SIZE)
@@ -679,6 +686,9 @@ ZoneManager::ZoneManager(Zone* zone, u64 max_size)
   // flusher_ = nullptr;
   rw_lock_ = new ReaderWriterLatch();
   read_cache_ = nullptr;
+#ifndef ZONE_APPEND
+  flush_thread_ = std::thread(&ZoneManager::FlushLoop, this);
+#endif
 }
 ZoneManager::~ZoneManager() {
   /*
@@ -687,154 +697,466 @@ ZoneManager::~ZoneManager() {
    * Description: todo 将未下刷的数据下刷
    */
   FlushAllPages();
+#ifndef ZONE_APPEND
+  {
+    std::lock_guard<std::mutex> lock(flush_mtx_);
+    stop_flush_ = true;
+  }
+  flush_cv_.notify_one();
+  flush_thread_.join();
+#endif
   zone_->Counts();
   SAFE_DELETE(rw_lock_);
   // SAFE_DELETE(read_cache_);
   // SAFE_DELETE(zone_);
   SAFE_DELETE(replacer_);
-  if (pages_buffer_ != nullptr) {
-    free(pages_buffer_);
-  }
   // SAFE_DELETE(flusher_);
 }
-static offset_t get_offset(page_id_t page_id, Zone* zone_) {
-  // offset_t zone_offset = zone_->GetMaxCapacity() * GET_ZONE_ID(page_id);
-  offset_t zone_offset = 0;
-  offset_t offset = zone_offset + GET_ZONE_OFFSET(page_id) * PAGE_SIZE;
-  return offset;
+static u64 NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
 }
 
 void ZoneManager::FlushAllPages() {
+#ifdef ZONE_APPEND
+  {
+    WriteLockGuard guard(rw_lock_);
+    while (DetachBatch()) {
+    }
+  }
+  DrainAppends();
+  while (appending_.load() > 0) {
+    std::this_thread::yield();
+  }
+  {
+    WriteLockGuard guard(rw_lock_);
+    ReapAppends();
+  }
+  return;
+#endif
   WriteLockGuard guard(rw_lock_);
   // printf("%s\n", __func__);
-  while (replacer_->Size() > 0) {
-    Item* tmp = nullptr;
-    replacer_->Victim(&tmp);
-    Page* page = reinterpret_cast<Page*>(tmp->data_);
-    offset_t offset = get_offset(page->GetPageId(), zone_);
-    u64 length = tmp->length;
-    AppendPage(page);
-    delete (tmp);
+  while (StageBatch()) {
+  }
+  DrainStaged();
+}
+
+bool ZoneManager::StageBatch() {
+  if (replacer_->Size() == 0) return false;
+  std::vector<Page*> batch;
+  Item* item = nullptr;
+  u32 batch_size = batch_size_.load(std::memory_order_relaxed);
+  while (batch.size() < batch_size && replacer_->Victim(&item)) {
+    Page* page = reinterpret_cast<Page*>(item->data_);
+    delete item;
+    // an update of it copies it from memory from now on
+    page->WLatch();
+    page->SetStatus(FLUSHED);
+    page->WUnlatch();
+    AddGhost(FIFO_PART, page->GetPageId());
+    batch.push_back(page);
+  }
+  {
+    std::lock_guard<std::mutex> lock(flush_mtx_);
+    staged_.push_back(std::move(batch));
+  }
+  flush_cv_.notify_one();
+  return true;
+}
+
+void ZoneManager::DrainStaged() {
+  {
+    std::unique_lock<std::mutex> lock(flush_mtx_);
+    flushed_cv_.wait(lock, [this] { return staged_.empty(); });
   }
+  // the flusher is idle until the next batch is staged
   FlushBatchedPage();
+  WaitAllBatches();
+}
+
+void ZoneManager::ThrottleFlush() {
+  std::unique_lock<std::mutex> lock(flush_mtx_);
+  flushed_cv_.wait(lock,
+                   [this] { return staged_.size() <= MAX_STAGED_BATCHES; });
+}
+
+void ZoneManager::FlushLoop() {
+  std::unique_lock<std::mutex> lock(flush_mtx_);
+  while (true) {
+    flush_cv_.wait(lock, [this] { return stop_flush_ || !staged_.empty(); });
+    if (staged_.empty()) return;
+    std::vector<Page*>& batch = staged_.front();
+    lock.unlock();
+    for (auto page : batch) {
+      AppendPage(page);
+    }
+    lock.lock();
+    if (staged_.size() == 1) {
+      // nothing behind it, the pages of the full buffers may leave the FIFO
+      lock.unlock();
+      WaitAllBatches();
+      lock.lock();
+    }
+    staged_.pop_front();
+    flushed_cv_.notify_all();
+  }
 }
 
 void ZoneManager::AppendPage(Page* page) {
-  if (__glibc_unlikely(pages_buffer_ == nullptr)) {
-    // pages_buffer_ = new char[PAGE_SIZE * BATCH_SIZE];
-    pages_buffer_ = (char*)aligned_alloc(4096, PAGE_SIZE * BATCH_SIZE);
-    memset(pages_buffer_, 0, BATCH_SIZE * PAGE_SIZE);
+  if (buffer_pages_ == 0) {
+    // the size of a batch is fixed once its first page is in
+    cur_batch_size_ = batch_size_.load(std::memory_order_relaxed);
+  }
+  // a staged page is not written in place any more and the flusher pins it
+  // until PublishPage, the device reads its frame
+  std::vector<struct iovec>& iov = batch_iov_[cur_batch_];
+  char* data = page->GetData();
+  if (!iov.empty() && (char*)iov.back().iov_base + iov.back().iov_len == data) {
+    iov.back().iov_len += PAGE_SIZE;
+  } else {
+    iov.push_back({data, PAGE_SIZE});
   }
-  page->WLatch();
-  memcpy(pages_buffer_ + buffer_pages_ * PAGE_SIZE, page->GetData(), PAGE_SIZE);
+  batch_pages_[cur_batch_].push_back(page);
   buffer_pages_++;
-  if (buffer_pages_ == BATCH_SIZE) {
+  if (buffer_pages_ >= cur_batch_size_) {
     FlushBatchedPage();
   }
+}
+
+void ZoneManager::SetBatchSize(u32 pages) {
+  WriteLockGuard guard(rw_lock_);
+#ifndef ZONE_APPEND
+  // the flusher is idle while the lock is held
+  DrainStaged();
+#endif
+  // a zone write covers whole device blocks
+  ZonedBlockDevice* zbd = zone_->GetDevice();
+  u32 block = std::max<u64>(zbd->GetBlockSize() / PAGE_SIZE, 1);
+  auto align = [block](u32 n) {
+    return std::max((n + block - 1) / block, 1u) * block;
+  };
+  max_batch_size_ = std::max(MAX_BATCH_SIZE / block * block, block);
+  auto_batch_ = pages == AUTO_BATCH_SIZE;
+  if (auto_batch_) {
+    // a batch must not take much of a zone, the zone switch drains it
+    u32 zone_pages = zbd->GetZoneSize() / PAGE_SIZE;
+    max_batch_size_ = std::min(max_batch_size_, zone_pages / 16);
+    max_batch_size_ = std::max(max_batch_size_ / block * block, block);
+    pages = BATCH_SIZE;
+    tune_appends_ = 0;
+    tune_bytes_ = 0;
+    tune_ns_ = 0;
+    tune_bandwidth_ = 0;
+  }
+  batch_size_.store(std::min(align(pages), max_batch_size_),
+                    std::memory_order_relaxed);
+}
+
+void ZoneManager::TuneBatchSize(u64 bytes, u64 ns) {
+  u32 batch_size = batch_size_.load(std::memory_order_relaxed);
+  // only full batches of the size being measured count
+  if (bytes != (u64)batch_size * PAGE_SIZE) return;
+  tune_bytes_ += bytes;
+  tune_ns_ += std::max<u64>(ns, 1);
+  if (++tune_appends_ < BATCH_TUNE_APPENDS) return;
+  double bandwidth = (double)tune_bytes_ / tune_ns_;
+  tune_appends_ = 0;
+  tune_bytes_ = 0;
+  tune_ns_ = 0;
+  if (bandwidth >= tune_bandwidth_ * BATCH_TUNE_GAIN) {
+    tune_bandwidth_ = bandwidth;
+    if (batch_size * 2 <= max_batch_size_) {
+      batch_size_.store(batch_size * 2, std::memory_order_relaxed);
+      return;
+    }
+  } else {
+    // the last doubling did not pay off
+    batch_size_.store(std::max(batch_size / 2, 1u), std::memory_order_relaxed);
+  }
+  INFO_PRINT("[ZoneManager] zone %lu writes batches of %u pages\n", zone_id_,
+             batch_size_.load(std::memory_order_relaxed));
+  auto_batch_ = false;
+}
+
+void ZoneManager::PublishPage(Page* page) {
+  page->WLatch();
+  // rewritten meanwhile, the new copy lives on elsewhere
+  bool rewritten = page->IsEvicted();
+  // out of the FIFO before the read cache may free it
+  page_table_.Erase(page->GetPageId());
+  if (!rewritten) {
 #ifdef USE_LRU_BUFFER
-  auto epage = lru_buffer_.evict_and_insert(page->page_id_, page);
+    auto epage = lru_buffer_.evict_and_insert(page->page_id_, page,
+                                              page->GetReadCount());
 #elif defined(USE_SIEVE)
-  auto epage = sieve_.evict_and_insert(page->page_id_, page);
+    auto epage = sieve_.evict_and_insert(page->page_id_, page,
+                                         page->GetReadCount());
 #else
-  Page* epage = nullptr;
-  page->Unpin();
-  if (page->pin_count_ == 0) {
-    DESTROY_PAGE(page);
-  }
+    Page* epage = nullptr;
+    rewritten = true;
 #endif
-  if (__glibc_likely(epage != nullptr)) {
-    auto cnt = epage->pin_count_.fetch_sub(1);
-    epage->SetStatus(EVICTED);
-    if (cnt == 1) {
-      DESTROY_PAGE(epage);
+    if (__glibc_likely(epage != nullptr)) {
+      epage->SetStatus(EVICTED);
+      auto cnt = epage->pin_count_.fetch_sub(1);
+      if (cnt == 1) {
+        RETIRE_PAGE(epage);
+      }
     }
   }
-  page_table_.erase(page->GetPageId());
   page->WUnlatch();
-  // }
+  if (rewritten && page->pin_count_.fetch_sub(1) == 1) {
+    RETIRE_PAGE(page);
+  }
+}
+
+void ZoneManager::InitGhosts(u64 fifo_pages, u64 cache_pages) {
+#ifdef ADAPTIVE_BUFFER_SPLIT
+  ghosts_[FIFO_PART].Reset(fifo_pages);
+  ghosts_[READ_CACHE_PART].Reset(cache_pages);
+#ifdef USE_LRU_BUFFER
+  lru_buffer_._ghost = &ghosts_[READ_CACHE_PART];
+#else
+  sieve_._ghost = &ghosts_[READ_CACHE_PART];
+#endif
+#endif
+}
+
+void ZoneManager::ApplyCapacity(BufferPart part) {
+  if (part == FIFO_PART) {
+#ifdef ZONE_APPEND
+    {
+      WriteLockGuard guard(rw_lock_);
+      replacer_->max_size_ = zmp_->governor_.GetCapacity(buffer_index_, part);
+      while (replacer_->Size() > replacer_->max_size_ && DetachBatch()) {
+      }
+    }
+    DrainAppends();
+#else
+    WriteLockGuard guard(rw_lock_);
+    replacer_->max_size_ = zmp_->governor_.GetCapacity(buffer_index_, part);
+    // the pages over it go to the flusher
+    while (replacer_->Size() > replacer_->max_size_ && StageBatch()) {
+    }
+#endif
+    return;
+  }
+#if defined(USE_LRU_BUFFER) || defined(USE_SIEVE)
+  std::vector<Page*> victims;
+  {
+    // the capacity is read under the lock, the last resize wins
+    WriteLockGuard guard(rw_lock_);
+#ifdef USE_LRU_BUFFER
+    lru_buffer_.resize(zmp_->governor_.GetCapacity(buffer_index_, part),
+                       &victims);
+#else
+    sieve_.resize(zmp_->governor_.GetCapacity(buffer_index_, part), &victims);
+#endif
+  }
+  for (auto page : victims) {
+    page->SetStatus(EVICTED);
+    if (page->pin_count_.fetch_sub(1) == 1) {
+      RETIRE_PAGE(page);
+    }
+  }
+#endif
 }
 
 void ZoneManager::FlushBatchedPage() {
   if (buffer_pages_ == 0) return;
-  auto ret = zone_->Append(pages_buffer_, buffer_pages_ * PAGE_SIZE);
+  u64 bytes = buffer_pages_ * PAGE_SIZE;
+  batch_offset_[cur_batch_] = zone_->wp_;
+  batch_bytes_[cur_batch_] = bytes;
+  batch_nr_pages_[cur_batch_] = buffer_pages_;
+  batch_submit_ns_[cur_batch_] = NowNs();
+  std::vector<struct iovec>& iov = batch_iov_[cur_batch_];
+  auto ret =
+      zone_->AsyncAppendv(iov.data(), iov.size(), &batch_io_[cur_batch_]);
+  // the pages are published once the batch is written, like DrainAppends a
+  // write that fails is not survived
   if (ret != Code::kOk) {
-    DEBUG_PRINT("zone id:%lu append failed wp:%lu cap:%lu end:%lu\n", zone_id_,
+    FATAL_PRINT("zone id:%lu append failed wp:%lu cap:%lu end:%lu\n", zone_id_,
                 wp_, cap_, end_);
   }
   buffer_pages_ = 0;
+  // the next batch is the oldest one in flight
+  cur_batch_ = (cur_batch_ + 1) % MAX_INFLIGHT_BATCHES;
+  WaitBatch(cur_batch_);
 }
 
-/**
- * every time add a page to flusher,
- * check to flush the existed page in flusher to zns
- */
-
-void ZoneManager::AddPage(Slot slot) {
-  // 1.1 add the current evicted pages to flusher
-  // flusher_->Push(slot);
-  // 1.2 if no exited page in flusher, just return
-  Slot tmp = slot;
-
-  // 1.3 flushed the existed page
-  Page* page = tmp.first;
-  u64 length = tmp.second;
-  // if (length > 0) {
-  // length indicates the page not flushed
-  // page_id_t page_id = page->GetPageId();
-  // uint64_t offset = get_offset(page_id, zone_);
-  // if(offset != this->zone_->wp_) {
-  //   printf("[ZoneManager] page_id:%lu zone_offset:%lu wp:%lu zoneid:%lu
-  //   thiszoneid:%lu\n", page_id, offset, this->zone_->wp_,
-  //   this->zone_->GetZoneNr(), this->zone_id_);
-  //   // printf("[ZoneManager] page_id:%lu zone_offset:%lu wp:%lu\n", page_id,
-  //   offset, this->zone_->wp_);
-  // }
-  // assert(offset == this->zone_->wp_);
-  zone_->Append(page->GetData(), length * PAGE_SIZE);
-
-  // small batch buffer that merge multi page into big write
-  // AppendPage(page);
-  // zone_->Append(page, buffer_pages_ * PAGE_SIZE);
-
-  // 2. after flushed to zns, it will be safe to umap the items
-  //
-  for (u64 i = 0; i < length; i++) {
-    // DEBUG_PRINT("%lu pin count %d \n", i, page[i].GetPinCount());
-    // buffer_pool_manager_->page_table_.erase(page[i].GetPageId());
-    page_table_.erase(page[i].GetPageId());
-    page[i].Unpin();
-    page[i].SetStatus(FLUSHED);
-    // ATOMIC_SPIN_UNTIL(page[i].GetReadCount(), 0);
-    // page[i].SetStatus(FLUSHED);
-  }
+void ZoneManager::WaitBatch(int32_t idx) {
+  if (batch_bytes_[idx] != 0) {
+    int ret = batch_io_[idx].Wait();
+    if (ret != (int)batch_bytes_[idx]) {
+      FATAL_PRINT("zone id:%lu append failed offset:%lu ret:%d\n", zone_id_,
+                  batch_offset_[idx], ret);
+    }
+    if (auto_batch_) {
+      TuneBatchSize(batch_bytes_[idx], NowNs() - batch_submit_ns_[idx]);
+    }
+    batch_bytes_[idx] = 0;
+    batch_iov_[idx].clear();
+  }
+  // the pages of the batch being filled are not written yet
+  std::vector<Page*>& pages = batch_pages_[idx];
+  for (u32 i = 0; i < batch_nr_pages_[idx]; i++) {
+    PublishPage(pages[i]);
+  }
+  pages.erase(pages.begin(), pages.begin() + batch_nr_pages_[idx]);
+  batch_nr_pages_[idx] = 0;
+}
+
+void ZoneManager::WaitAllBatches() {
+  for (int32_t i = 0; i < MAX_INFLIGHT_BATCHES; i++) {
+    WaitBatch(i);
+  }
+}
+
+bool ZoneManager::DetachBatch() {
+  if (replacer_->Size() == 0) return false;
+  AppendBatch* batch = new AppendBatch();
+  batch->zone = zone_;
+  u32 batch_size = batch_size_.load(std::memory_order_relaxed);
+  batch->buf = (char*)aligned_alloc(PAGE_SIZE, PAGE_SIZE * batch_size);
+  batch->page.resize(batch_size);
+  Item* item = nullptr;
+  while (batch->pages < batch_size && replacer_->Victim(&item)) {
+    Page* page = reinterpret_cast<Page*>(item->data_);
+    delete item;
+    // the page stays in page_table_ until its batch is placed,
+    // an update of it copies it from memory
+    page->WLatch();
+    memcpy(batch->buf + batch->pages * PAGE_SIZE, page->GetData(), PAGE_SIZE);
+    page->SetStatus(FLUSHED);
+    page->WUnlatch();
+    AddGhost(FIFO_PART, page->GetPageId());
+    batch->page[batch->pages++] = page;
+  }
+  appending_++;
+  std::lock_guard<std::mutex> lock(append_mtx_);
+  pending_.push_back(batch);
+  return true;
+}
 
-  if (page->GetReadCount() < MAX_RESEVER_THR && page->GetPinCount() == 0) {
-    // 1.1 the page is not hot, just destroy it
-    DESTROY_PAGE(page);
-  } else if (page->GetReadCount() >= MAX_RESEVER_THR) {
-    // 1.2 if the page is hot add it to read cache
-    page->Pin();
+void ZoneManager::DrainAppends() {
+  while (true) {
+    AppendBatch* batch = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(append_mtx_);
+      if (pending_.empty()) return;
+      batch = pending_.front();
+      pending_.pop_front();
+    }
+    u64 placed = 0;
+    auto ret = batch->zone->ZoneAppend(batch->buf, batch->pages * PAGE_SIZE,
+                                       &placed);
+    if (ret != Code::kOk) {
+      FATAL_PRINT("zone id:%lu append of %u pages failed\n",
+                  batch->zone->GetZoneNr(), batch->pages);
+    }
+    batch->placed = placed;
+    zns_id_t zid = GetZoneId(batch->zone);
+    offset_t first = placed / PAGE_SIZE;
+    {
+      std::lock_guard<std::mutex> lock(remap_mtx_);
+      for (u32 i = 0; i < batch->pages; i++) {
+        page_id_t page_id = MAKE_PAGE_ID(zid, first + i);
+        batch->zone->MarkValid(GET_ZONE_OFFSET(page_id) * PAGE_SIZE);
+        remap_[batch->page[i]->GetPageId()] = page_id;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(append_mtx_);
+      placed_.push_back(batch);
+    }
+    appending_--;
+  }
+}
+
+void ZoneManager::ReapAppends() {
+  std::deque<AppendBatch*> done;
+  {
+    std::lock_guard<std::mutex> lock(append_mtx_);
+    if (placed_.empty()) return;
+    done.swap(placed_);
+  }
+  for (auto batch : done) {
+    zns_id_t zid = GetZoneId(batch->zone);
+    offset_t first = batch->placed / PAGE_SIZE;
+    for (u32 i = 0; i < batch->pages; i++) {
+      Page* page = batch->page[i];
+      page_id_t provisional = page->GetPageId();
+      page_id_t page_id = MAKE_PAGE_ID(zid, first + i);
+      page_table_.Erase(provisional);
+      if (page->IsEvicted()) {
+        // rewritten while the batch was in flight
+        batch->zone->MarkInvalid(GET_ZONE_OFFSET(page_id) * PAGE_SIZE);
+        RetirePageId(provisional);
+        if (page->pin_count_.fetch_sub(1) == 1) {
+          RETIRE_PAGE(page);
+        }
+        continue;
+      }
+      page->WLatch();
+      page->page_id_ = page_id;
+      page->SetStatus(ACTIVE);
 #ifdef USE_LRU_BUFFER
-    auto epage = lru_buffer_.evict_and_insert(page->page_id_, page);
+      auto epage = lru_buffer_.evict_and_insert(page_id, page,
+                                                page->GetReadCount());
 #elif defined(USE_SIEVE)
-    auto epage = sieve_.evict_and_insert(page->page_id_, page);
+      auto epage = sieve_.evict_and_insert(page_id, page,
+                                           page->GetReadCount());
 #else
-    Page* epage = nullptr;
-    page->Unpin();
-    if (page->pin_count_ == 0) {
-      DESTROY_PAGE(page);
-    }
+      // no read cache, the pin of the FIFO goes once the page is unlatched
+      Page* epage = nullptr;
 #endif
-    if (epage != nullptr) {
-      auto cnt = epage->pin_count_.fetch_sub(1);
-      if (cnt == 1) {
-        DESTROY_PAGE(epage);
+      if (epage != nullptr) {
+        epage->SetStatus(EVICTED);
+        auto cnt = epage->pin_count_.fetch_sub(1);
+        if (cnt == 1) {
+          RETIRE_PAGE(epage);
+        }
+      }
+      void* leaf = page->GetLeafPtr();
+      page->WUnlatch();
+#if !defined(USE_LRU_BUFFER) && !defined(USE_SIEVE)
+      if (page->pin_count_.fetch_sub(1) == 1) {
+        RETIRE_PAGE(page);
+      }
+#endif
+      // the leaf keeps the provisional id if it is latched right now,
+      // the remap resolves it until the leaf is written again
+      if (leaf != nullptr && zmp_->fixup_ &&
+          zmp_->fixup_(leaf, provisional, page_id)) {
+        RetirePageId(provisional);
       }
     }
+    free(batch->buf);
+    delete batch;
+  }
+}
+
+page_id_t ZoneManager::ResolvePageId(page_id_t page_id) {
+  std::lock_guard<std::mutex> lock(remap_mtx_);
+  auto it = remap_.find(page_id);
+  return it == remap_.end() ? INVALID_PAGE_ID : it->second;
+}
+
+void ZoneManager::RetirePageId(page_id_t page_id) {
+  std::lock_guard<std::mutex> lock(remap_mtx_);
+  retired_.push_back(page_id);
+  while (retired_.size() > REMAP_GRACE) {
+    remap_.erase(retired_.front());
+    retired_.pop_front();
   }
 }
 
 Page* ZoneManager::AllocateSeqPage(u64 length) {
+  if (length == 1) {
+    Page* page = PagePool::Grab();
+    if (page != nullptr) page->SetStatus(ACTIVE);
+    return page;
+  }
   Page* tmp_page = new Page[length];
   char* page_data = (char*)aligned_alloc(PAGE_SIZE, length * PAGE_SIZE);
   // memset(page_data, 0, length * PAGE_SIZE);
@@ -850,100 +1172,219 @@ Page* ZoneManager::AllocateSeqPage(u64 length) {
 }
 
 Page* ZoneManager::GrabPageFrameImp(u64 length) {
-  Page* ret_page = nullptr;
-  Item* cur_item = nullptr;
   // DEBUG_PRINT("call of zone grab page frame\n");
   if (!replacer_->IsFull()) {
     // DEBUG_PRINT("!empty\n");
     return AllocateSeqPage(length);
-  } else if (replacer_->Victim(&cur_item)) {
-    // 2. then find in replacer
-    // DEBUG_PRINT("victim frame_id:%u\n", cur_item->frame_id_);
-    ret_page = reinterpret_cast<Page*>(cur_item->data_);
-    u64 length = cur_item->length;
-    AppendPage(ret_page);
-    // DESTROY_PAGE(ret_page);
-    delete cur_item;
-    cur_item = nullptr;
-    for (int i = 1; i < BATCH_SIZE; ++i) {
-      if (replacer_->Victim(&cur_item)) {
-        ret_page = (Page*)cur_item->data_;
-        AppendPage(ret_page);
-        delete cur_item;
-      }
-    }
-    FlushBatchedPage();
-    // AddPage({ret_page, length});
-    Page* tmp_page = AllocateSeqPage(length);
-    return tmp_page;
+  }
+#ifdef ZONE_APPEND
+  // the caller drains the batch after releasing the lock
+  DetachBatch();
+  return AllocateSeqPage(length);
+#endif
+  // 2. hand the oldest pages to the flusher
+  if (StageBatch()) {
+    return AllocateSeqPage(length);
   }
   return nullptr;
 }
 
 Page* ZoneManager::GetPageImp(page_id_t page_id) {
   Page* ret_page = nullptr;
-  if (page_table_.find(page_id) != page_table_.end()) {
-    // 1.1 first find in fifo write buffer
-    ret_page = page_table_[page_id];
-    ret_page->Pin();
+  if (page_table_.Find(page_id, &ret_page)) {
+    // 1.1 first find in fifo write buffer. the flusher publishes without
+    // rw_lock_, the epoch of the caller keeps the page alive meanwhile
+    if (ret_page->GetPageId() != page_id) {
+      // it was placed under another id
+      return nullptr;
+    }
 
     HitHelper();
-    page_id_counts_[page_id]++;
+    page_id_counts_.Add(page_id, 1);
   }
   return ret_page;
 }
 
-Page* ZoneManager::NewPageImp(page_id_t* page_id, u64 length) {
+Page* ZoneManager::NewPageImp(page_id_t* page_id, u64 length,
+                              bool use_reserved) {
   Page* ret_page = GrabPageFrameImp(length);
   if (ret_page == nullptr) {
     return nullptr;
   }
 
   for (u64 i = 0; i < length; i++) {
-    if (!AllocatePageId(page_id + i)) {
+    if (!AllocatePageId(page_id + i, use_reserved)) {
+      // out of zones, the caller waits for the cleaner
+      if (i == 0) {
+        DESTROY_PAGE(ret_page);
+      }
       return nullptr;
     }
+#ifndef ZONE_APPEND
+    zone_->MarkValid(GET_ZONE_OFFSET(page_id[i]) * PAGE_SIZE);
+#endif
     ret_page[i].page_id_ = page_id[i];
     ret_page[i].read_count_ = 1;
-    // ret_page[i].pin_count_ = 1;
+    // the pin of the FIFO, the caller reads it in its epoch
     ret_page[i].Pin();
     ret_page[i].is_dirty_ = true;
-    page_table_[page_id[i]] = ret_page + i;
+    page_table_.Insert(page_id[i], ret_page + i);
 
-    page_id_counts_[page_id[i]] = 1;
+    page_id_counts_.Insert(page_id[i], 1);
     MissHelper();
   }
   replacer_->Add(page_id[0], length, (char*)(ret_page));
-  ret_page[0].Pin();
   return ret_page;
 }
 
-Page* ZoneManager::NewPage(page_id_t* page_id, u64 length) {
-  WriteLockGuard guard(rw_lock_);
-  return NewPageImp(page_id, length);
+Page* ZoneManager::NewPage(page_id_t* page_id, u64 length, bool use_reserved,
+                           const char* data) {
+  // the caller leaves it when it unpins the page
+  Epoch::Enter();
+#ifdef ZONE_APPEND
+  Page* ret_page = nullptr;
+  {
+    WriteLockGuard guard(rw_lock_);
+    ReapAppends();
+    ret_page = NewPageImp(page_id, length, use_reserved);
+    if (ret_page != nullptr && data != nullptr) {
+      memcpy(ret_page->GetData(), data, length * PAGE_SIZE);
+    }
+  }
+  DrainAppends();
+#else
+  Page* ret_page = nullptr;
+  {
+    WriteLockGuard guard(rw_lock_);
+    ret_page = NewPageImp(page_id, length, use_reserved);
+    // another writer may stage it once the lock is released
+    if (ret_page != nullptr && data != nullptr) {
+      memcpy(ret_page->GetData(), data, length * PAGE_SIZE);
+    }
+  }
+  ThrottleFlush();
+#endif
+  if (ret_page == nullptr) Epoch::Leave();
+  return ret_page;
 }
 
 Page* ZoneManager::UpdatePage(page_id_t* page_id) {
-  WriteLockGuard guard(rw_lock_);
+  // see NewPage
+  Epoch::Enter();
+#ifdef ZONE_APPEND
+  Page* ret_page = nullptr;
+  {
+    WriteLockGuard guard(rw_lock_);
+    ReapAppends();
+    ret_page = UpdatePageImp(page_id);
+  }
+  DrainAppends();
+#else
+  Page* ret_page = nullptr;
+  {
+    WriteLockGuard guard(rw_lock_);
+    ret_page = UpdatePageImp(page_id);
+  }
+  ThrottleFlush();
+#endif
+  if (ret_page == nullptr) Epoch::Leave();
+  return ret_page;
+}
+
+Page* ZoneManager::UpdatePageImp(page_id_t* page_id) {
   Page* ret_page = nullptr;
   // 1.1 find in fifo buffer first
   ret_page = GetPageImp(*page_id);
   if (ret_page != nullptr) {
     ret_page->WLatch();
     if (ret_page->IsFlushed()) {
-      ret_page->Unpin();
+#ifdef ZONE_APPEND
+      // its batch is being appended, copy it from memory
       ret_page->WUnlatch();
-      goto new_one_page;
+      page_id_t tmp_page_id = INVALID_PAGE_ID;
+      Page* new_page = NewPageImp(&tmp_page_id);
+      if (new_page == nullptr) {
+        return nullptr;
+      }
+      ret_page->RLatch();
+      memcpy(new_page->GetData(), ret_page->GetData(), PAGE_SIZE);
+      ret_page->RUnlatch();
+      if (page_table_.Find(*page_id)) {
+        // still in flight, ReapAppends drops it
+        ret_page->SetStatus(EVICTED);
+      } else {
+        // placed by NewPageImp meanwhile
+        page_id_t placed = ResolvePageId(*page_id);
+        RetirePageId(*page_id);
+        zmp_->InvalidatePage(placed);
+        Page* evicted = nullptr;
+#ifdef USE_LRU_BUFFER
+        evicted = lru_buffer_.evict(placed);
+#elif defined(USE_SIEVE)
+        evicted = sieve_.evict(placed);
+#endif
+        if (evicted != nullptr) {
+          evicted->SetStatus(PageStatus::EVICTED);
+          int cnt = evicted->pin_count_.fetch_sub(1);
+          if (cnt == 1) RETIRE_PAGE(evicted);
+        }
+      }
+      *page_id = tmp_page_id;
+      return new_page;
+#else
+      // its batch is being written, copy it from memory
+      ret_page->WUnlatch();
+      page_id_t tmp_page_id = INVALID_PAGE_ID;
+      Page* new_page = NewPageImp(&tmp_page_id);
+      if (new_page == nullptr) {
+        return nullptr;
+      }
+      ret_page->WLatch();
+      memcpy(new_page->GetData(), ret_page->GetData(), PAGE_SIZE);
+      // the flusher drops it instead of caching it
+      ret_page->SetStatus(EVICTED);
+      ret_page->WUnlatch();
+      zmp_->InvalidatePage(*page_id);
+      // unless it was published meanwhile
+      Page* evicted = nullptr;
+#ifdef USE_LRU_BUFFER
+      evicted = lru_buffer_.evict(*page_id);
+#elif defined(USE_SIEVE)
+      evicted = sieve_.evict(*page_id);
+#endif
+      if (evicted != nullptr && evicted->pin_count_.fetch_sub(1) == 1) {
+        RETIRE_PAGE(evicted);
+      }
+      *page_id = tmp_page_id;
+      return new_page;
+#endif
     }
     ret_page->read_count_++;
     ret_page->WUnlatch();
     return ret_page;
   }
-new_one_page:
+  // a bigger FIFO would have updated it in place
+  CheckGhost(FIFO_PART, *page_id);
   // 2. allocate a new page_id in zns;
   page_id_t tmp_page_id = INVALID_PAGE_ID;
   // Attenion: MissHelper() is in NewPageImp();
   Page* new_page = NewPageImp(&tmp_page_id);
+  if (new_page == nullptr) {
+    return nullptr;
+  }
+#ifdef ZONE_APPEND
+  if (IS_PROVISIONAL(*page_id)) {
+    page_id_t provisional = *page_id;
+    *page_id = ResolvePageId(provisional);
+    RetirePageId(provisional);
+    // the leaf is fixed up long before the grace of its id runs out, the
+    // page is lost otherwise
+    if (*page_id == INVALID_PAGE_ID) {
+      FATAL_PRINT("page:%lx has no placed id\n", provisional);
+    }
+  }
+#endif
+  zmp_->InvalidatePage(*page_id);
   Page* evicted = nullptr;
   // 2.1 find page data in read cache
 #ifdef USE_LRU_BUFFER
@@ -953,9 +1394,9 @@ new_one_page:
 #endif
   if (evicted != nullptr) {
     memcpy(new_page->GetData(), evicted->GetData(), PAGE_SIZE);
-    int cnt = evicted->pin_count_.fetch_sub(1);
     evicted->SetStatus(PageStatus::EVICTED);
-    if (cnt == 1) DESTROY_PAGE(evicted);
+    int cnt = evicted->pin_count_.fetch_sub(1);
+    if (cnt == 1) RETIRE_PAGE(evicted);
     *page_id = tmp_page_id;
     return new_page;
   }
@@ -966,22 +1407,100 @@ new_one_page:
   return new_page;
 }
 
+Page* ZoneManager::UpdatePageInPlace(page_id_t page_id) {
+  WriteLockGuard guard(rw_lock_);
+  // see NewPage
+  Epoch::Enter();
+  Page* ret_page = GetPageImp(page_id);
+  if (ret_page != nullptr) {
+    ret_page->WLatch();
+    if (ret_page->IsFlushed()) {
+      ret_page->WUnlatch();
+      Epoch::Leave();
+      return nullptr;
+    }
+    ret_page->read_count_++;
+    ret_page->WUnlatch();
+    return ret_page;
+  }
+  Epoch::Leave();
+  return nullptr;
+}
+
+bool ZoneManager::MovePageOut(page_id_t page_id, char* data) {
+  WriteLockGuard guard(rw_lock_);
+  Page* page = nullptr;
+  if (page_table_.Find(page_id, &page)) {
+    // its batch is being appended
+    page->WLatch();
+    if (data != nullptr) memcpy(data, page->GetData(), PAGE_SIZE);
+#ifdef ZONE_APPEND
+    page->SetStatus(EVICTED);
+#else
+    // a staged page is dropped by the flusher instead of cached
+    if (page->IsFlushed()) page->SetStatus(EVICTED);
+    zmp_->InvalidatePage(page_id);
+#endif
+    page->WUnlatch();
+    return true;
+  }
+#ifdef ZONE_APPEND
+  if (IS_PROVISIONAL(page_id)) {
+    page_id_t provisional = page_id;
+    page_id = ResolvePageId(provisional);
+    RetirePageId(provisional);
+    if (page_id == INVALID_PAGE_ID) return false;
+  }
+#endif
+  Page* evicted = nullptr;
+#ifdef USE_LRU_BUFFER
+  evicted = lru_buffer_.evict(page_id);
+#elif defined(USE_SIEVE)
+  evicted = sieve_.evict(page_id);
+#endif
+  if (evicted != nullptr) {
+    if (data != nullptr) memcpy(data, evicted->GetData(), PAGE_SIZE);
+    evicted->SetStatus(PageStatus::EVICTED);
+    int cnt = evicted->pin_count_.fetch_sub(1);
+    if (cnt == 1) RETIRE_PAGE(evicted);
+  } else if (data != nullptr && ReadPageFromZNSImp((bytes_t*)data, page_id)) {
+    return false;
+  }
+  zmp_->InvalidatePage(page_id);
+  return true;
+}
+
 // 1.find in write buffer (fifo)
 // 2.find in read cache (lru or sieve)
 // 3.read data from zns ssd
 Page* ZoneManager::FetchPage(page_id_t page_id) {
   ReadLockGuard guard(rw_lock_);
+  // the reader holds no pin, the page lives until it leaves the epoch in
+  // UnpinPage
+  Epoch::Enter();
   // 1. find in RingBuffer first
   Page* page = nullptr;
   if (page = GetPageImp(page_id)) {
     page->read_count_++;
     return page;
   }
+#ifdef ZONE_APPEND
+  // 1.2 a placed page is cached under its placed id
+  page_id_t stale_page_id = INVALID_PAGE_ID;
+  if (IS_PROVISIONAL(page_id)) {
+    page_id_t placed = ResolvePageId(page_id);
+    if (placed == INVALID_PAGE_ID) {
+      // the leaf was rewritten long ago, the reader will restart
+      stale_page_id = page_id;
+    } else {
+      page_id = placed;
+    }
+  }
+#endif
   // 2. find in read cache,
   // page = read_cache_->FetchPage(page_id);
 #ifdef USE_LRU_BUFFER
   if (page = lru_buffer_.fetch(page_id)) {
-    page->Pin();
     lru_buffer_._hit++;
     page->read_count_++;
     HitHelper();
@@ -989,8 +1508,8 @@ Page* ZoneManager::FetchPage(page_id_t page_id) {
   }
   lru_buffer_._miss++;
 #elif defined(USE_SIEVE)
+  // the flusher may evict it meanwhile, it is retired and not freed
   if (page = sieve_.fetch(page_id)) {
-    page->Pin();
     page->read_count_++;
     HitHelper();
     return page;
@@ -998,122 +1517,189 @@ Page* ZoneManager::FetchPage(page_id_t page_id) {
 #endif
 
   MissHelper();
-  page_id_counts_[page_id]++;
+  page_id_counts_.Add(page_id, 1);
+  CheckGhost(READ_CACHE_PART, page_id);
 
   // 3. if not exist in LRU cache, then fetch from disk
   page = AllocateSeqPage(1);
   int ret = 0;
+#ifdef ZONE_APPEND
+  if (stale_page_id != INVALID_PAGE_ID) {
+    memset(page->GetData(), 0, PAGE_SIZE);
+  } else
+#endif
   if (ret = ReadPageFromZNSImp((bytes_t*)page->GetData(), page_id)) {
     FATAL_PRINT("reading page:%ld %s error read zns\n", page_id, strerror(ret));
   } else {
     page->page_id_ = page_id;
-    page->Pin();
-    page->Pin();
     page->read_count_ = 1;
     page->is_dirty_ = false;
+    bool cache = true;
+#ifdef ZONE_APPEND
+    cache = stale_page_id == INVALID_PAGE_ID;
+#endif
+    // the cleaner reclaimed the zone meanwhile, like in InsertReadCache. A
+    // copy cached before it was cleared goes with EvictZonePages
+    cache = cache && zmp_->LookupZone(GET_ZONE_ID(page_id))
+                         ->IsValid(GET_ZONE_OFFSET(page_id) * PAGE_SIZE);
+#if defined(USE_LRU_BUFFER) || defined(USE_SIEVE)
+    if (cache) {
+      // the pin of the read cache
+      page->Pin();
 #ifdef USE_LRU_BUFFER
-    Page* evicted = lru_buffer_.evict_and_insert(page_id, page);
-    if (evicted != nullptr) {
-      evicted->SetStatus(PageStatus::EVICTED);
-      int cnt = evicted->pin_count_.fetch_sub(1);
-      if (cnt == 1) {
-        DESTROY_PAGE(evicted);
-      }
-    }
-#elif defined(USE_SIEVE)
-    Page* evicted = sieve_.evict_and_insert(page_id, page);
-    if (evicted != nullptr) {
-      // evicted->SetStatus(EVICTED);
-      int cnt = evicted->pin_count_.fetch_sub(1);
-      if (cnt == 1) {
-        DESTROY_PAGE(evicted);
+      Page* evicted = lru_buffer_.evict_and_insert(page_id, page);
+#else
+      Page* evicted = sieve_.evict_and_insert(page_id, page);
+#endif
+      if (evicted != nullptr) {
+        evicted->SetStatus(PageStatus::EVICTED);
+        int cnt = evicted->pin_count_.fetch_sub(1);
+        if (cnt == 1) {
+          RETIRE_PAGE(evicted);
+        }
       }
+      return page;
     }
-#else
-    // only works for  pure fifo without any read-cache
-    // page_table_[page_id] = page;
-    page->Unpin();
 #endif
+    // without a read cache nobody holds the page once the reader leaves
+    // its epoch
+    Epoch::Retire(page);
   }
   return page;
 }
 
-bool ZoneManager::UnpinPage(page_id_t page_id, bool is_dirty) {
-  // WriteLockGuard guard(rw_lock_);
+Page* ZoneManager::PrefetchPage(page_id_t page_id) {
   ReadLockGuard guard(rw_lock_);
-  // 1. find in RingBuffer first
-  // 0 Make sure you can unpin page_id
-  Page* cur_page = nullptr;
-  if (page_table_.find(page_id) == page_table_.end()) {
+  if (page_table_.Find(page_id)) return nullptr;
+#ifdef ZONE_APPEND
+  if (IS_PROVISIONAL(page_id)) {
+    page_id = ResolvePageId(page_id);
+    if (page_id == INVALID_PAGE_ID) return nullptr;
+  }
+#endif
+#ifdef USE_LRU_BUFFER
+  if (lru_buffer_.touch(page_id) != nullptr) return nullptr;
+#elif defined(USE_SIEVE)
+  if (sieve_.touch(page_id) != nullptr) return nullptr;
+#endif
+  CheckGhost(READ_CACHE_PART, page_id);
+  Page* page = AllocateSeqPage(1);
+  if (page != nullptr) {
+    page->page_id_ = page_id;
+  }
+  return page;
+}
+
+void ZoneManager::InsertReadCache(Page* page) {
+  WriteLockGuard guard(rw_lock_);
+  page_id_t page_id = page->GetPageId();
+  bool drop = page_table_.Find(page_id) ||
+              !zmp_->LookupZone(GET_ZONE_ID(page_id))
+                   ->IsValid(GET_ZONE_OFFSET(page_id) * PAGE_SIZE);
+#ifdef USE_LRU_BUFFER
+  drop = drop || lru_buffer_.touch(page_id) != nullptr;
+#elif defined(USE_SIEVE)
+  drop = drop || sieve_.touch(page_id) != nullptr;
+#else
+  drop = true;
+#endif
+  // someone read or rewrote the page meanwhile
+  if (drop) {
+    DESTROY_PAGE(page);
+    return;
+  }
+  page->Pin();
+  page->read_count_ = 0;
+  page->is_dirty_ = false;
+  MissHelper();
 #ifdef USE_LRU_BUFFER
-    cur_page = lru_buffer_.touch(page_id);
+  Page* evicted = lru_buffer_.evict_and_insert(page_id, page);
 #elif defined(USE_SIEVE)
-    cur_page = sieve_.touch(page_id);
+  Page* evicted = sieve_.evict_and_insert(page_id, page);
 #else
+  Page* evicted = nullptr;
 #endif
-    if (cur_page != nullptr) {
-      goto GC;
+  if (evicted != nullptr) {
+    evicted->SetStatus(PageStatus::EVICTED);
+    int cnt = evicted->pin_count_.fetch_sub(1);
+    if (cnt == 1) {
+      RETIRE_PAGE(evicted);
     }
-    return true;
   }
-  // 1 get page object
-  cur_page = page_table_[page_id];
-  if (is_dirty) {
+}
+
+bool ZoneManager::UnpinPage(page_id_t page_id, bool is_dirty) {
+  // WriteLockGuard guard(rw_lock_);
+  ReadLockGuard guard(rw_lock_);
+  // 1. find in RingBuffer first
+  Page* cur_page = nullptr;
+  if (page_table_.Find(page_id, &cur_page) && is_dirty) {
+    // 1 the page object is in the FIFO
     // if page is dirty but is_dirty indicates non-dirty,
     // it also should be dirty
     cur_page->is_dirty_ |= is_dirty;
   }
-GC:
-  // cur_page->Unpin();
-  int cnt = cur_page->pin_count_.fetch_sub(1);
-  if (cur_page->IsEvicted() && cnt == 1) {
-    DESTROY_PAGE(cur_page);
-  }
+  // the page may be retired from now on
+  Epoch::Leave();
   return true;
 }
 
-bool ZoneManager::AllocatePageId(page_id_t* page_id) {
+bool ZoneManager::AllocatePageId(page_id_t* page_id, bool use_reserved) {
 restart:
   if (wp_ < end_) {
+#ifdef ZONE_APPEND
+    // the slot is reserved, the page is placed by its append
+    *page_id = MAKE_PAGE_ID(provisional_zone_, provisional_seq_++);
+#else
     *page_id = MAKE_PAGE_ID(zone_id_, wp_);
+#endif
     wp_++;
     return true;
   } else {
     // DEBUG_PRINT("zone:%lu is full :wp_ %6lu end_ %6lu\n", zone_id_, wp_,
     // end_); evict and flush all pages in replacer
-    Page* ret_page = nullptr;
-    Item* cur_item = nullptr;
-    while (replacer_->Victim(&cur_item)) {
-      ret_page = reinterpret_cast<Page*>(cur_item->data_);
-      u64 length = cur_item->length;
-      // AddPage({ret_page, length});
-      AppendPage(ret_page);
-      delete cur_item;
+#ifdef ZONE_APPEND
+    // every reserved slot is written before the zone is finished,
+    // the other writers never take rw_lock_ so waiting for them is safe
+    while (DetachBatch()) {
     }
-    FlushBatchedPage();
-  retry:
-    Zone* new_zone = zmp_->zns_->GetUsableZone();
-    if (new_zone && new_zone->IsFull()) {
-      DEBUG_PRINT("allocate new zone %lu failed is also full %lu \n", zone_id_,
-                  new_zone->GetZoneNr());
-      goto retry;
+    DrainAppends();
+    while (appending_.load() > 0) {
+      std::this_thread::yield();
+    }
+    ReapAppends();
+#else
+    while (StageBatch()) {
+    }
+    DrainStaged();
+#endif
+    // give the active zone back first, the device may have no spare one.
+    // the zone stays busy until it is replaced, a retry must not finish twice
+    if (zone_->IsOpen()) {
+      zone_->Finish();
+    }
+    // the buffer stays on its device, the stripe keeps its width
+    Zone* new_zone =
+        zmp_->AllocateZone(zone_->GetDevice()->GetDeviceId(), use_reserved);
+    if (new_zone == nullptr) {
+      return false;
     }
 
-    // finished raw zone
-    zone_->Finish();
+    // finished raw zone, the cleaner may pick it from now on
+    zone_->Release();
     // set new zone
     zns_id_t raw_zone_id = zone_id_;
-    zone_id_ = new_zone->GetZoneNr();
+    zone_id_ = GetZoneId(new_zone);
     wp_ = new_zone->wp_ / PAGE_SIZE;
     cap_ = new_zone->GetCapacityLeft() / PAGE_SIZE;
     end_ =
         new_zone->start_ / PAGE_SIZE + new_zone->GetMaxCapacity() / PAGE_SIZE;
     zone_ = new_zone;
-    // set new zoneid mapping
-    zmp_->zone_table_[zone_id_] = zmp_->zone_table_[raw_zone_id];
+    // set new zoneid mapping, before the first page id of the zone is out
+    zmp_->MapZone(zone_id_, zmp_->BufferIndex(raw_zone_id));
     //  add wp_
     INFO_PRINT("zone %lu is full, allocate new zone %lu\n", raw_zone_id,
-               new_zone->GetZoneNr());
+               zone_id_);
     goto restart;
     // *page_id = INVALID_PAGE_ID;
   }
@@ -1127,7 +1713,14 @@ bool ZoneManager::ReadPageFromZNSImp(bytes_t* data, zns_id_t zid,
   // offset_t zone_offset = zone_->GetMaxCapacity() * GET_ZONE_ID(zid);
   offset_t zone_offset = 0;
   offset_t offset = zone_offset + GET_ZONE_OFFSET(zid) * PAGE_SIZE;
-  return zone_->Read((char*)data, page_nums * PAGE_SIZE, offset);
+  u32 size = page_nums * PAGE_SIZE;
+  IOHandle io;
+  // the page may sit in any zone this buffer wrote before
+  auto ret = zmp_->LookupZone(GET_ZONE_ID(zid))
+                 ->AsyncRead((char*)data, size, offset, &io);
+  if (ret != Code::kOk) return ret;
+  if (io.Wait() != (int)size) return IOError("Read failed");
+  return OK();
 }
 
 /*
@@ -1137,103 +1730,624 @@ bool ZoneManager::ReadPageFromZNSImp(bytes_t* data, zns_id_t zid,
  * ===================================================================
  * ===================================================================
  */
-ZoneManagerPool::ZoneManagerPool(u32 pool_size, u32 num_instances_,
-                                 const char* db_file)
-    : pool_size_(pool_size), num_instances_(num_instances_), index_(0) {
-  zns_ = new ZnsManager(db_file);
-
-  CHECK_OR_EXIT(zns_, "ZnsManager is nullptr\n");
-
+static MetaRecord MakeMetaRecord(u32 device_id, u32 nr_devices) {
+  MetaRecord meta;
+  memset(&meta, 0, sizeof(meta));
+  meta.magic = META_RECORD_MAGIC;
+  meta.page_size = PAGE_SIZE;
+  meta.key_size = sizeof(KeyType);
+  meta.value_size = sizeof(ValueType);
+  meta.device_id = device_id;
+  meta.nr_devices = nr_devices;
+  return meta;
+}
+
+ZoneManagerPool::ZoneManagerPool(u32 pool_size, u32 num_instances,
+                                 const char* db_file, u64 budget_bytes)
+    : pool_size_(pool_size), num_instances_(num_instances), index_(0) {
+  std::string files(db_file);
+  for (size_t begin = 0; begin <= files.size();) {
+    size_t end = std::min(files.find(',', begin), files.size());
+    if (devices_.size() == MAX_NR_DEVICES) {
+      FATAL_PRINT("ZoneManagerPool stripes over at most %d devices\n",
+                  MAX_NR_DEVICES);
+    }
+    auto zns = new ZnsManager(files.substr(begin, end - begin).c_str());
+    CHECK_OR_EXIT(zns, "ZnsManager is nullptr\n");
+    if (zns->zbd_->GetNrZones() > (1ULL << ZONE_NR_BITS)) {
+      FATAL_PRINT("%s has more than %llu zones\n",
+                  zns->zbd_->GetFilename().c_str(), 1ULL << ZONE_NR_BITS);
+    }
+    zns->zbd_->SetDeviceId(devices_.size());
+    devices_.push_back(zns);
+    begin = end + 1;
+  }
+  zns_ = devices_[0];
+
+  // every zone buffer keeps a zone open, the devices decide how many fit
+  std::vector<u32> max_zones;
+  u32 total_zones = 0;
+  for (auto zns : devices_) {
+    max_zones.push_back(std::min(zns->zbd_->GetMaxActiveIOZones(),
+                                 zns->zbd_->GetMaxOpenIOZones()));
+    total_zones += max_zones.back();
+  }
+  if (num_instances_ > total_zones) {
+    INFO_PRINT("[ZoneManagerPool] %u zone buffers, the devices open at most "
+               "%u zones\n",
+               num_instances_, total_zones);
+    num_instances_ = total_zones;
+  }
+  if (num_instances_ < 2) {
+    FATAL_PRINT("ZoneManagerPool needs at least 2 zone buffers\n");
+  }
+  for (u32 t = 0; t <= NR_TEMPERATURES; t++) {
+    class_begin_[t] = (size_t)t * num_instances_ / NR_TEMPERATURES;
+  }
+
+  u64 nr_zone_ids = MAKE_ZONE_ID(devices_.size() - 1,
+                                 devices_.back()->zbd_->GetNrZones());
+  zone_table_.reset(new std::atomic<u32>[nr_zone_ids]);
+  for (u64 zid = 0; zid < nr_zone_ids; zid++) {
+    zone_table_[zid].store(zid % num_instances_, std::memory_order_relaxed);
+  }
+
+  // the budget is split like the compile-time sizes until the governor
+  // moves it
+  u64 fifo_pages = MAX_CACHED_PAGES_PER_ZONE;
+  u64 cache_pages = MAX_READ_CACHE_PAGES;
+  if (budget_bytes > 0) {
+    u64 pages = std::max<u64>(budget_bytes / PAGE_SIZE / num_instances_, 2);
+    fifo_pages = std::clamp<u64>(
+        pages * fifo_pages / (fifo_pages + cache_pages), 1, pages - 1);
+    cache_pages = pages - fifo_pages;
+  }
+  governor_.Init(num_instances_, fifo_pages, cache_pages);
+
+  // neighbouring zone buffers go to different devices, so every
+  // temperature class and every round robin step spans the stripe
+  std::vector<u32> opened(devices_.size(), 0);
+  u32 device_id = 0;
   for (size_t i = 0; i < num_instances_; i++) {
-    auto zone = zns_->GetUsableZone();
+    while (opened[device_id] == max_zones[device_id]) {
+      device_id = (device_id + 1) % devices_.size();
+    }
+    auto zone = devices_[device_id]->GetUsableZone();
+    CHECK_OR_EXIT(zone, "no zone left for the zone buffers\n");
+    opened[device_id]++;
+    device_id = (device_id + 1) % devices_.size();
     auto zbf = new ZoneManager(zone);
     zone_buffers_.push_back(zbf);
     zbf->SetPoolPtr(this);
-    zone_table_[zone->GetZoneNr()] = i;
+    zbf->buffer_index_ = i;
+    zbf->InitGhosts(governor_.GetMaxCapacity(FIFO_PART),
+                    governor_.GetMaxCapacity(READ_CACHE_PART));
+    zbf->ApplyCapacity(FIFO_PART);
+    zbf->ApplyCapacity(READ_CACHE_PART);
+    MapZone(GetZoneId(zone), i);
+    while (class_begin_[zbf->temperature_ + 1] <= i) {
+      zbf->temperature_++;
+    }
+#ifdef ZONE_APPEND
+    // BufferIndex maps it back to i
+    zbf->provisional_zone_ = PROVISIONAL_ZONE_BASE + i;
+#endif
   }
 
+  // the devices must be the ones of the last run, in the same order. The
+  // last run may have stamped every number below its lease
+  bool fresh = true;
+  for (u32 d = 0; d < devices_.size(); d++) {
+    MetaRecord meta;
+    if (!devices_[d]->ReadMeta(&meta)) {
+      if (!fresh) {
+        FATAL_PRINT("device %u is not part of the store\n", d);
+      }
+      continue;
+    }
+    if (meta.page_size != PAGE_SIZE || meta.key_size != sizeof(KeyType) ||
+        meta.value_size != sizeof(ValueType)) {
+      FATAL_PRINT("the device holds pages of another layout\n");
+    }
+    if (meta.device_id != d || meta.nr_devices != devices_.size()) {
+      FATAL_PRINT("device %u was device %u of %u in the last run\n", d,
+                  meta.device_id, meta.nr_devices);
+    }
+    if (d == 0) {
+      fresh = false;
+      page_seq_ = meta.seq_lease;
+    }
+  }
+  // the first device is written last, a store it knows is complete
+  for (u32 d = 1; fresh && d < devices_.size(); d++) {
+    if (devices_[d]->WriteMeta(MakeMetaRecord(d, devices_.size())) != OK()) {
+      FATAL_PRINT("writing the metadata zone of device %u failed\n", d);
+    }
+  }
+  ExtendSeqLease(page_seq_.load());
+
   // INFO_PRINT("ZoneManagerPool is created \n");
   // INFO_PRINT("[Sieve Buffer] instances:%2d  pages:%6d\n", MAX_NUMS_ZONE,
   //  MAX_READ_CACHE_PAGES);
 }
 
 ZoneManagerPool::~ZoneManagerPool() {
+  StopCleaner();
+  SAFE_DELETE(cleaner_);
   for (auto& zbf : zone_buffers_) {
     SAFE_DELETE(zbf);
   }
-  SAFE_DELETE(zns_);
+  for (auto& zns : devices_) {
+    SAFE_DELETE(zns);
+  }
+  zns_ = nullptr;
   // INFO_PRINT("ZoneManagerPool is deleted\n");
 }
 
 Page* ZoneManagerPool::NewPageFrom(page_id_t* page_id, u64 length,
-                                   page_id_t from) {
+                                   page_id_t from, u32 temperature) {
   // 1. robin-round to get zone buffer
-  size_t start_index = index_;
-  size_t loop_index = index_;
-  index_ = (index_ + 1) % num_instances_;
+  size_t begin = 0;
+  std::atomic<zns_id_t>* index = nullptr;
+  size_t nums = ClassRange(temperature, &begin, &index);
+  auto zid = BufferIndex(GET_ZONE_ID(from));
+  // the class has no other zone buffer
+  if (nums == 1 && begin == zid) {
+    nums = ClassRange(ANY_TEMPERATURE, &begin, &index);
+  }
+  size_t start_index = *index % nums;
+  size_t loop_index = start_index;
+  *index = (start_index + 1) % nums;
   Page* ret_page = nullptr;
-  auto zid = zone_table_[GET_ZONE_ID(from)];
+  u32 waited_ms = 0;
+  assert(num_instances_ > 1);
   while (true) {
-    if (loop_index == zid) {
-      loop_index = (loop_index + 1) % num_instances_;
-      assert(num_instances_ > 1);
-      continue;
-    }
-    // 2. get page from zone buffer
-    ret_page = zone_buffers_[loop_index]->NewPage(page_id, length);
-    if (ret_page != nullptr) {
-      // 3. record the zid to zone_buffers_
-      zone_table_[GET_ZONE_ID(*page_id)] = loop_index;
-      return ret_page;
+    if (begin + loop_index != zid) {
+      // 2. get page from zone buffer
+      ret_page = zone_buffers_[begin + loop_index]->NewPage(page_id, length);
+      if (ret_page != nullptr) {
+        // 3. the zone is mapped since the zone buffer took it
+        return ret_page;
+      }
     }
-    loop_index = (loop_index + 1) % num_instances_;
-    if (loop_index == start_index) {
+    loop_index = (loop_index + 1) % nums;
+    if (loop_index == start_index && !WaitForZone(&waited_ms)) {
       return nullptr;
     }
   }
   return ret_page;
 }
 
-// :TODO: :hjl: the condition which zone is full is not implemented
-Page* ZoneManagerPool::NewPage(page_id_t* page_id, u64 length) {
+Page* ZoneManagerPool::NewPage(page_id_t* page_id, u64 length,
+                               u32 temperature, const char* data) {
   // 1. robin-round to get zone buffer
-  size_t start_index = index_;
-  size_t loop_index = index_;
-  index_ = (index_ + 1) % num_instances_;
+  size_t begin = 0;
+  std::atomic<zns_id_t>* index = nullptr;
+  size_t nums = ClassRange(temperature, &begin, &index);
+  size_t start_index = *index % nums;
+  size_t loop_index = start_index;
+  *index = (start_index + 1) % nums;
   Page* ret_page = nullptr;
+  u32 waited_ms = 0;
   while (true) {
     // 2. get page from zone buffer
-    ret_page = zone_buffers_[loop_index]->NewPage(page_id, length);
+    ret_page = zone_buffers_[begin + loop_index]->NewPage(page_id, length,
+                                                          false, data);
     if (ret_page != nullptr) {
-      // 3. record the zid to zone_buffers_
-      zone_table_[GET_ZONE_ID(*page_id)] = loop_index;
+      // 3. the zone is mapped since the zone buffer took it
       return ret_page;
     }
-    loop_index = (loop_index + 1) % num_instances_;
-    if (loop_index == start_index) {
+    loop_index = (loop_index + 1) % nums;
+    if (loop_index == start_index && !WaitForZone(&waited_ms)) {
       return nullptr;
     }
   }
   return ret_page;
 }
 
+size_t ZoneManagerPool::ClassRange(u32 temperature, size_t* begin,
+                                   std::atomic<zns_id_t>** index) {
+  if (temperature < NR_TEMPERATURES &&
+      class_begin_[temperature + 1] > class_begin_[temperature]) {
+    *begin = class_begin_[temperature];
+    *index = &class_index_[temperature];
+    return class_begin_[temperature + 1] - class_begin_[temperature];
+  }
+  *begin = 0;
+  *index = &index_;
+  return num_instances_;
+}
+
 // readonly
 Page* ZoneManagerPool::FetchPage(page_id_t page_id) {
   // 1. get zone buffer from pageid
   zns_id_t zid = GET_ZONE_ID(page_id);
   // 2. return the page from zone buffer
-  return zone_buffers_[zone_table_[zid]]->FetchPage(page_id);
+  ZoneManager* zbf = zone_buffers_[BufferIndex(zid)];
+  Page* page = zbf->FetchPage(page_id);
+  Rebalance(zbf);
+  return page;
+}
+
+void ZoneManagerPool::PrefetchPages(const page_id_t* page_ids, u32 num) {
+#if defined(USE_LRU_BUFFER) || defined(USE_SIEVE)
+  // the read caches are looked up
+  EpochGuard epoch;
+  Page* pages[MAX_PREFETCH_PAGES];
+  IOHandle io[MAX_PREFETCH_PAGES];
+  for (u32 base = 0; base < num; base += MAX_PREFETCH_PAGES) {
+    u32 end = std::min<u32>(num, base + MAX_PREFETCH_PAGES);
+    u32 n = 0;
+    // 1. submit all misses at once
+    for (u32 i = base; i < end; i++) {
+      page_id_t page_id = page_ids[i];
+      if (page_id == INVALID_PAGE_ID) continue;
+      Page* page = GetZone(page_id)->PrefetchPage(page_id);
+      if (page == nullptr) continue;
+      page_id = page->GetPageId();
+      Zone* zone = LookupZone(GET_ZONE_ID(page_id));
+      if (zone->AsyncRead(page->GetData(), PAGE_SIZE,
+                          GET_ZONE_OFFSET(page_id) * PAGE_SIZE,
+                          &io[n]) != Code::kOk) {
+        DESTROY_PAGE(page);
+        continue;
+      }
+      pages[n++] = page;
+    }
+    // 2. then reap them
+    for (u32 i = 0; i < n; i++) {
+      if (io[i].Wait() != PAGE_SIZE) {
+        DESTROY_PAGE(pages[i]);
+        continue;
+      }
+      GetZone(pages[i]->GetPageId())->InsertReadCache(pages[i]);
+    }
+  }
+  for (auto zbf : zone_buffers_) {
+    Rebalance(zbf);
+  }
+#endif
 }
 
 // append page
-Page* ZoneManagerPool::UpdatePage(page_id_t* page_id) {
+Page* ZoneManagerPool::UpdatePage(page_id_t* page_id, u32 temperature) {
   zns_id_t zid = GET_ZONE_ID(*page_id);
-  return zone_buffers_[zone_table_[zid]]->UpdatePage(page_id);
+  Page* ret_page = nullptr;
+  u32 waited_ms = 0;
+  ZoneManager* owner = zone_buffers_[BufferIndex(zid)];
+  size_t begin = 0;
+  std::atomic<zns_id_t>* index = nullptr;
+  size_t nums = ClassRange(temperature, &begin, &index);
+  if (nums < num_instances_ && owner->temperature_ != temperature) {
+    // 1. a page still in the FIFO is rewritten in place
+    ret_page = owner->UpdatePageInPlace(*page_id);
+    if (ret_page != nullptr) return ret_page;
+    // 2. otherwise the copy goes to the zones of its temperature. It is
+    // read first, a page filled after NewPage may be staged empty
+    alignas(PAGE_SIZE) char data[PAGE_SIZE];
+    if (!owner->MovePageOut(*page_id, data)) {
+      FATAL_PRINT("moving page:%lx to temperature %u failed\n", *page_id,
+                  temperature);
+    }
+    page_id_t new_page_id = INVALID_PAGE_ID;
+    ret_page = NewPage(&new_page_id, 1, temperature, data);
+    if (ret_page == nullptr) return nullptr;
+    *page_id = new_page_id;
+    return ret_page;
+  }
+  while ((ret_page = zone_buffers_[BufferIndex(zid)]->UpdatePage(page_id)) ==
+         nullptr) {
+    if (!WaitForZone(&waited_ms)) break;
+  }
+  Rebalance(owner);
+  return ret_page;
+}
+
+void ZoneManagerPool::Rebalance(ZoneManager* zbf, BufferPart part) {
+  u32 hits = zbf->ghost_hits_[part].exchange(0, std::memory_order_relaxed);
+  for (; hits > 0; hits--) {
+    u32 donor = 0;
+    BufferPart donor_part = FIFO_PART;
+    if (!governor_.Grow(zbf->buffer_index_, part, &donor, &donor_part)) {
+      break;
+    }
+    // the donor shrinks first, the parts stay within the budget
+    zone_buffers_[donor]->ApplyCapacity(donor_part);
+    zbf->ApplyCapacity(part);
+  }
+}
+
+bool ZoneManagerPool::DeletePage(page_id_t page_id) {
+  zns_id_t zid = GET_ZONE_ID(page_id);
+  return zone_buffers_[BufferIndex(zid)]->MovePageOut(page_id, nullptr);
 }
 
 bool ZoneManagerPool::UnpinPage(page_id_t page_id, bool is_dirty) {
   zns_id_t zid = GET_ZONE_ID(page_id);
-  return zone_buffers_[zone_table_[zid]]->UnpinPage(page_id, is_dirty);
+  return zone_buffers_[BufferIndex(zid)]->UnpinPage(page_id, is_dirty);
+}
+
+bool ZoneManagerPool::UnpinPage(Page* page, bool is_dirty) {
+  if (is_dirty) page->is_dirty_ = true;
+  // the FIFO and the read caches hold the pins, whoever drops the last one
+  // retires the page
+  Epoch::Leave();
+  return true;
+}
+
+void ZoneManagerPool::StartCleaner(
+    std::function<bool(zns_id_t, u64*)> migrate) {
+  if (cleaner_ != nullptr) return;
+#ifdef GC_COST_BENEFIT
+  cleaner_ = new ZoneCleaner(this, migrate, GCPolicy::kCostBenefit);
+#else
+  cleaner_ = new ZoneCleaner(this, migrate, GCPolicy::kGreedy);
+#endif
+}
+
+void ZoneManagerPool::StopCleaner() {
+  if (cleaner_ != nullptr) {
+    cleaner_->Stop();
+  }
+}
+
+Zone* ZoneManagerPool::AllocateZone(u32 device_id, bool use_reserved) {
+  ZnsManager* zns = devices_[device_id];
+  if (cleaner_ != nullptr && cleaner_->IsRunning()) {
+    u32 free_zones = zns->zbd_->GetFreeZones();
+    if (free_zones <= GC_START_FREE_ZONES) {
+      cleaner_->Wake();
+    }
+    // the cleaner needs free zones to move the leaves to
+    if (!use_reserved && free_zones <= GC_RESERVED_ZONES) {
+      return nullptr;
+    }
+  }
+  Zone* zone = zns->GetUsableZone();
+  if (zone != nullptr) {
+    opened_zones_++;
+  }
+  return zone;
+}
+
+bool ZoneManagerPool::WaitForZone(u32* waited_ms) {
+  if (cleaner_ == nullptr || !cleaner_->IsRunning() ||
+      *waited_ms >= GC_WAIT_ZONE_MS) {
+    return false;
+  }
+  cleaner_->Wake();
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  (*waited_ms)++;
+  return true;
+}
+
+u64 ZoneManagerPool::NextPageSeq() {
+  u64 seq = page_seq_.fetch_add(1);
+  if (seq >= seq_lease_.load(std::memory_order_acquire)) {
+    ExtendSeqLease(seq + 1);
+  }
+  return seq;
+}
+
+void ZoneManagerPool::AdvancePageSeq(u64 seq) {
+  u64 cur = page_seq_.load();
+  while (cur < seq && !page_seq_.compare_exchange_weak(cur, seq)) {
+  }
+}
+
+void ZoneManagerPool::ExtendSeqLease(u64 seq) {
+  std::lock_guard<std::mutex> guard(seq_mtx_);
+  if (seq <= seq_lease_.load()) return;
+  MetaRecord meta = MakeMetaRecord(0, devices_.size());
+  meta.seq_lease = seq + PAGE_SEQ_LEASE;
+  if (zns_->WriteMeta(meta) != OK()) {
+    FATAL_PRINT("writing the metadata zone failed\n");
+  }
+  seq_lease_.store(meta.seq_lease, std::memory_order_release);
+}
+
+void ZoneManagerPool::ScanPages(
+    u32 threads,
+    const std::function<void(u32, page_id_t, const char*)>& visit) {
+  std::vector<Zone*> zones;
+  for (auto zns : devices_) {
+    auto zbd = zns->zbd_;
+    for (const auto z : zbd->GetIOZones()) {
+      if (z == zbd->GetMetaZone() || z->IsEmpty()) continue;
+      // zones no zone buffer writes to are read through all of them
+      zones.push_back(z);
+    }
+  }
+
+  threads = std::max<u32>(1, std::min<u32>(threads, zones.size()));
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> workers;
+  for (u32 t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      const u64 chunk = RECOVERY_SCAN_PAGES * PAGE_SIZE;
+      char* buf = (char*)aligned_alloc(PAGE_SIZE, chunk);
+      for (size_t i = next++; i < zones.size(); i = next++) {
+        Zone* zone = zones[i];
+        // a finished zone is read up to its capacity, the pages that were
+        // never written are left to the visitor
+        u64 end = std::min(zone->wp_, zone->start_ + zone->GetMaxCapacity());
+        for (u64 offset = zone->start_; offset < end; offset += chunk) {
+          u32 size = std::min<u64>(chunk, end - offset);
+          if (zone->Read(buf, size, offset) != OK()) {
+            FATAL_PRINT("scanning zone %lu failed\n", zone->GetZoneNr());
+          }
+          for (u32 p = 0; p < size / PAGE_SIZE; p++) {
+            page_id_t page_id =
+                MAKE_PAGE_ID(GetZoneId(zone), offset / PAGE_SIZE + p);
+            visit(t, page_id, buf + p * PAGE_SIZE);
+          }
+        }
+      }
+      free(buf);
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+page_id_t ZoneManagerPool::ResolvePageId(page_id_t page_id) {
+#ifdef ZONE_APPEND
+  if (page_id != INVALID_PAGE_ID && IS_PROVISIONAL(page_id)) {
+    return GetZone(page_id)->ResolvePageId(page_id);
+  }
+#endif
+  return page_id;
+}
+
+void ZoneManagerPool::InvalidatePage(page_id_t page_id) {
+  if (page_id == INVALID_PAGE_ID) return;
+  Zone* zone = LookupZone(GET_ZONE_ID(page_id));
+  zone->MarkInvalid(GET_ZONE_OFFSET(page_id) * PAGE_SIZE);
+}
+
+void ZoneManagerPool::GetSpaceStats(SpaceStats* total,
+                                    std::vector<SpaceStats>* zones) {
+  *total = SpaceStats();
+  for (auto zns : devices_) {
+    auto zbd = zns->zbd_;
+    total->zone_id += zbd->GetNrZones();
+    for (const auto z : zbd->GetIOZones()) {
+      SpaceStats stats;
+      stats.zone_id = GetZoneId(z);
+      stats.written_pages = z->GetWrittenPages();
+      stats.valid_pages = z->GetValidPages();
+      stats.invalid_pages = z->GetInvalidPages();
+      stats.live_ratio = z->GetLiveRatio();
+      total->written_pages += stats.written_pages;
+      total->valid_pages += stats.valid_pages;
+      total->invalid_pages += stats.invalid_pages;
+      if (zones != nullptr) {
+        zones->push_back(stats);
+      }
+    }
+  }
+  u64 used = total->valid_pages + total->invalid_pages;
+  total->live_ratio = used == 0 ? 1.0 : total->valid_pages * 1.0 / used;
+}
+
+void ZoneManagerPool::PrintSpaceStats() {
+  SpaceStats total;
+  std::vector<SpaceStats> zones;
+  GetSpaceStats(&total, &zones);
+  INFO_PRINT("[ZoneSpace] written:%s valid:%s invalid:%s live:" KCYN
+             "%2.2lf%%" KRESET " dead:%2.2lf%% space amp:%2.2lf\n",
+             CalSize(total.written_pages * PAGE_SIZE).c_str(),
+             CalSize(total.valid_pages * PAGE_SIZE).c_str(),
+             CalSize(total.invalid_pages * PAGE_SIZE).c_str(),
+             total.live_ratio * 100, (1 - total.live_ratio) * 100,
+             total.valid_pages == 0
+                 ? 0.0
+                 : (total.valid_pages + total.invalid_pages) * 1.0 /
+                       total.valid_pages);
+  INFO_PRINT("[ZoneSpace] live ratio per zone:");
+  int printed = 0;
+  for (auto& stats : zones) {
+    if (stats.valid_pages + stats.invalid_pages == 0) continue;
+    if (printed++ % 8 == 0) {
+      INFO_PRINT("\n  ");
+    }
+    INFO_PRINT(" {%4lu->%6.2lf%%}", stats.zone_id, stats.live_ratio * 100);
+  }
+  INFO_PRINT("\n");
+}
+
+bool ZoneManagerPool::RelocatePage(page_id_t* page_id, void* leaf_ptr) {
+  page_id_t raw_page_id = *page_id;
+  page_id_t old_page_id = ResolvePageId(raw_page_id);
+  if (old_page_id == INVALID_PAGE_ID) return false;
+  ZoneManager* owner = GetZone(old_page_id);
+  char* data = (char*)aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+
+  // 1. the victim zone is finished, so the page is either in the read cache
+  // of its owner or on the device
+  Page* evicted = nullptr;
+#ifdef USE_LRU_BUFFER
+  evicted = owner->lru_buffer_.evict(old_page_id);
+#elif defined(USE_SIEVE)
+  evicted = owner->sieve_.evict(old_page_id);
+#endif
+  if (evicted != nullptr) {
+    memcpy(data, evicted->GetData(), PAGE_SIZE);
+    evicted->SetStatus(PageStatus::EVICTED);
+    int cnt = evicted->pin_count_.fetch_sub(1);
+    if (cnt == 1) {
+      RETIRE_PAGE(evicted);
+    }
+  } else {
+    Zone* zone = LookupZone(GET_ZONE_ID(old_page_id));
+    if (zone->Read(data, PAGE_SIZE, GET_ZONE_OFFSET(old_page_id) * PAGE_SIZE)) {
+      free(data);
+      return false;
+    }
+  }
+
+  // 2. write it through any zone buffer, the reserved zones may be used.
+  // what survives a zone is cold, start with the coldest class
+  size_t begin = 0;
+  std::atomic<zns_id_t>* index = nullptr;
+  size_t nums = ClassRange(0, &begin, &index);
+  size_t loop_index = begin + *index % nums;
+  *index = (*index + 1) % nums;
+  for (u32 i = 0; i < num_instances_; i++) {
+    ZoneManager* zbf = zone_buffers_[loop_index];
+    Page* page = zbf->NewPage(page_id, 1, true);
+    if (page != nullptr) {
+      page->WLatch();
+      if (!page->IsWritable(*page_id)) {
+        // a writer switched the zone before the copy, try this buffer again
+        page->WUnlatch();
+        UnpinPage(page, false);
+        InvalidatePage(*page_id);
+        i--;
+        continue;
+      }
+      memcpy(page->GetData(), data, PAGE_SIZE);
+      page->SetLeafPtr(leaf_ptr);
+      page->WUnlatch();
+      UnpinPage(page, true);
+      InvalidatePage(old_page_id);
+#ifdef ZONE_APPEND
+      if (IS_PROVISIONAL(raw_page_id)) {
+        GetZone(raw_page_id)->RetirePageId(raw_page_id);
+      }
+#endif
+      free(data);
+      return true;
+    }
+    loop_index = (loop_index + 1) % num_instances_;
+  }
+  *page_id = raw_page_id;
+  free(data);
+  return false;
+}
+
+void ZoneManagerPool::EvictZonePages(Zone* zone) {
+#if defined(USE_LRU_BUFFER) || defined(USE_SIEVE)
+  // page ids are reused once the zone is written again. The lock waits for
+  // the misses which read the zone before it was cleared
+  std::vector<Page*> victims;
+  for (auto& zbf : zone_buffers_) {
+    WriteLockGuard guard(zbf->rw_lock_);
+#ifdef USE_LRU_BUFFER
+    zbf->lru_buffer_.evict_zone(GetZoneId(zone), &victims);
+#else
+    zbf->sieve_.evict_zone(GetZoneId(zone), &victims);
+#endif
+  }
+  for (Page* evicted : victims) {
+    evicted->SetStatus(PageStatus::EVICTED);
+    int cnt = evicted->pin_count_.fetch_sub(1);
+    if (cnt == 1) {
+      RETIRE_PAGE(evicted);
+    }
+  }
+#endif
 }
 
 void ZoneManagerPool::FlushAllPages() {
@@ -1251,18 +2365,27 @@ u64 ZoneManagerPool::GetPoolSize() {
 }
 
 u64 ZoneManagerPool::GetFileSize() {
-  auto zbd_ = zns_->zbd_;
-  return zbd_->GetTotalBytesWritten();
+  u64 total = 0;
+  for (auto zns : devices_) {
+    total += zns->zbd_->GetTotalBytesWritten();
+  }
+  return total;
 }
 
 u64 ZoneManagerPool::GetReadCount() {
-  auto zbd_ = zns_->zbd_;
-  return zbd_->GetReadCount();
+  u64 total = 0;
+  for (auto zns : devices_) {
+    total += zns->zbd_->GetReadCount();
+  }
+  return total;
 }
 
 u64 ZoneManagerPool::GetWriteCount() {
-  auto zbd_ = zns_->zbd_;
-  return zbd_->GetWriteCount();
+  u64 total = 0;
+  for (auto zns : devices_) {
+    total += zns->zbd_->GetWriteCount();
+  }
+  return total;
 }
 
 void ZoneManagerPool::PrintReadCache() {
@@ -1307,22 +2430,21 @@ void ZoneManagerPool::Print() {
   for (auto& buffer : zone_buffers_) {
     auto instance = buffer;
     // instance->Print();
-    page_table_size += instance->page_table_.size();
+    page_table_size += instance->page_table_.Size();
     replacer_size += instance->replacer_->Size();
 
     count += instance->count_;
     miss += instance->miss_;
     hit += instance->hit_;
-    total += instance->page_id_counts_.size();
+    total += instance->page_id_counts_.Size();
   }
 
   std::vector<page_id_t> page_ids;
   page_ids.reserve(total);
   for (auto& buffer : zone_buffers_) {
     auto instance = buffer;
-    for (auto& count : instance->page_id_counts_) {
-      page_ids.push_back(count.second);
-    }
+    instance->page_id_counts_.ForEach(
+        [&](page_id_t, u64 count) { page_ids.push_back(count); });
   }
   std::sort(page_ids.begin(), page_ids.end());
   size_t avg = 0;
@@ -1353,9 +2475,24 @@ void ZoneManagerPool::Print() {
       "[ZoneBufferPool] count:%4lu miss: %4lu %2.2lf%% hit: %4lu "
       "hit_ratio: " KCYN "%2.2lf%%" KRESET "\n",
       count, miss, miss_ratio, hit, hit_ratio);
+  u64 parts[NR_BUFFER_PARTS] = {0};
+  for (u32 i = 0; i < num_instances_; i++) {
+    for (u32 part = 0; part < NR_BUFFER_PARTS; part++) {
+      parts[part] += governor_.GetCapacity(i, static_cast<BufferPart>(part));
+    }
+  }
+  INFO_PRINT("[MemoryGovernor] budget: %lu pages fifo: %lu read cache: %lu "
+             "moved: %lu\n",
+             governor_.GetBudget(), parts[FIFO_PART], parts[READ_CACHE_PART],
+             governor_.GetMovedPages());
+  PrintSpaceStats();
+  if (cleaner_ != nullptr) {
+    cleaner_->Print();
+  }
 }
 
 void ZoneManagerPool::Close() {
+  StopCleaner();
   for (auto zbuffer : zone_buffers_) {
     // zone->FlushAllPages();
     delete zbuffer;
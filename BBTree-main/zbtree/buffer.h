@@ -1,16 +1,23 @@
 #pragma once
 #include <algorithm>
+#include <condition_variable>  // NOLINT
+#include <deque>
+#include <functional>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <mutex>  // NOLINT
+#include <thread>  // NOLINT
 #include <unordered_map>
 #include <vector>
 
 #include "../zns/zone_device.h"
-#include "ThreadSafeMap.h"
 #include "config.h"
+#include "epoch.h"
 #include "lru_buffer.h"
+#include "mem_governor.h"
 #include "page.h"
+#include "page_table.h"
 #include "replacer.h"
 #include "storage.h"
 
@@ -373,6 +380,17 @@ class FIFOBatchReplacer {
   // u32 fifo_tail_;
 };
 class ZoneManagerPool;
+class ZoneCleaner;
+/* valid/invalid pages of a zone, or of the whole device.
+ * written pages follow the write pointer, pages still in the FIFO are not
+ * written yet but already valid */
+struct SpaceStats {
+  u64 zone_id = 0;
+  u64 written_pages = 0;
+  u64 valid_pages = 0;
+  u64 invalid_pages = 0;
+  double live_ratio = 1.0;
+};
 typedef std::pair<Page *, u64> Slot;
 class ZoneManager {
  public:
@@ -381,43 +399,140 @@ class ZoneManager {
   ~ZoneManager();
 
   void SetPoolPtr(ZoneManagerPool *zmp) { zmp_ = zmp; }
-  bool AllocatePageId(page_id_t *page_id);
+  /* return false if no zone is left, use_reserved is only for the cleaner */
+  bool AllocatePageId(page_id_t *page_id, bool use_reserved = false);
   // get page from hash map
   Page *GetPageImp(page_id_t page_id);
   Page *AllocateSeqPage(u64 length = 1);
   Page *GrabPageFrameImp(u64 length = 1);
   bool ReadPageFromZNSImp(bytes_t *data, zns_id_t zid, u32 page_nums = 1);
   // no lock
-  Page *NewPageImp(page_id_t *page_id, u64 length = 1);
+  Page *NewPageImp(page_id_t *page_id, u64 length = 1,
+                   bool use_reserved = false);
 
   /* allocate a page in zns
-   * if length > 1 pageid will be consecutive in a zone*/
-  Page *NewPage(page_id_t *page_id, u64 length = 1);
+   * if length > 1 pageid will be consecutive in a zone. data is copied in
+   * before the flusher may take the pages */
+  Page *NewPage(page_id_t *page_id, u64 length = 1, bool use_reserved = false,
+                const char *data = nullptr);
   /* rewrite a existed page into a new page in CoW-style*/
   Page *UpdatePage(page_id_t *page_id);
+  // no lock
+  Page *UpdatePageImp(page_id_t *page_id);
+  /* the page if it is still in the FIFO, it is rewritten in place */
+  Page *UpdatePageInPlace(page_id_t page_id);
+  /* the page moves to another zone buffer, copy its data and invalidate it.
+   * Without data the page is dropped */
+  bool MovePageOut(page_id_t page_id, char *data);
   /* read a existed page in zns*/
   Page *FetchPage(page_id_t page_id);
-  /* unpin a page in circle buffer or read cache */
+  /* the pages missing in both caches get a frame, the caller reads them */
+  Page *PrefetchPage(page_id_t page_id);
+  /* insert a prefetched page into the read cache */
+  void InsertReadCache(Page *page);
+  /* the caller is done with the page, it leaves the epoch it got it in */
   bool UnpinPage(page_id_t page_id, bool is_dirty);
   void FlushAllPages();
 
   void FlushIfFull() {
-    WriteLockGuard guard(rw_lock_);
-    if (replacer_->IsFull()) {
-      for (int i = 0; i < BATCH_SIZE; ++i) {
-        Item *item = nullptr;
-        if (!replacer_->Victim(&item)) break;
-        Page *page = (Page *)item->data_;
-        AppendPage(page);
-      }
-      FlushBatchedPage();
+#ifdef ZONE_APPEND
+    {
+      WriteLockGuard guard(rw_lock_);
+      if (!replacer_->IsFull()) return;
+      DetachBatch();
+    }
+    DrainAppends();
+    return;
+#endif
+    {
+      WriteLockGuard guard(rw_lock_);
+      if (!replacer_->IsFull()) return;
+      StageBatch();
     }
+    ThrottleFlush();
   }
 
+  /**
+   * Background flush. Writers move up to BATCH_SIZE FIFO victims into a
+   * staged batch under rw_lock_ and go on, flush_thread_ copies and writes
+   * the batches in order without the lock. A staged page stays in
+   * page_table_ as FLUSHED until its write completed, reads find it in
+   * memory and never read a page before it is on the device.
+   */
+  /* move up to BATCH_SIZE victims to the flusher, write lock held */
+  bool StageBatch();
+  /* wait until the flusher wrote every staged page, write lock held */
+  void DrainStaged();
+  /* wait while more than MAX_STAGED_BATCHES are staged, no lock held */
+  void ThrottleFlush();
+  void FlushLoop();
+
+  /**
+   * pages merged into one zone write, at most MAX_BATCH_SIZE. With
+   * AUTO_BATCH_SIZE it starts from the device block and zone size and keeps
+   * doubling while the bandwidth of the appends grows. Takes effect with
+   * the next batch buffer.
+   */
+  void SetBatchSize(u32 pages);
+  u32 GetBatchSize() { return batch_size_.load(std::memory_order_relaxed); }
+  /* one full batch was written in ns, flusher only */
+  void TuneBatchSize(u64 bytes, u64 ns);
+
+  /**
+   * Memory governor, see ADAPTIVE_BUFFER_SPLIT. The ids of the pages that
+   * leave the FIFO or the read cache go to a ghost list, a miss on one of
+   * them is counted in ghost_hits_ for the pool to rebalance.
+   */
+  /* size the ghost lists, before the buffer is used */
+  void InitGhosts(u64 fifo_pages, u64 cache_pages);
+  void AddGhost(BufferPart part, page_id_t page_id) {
+#ifdef ADAPTIVE_BUFFER_SPLIT
+    ghosts_[part].Add(page_id);
+#endif
+  }
+  void CheckGhost(BufferPart part, page_id_t page_id) {
+#ifdef ADAPTIVE_BUFFER_SPLIT
+    if (ghosts_[part].Hit(page_id)) {
+      ghost_hits_[part].fetch_add(1, std::memory_order_relaxed);
+    }
+#endif
+  }
+  /* resize the part to what the governor gives it, no lock held */
+  void ApplyCapacity(BufferPart part);
+
+  /* the flusher and the drainers only */
   void AppendPage(Page *page);
+  /* submit the batch buffer, move on to the oldest one */
   void FlushBatchedPage();
+  /* wait for the write of batch idx, its pages leave page_table_ */
+  void WaitBatch(int32_t idx);
+  /* wait for every write in flight, before the zone gets finished */
+  void WaitAllBatches();
+  /* a written page moves to the read cache, unless it was rewritten */
+  void PublishPage(Page *page);
 
-  void AddPage(Slot slot);
+  /**
+   * Zone append (ZONE_APPEND). A detached batch is written without rw_lock_,
+   * several threads may drain batches into the zone at once.
+   */
+  struct AppendBatch {
+    Zone *zone = nullptr;
+    char *buf = nullptr;
+    u32 pages = 0;
+    u64 placed = 0;
+    std::vector<Page *> page;
+  };
+  /* move up to BATCH_SIZE pages of the FIFO into a batch, write lock held */
+  bool DetachBatch();
+  /* write the detached batches, no lock needed */
+  void DrainAppends();
+  /* publish the placed batches, write lock held */
+  void ReapAppends();
+  /* the placed id of a provisional id, INVALID_PAGE_ID if it is gone */
+  page_id_t ResolvePageId(page_id_t page_id);
+  /* nobody refers to the provisional id any more, it still resolves for
+   * the next REMAP_GRACE retirements */
+  void RetirePageId(page_id_t page_id);
 
   void RMPage(Page *page);
 
@@ -425,13 +540,13 @@ class ZoneManager {
   bool IsFull(u64 length = 1);
 
   void HitHelper() {
-    count_++;
-    hit_++;
+    count_.fetch_add(1, std::memory_order_relaxed);
+    hit_.fetch_add(1, std::memory_order_relaxed);
   }
 
   void MissHelper() {
-    count_++;
-    miss_++;
+    count_.fetch_add(1, std::memory_order_relaxed);
+    miss_.fetch_add(1, std::memory_order_relaxed);
   }
 
  public:
@@ -447,13 +562,63 @@ class ZoneManager {
   // the end of this zone
   offset_t end_;
   Zone *zone_;
-  int32_t buffer_pages_ = 0;
-  char *pages_buffer_ = nullptr;
+  u32 buffer_pages_ = 0;
+  /* batches written through the io_uring straight from the page frames,
+   * frames next to each other in memory share a piece */
+  std::vector<struct iovec> batch_iov_[MAX_INFLIGHT_BATCHES];
+  IOHandle batch_io_[MAX_INFLIGHT_BATCHES];
+  offset_t batch_offset_[MAX_INFLIGHT_BATCHES] = {0};
+  u64 batch_bytes_[MAX_INFLIGHT_BATCHES] = {0};
+  /* the pages of each batch, published once it is written */
+  std::vector<Page *> batch_pages_[MAX_INFLIGHT_BATCHES];
+  u32 batch_nr_pages_[MAX_INFLIGHT_BATCHES] = {0};
+  u64 batch_submit_ns_[MAX_INFLIGHT_BATCHES] = {0};
+  int32_t cur_batch_ = 0;
+  /* the batch size of the batch being filled */
+  u32 cur_batch_size_ = BATCH_SIZE;
+
+  std::atomic<u32> batch_size_{BATCH_SIZE};
+  bool auto_batch_ = false;
+  /* auto tuning, the flusher only */
+  u32 max_batch_size_ = MAX_BATCH_SIZE;
+  u32 tune_appends_ = 0;
+  u64 tune_bytes_ = 0;
+  u64 tune_ns_ = 0;
+  double tune_bandwidth_ = 0;
+
+  /* batches for flush_thread_, the front one stays until it is written */
+  std::mutex flush_mtx_;
+  std::condition_variable flush_cv_;
+  std::condition_variable flushed_cv_;
+  std::deque<std::vector<Page *>> staged_;
+  bool stop_flush_ = false;
+  std::thread flush_thread_;
+
+  /* provisional ids of ZONE_APPEND, see PROVISIONAL_ZONE_BASE */
+  zns_id_t provisional_zone_ = 0;
+  u64 provisional_seq_ = 0;
+  /* detached and placed batches, guarded by append_mtx_ */
+  std::mutex append_mtx_;
+  std::deque<AppendBatch *> pending_;
+  std::deque<AppendBatch *> placed_;
+  /* batches detached but not written yet */
+  std::atomic<u32> appending_{0};
+  /* provisional -> placed page id, guarded by remap_mtx_ */
+  std::mutex remap_mtx_;
+  std::unordered_map<page_id_t, page_id_t> remap_;
+  std::deque<page_id_t> retired_;
   // the zone id in the zns device
   zns_id_t zone_id_;
+  // offset in zone_buffers_
+  u32 buffer_index_ = 0;
+  GhostList ghosts_[NR_BUFFER_PARTS];
+  std::atomic<u32> ghost_hits_[NR_BUFFER_PARTS] = {0, 0};
+  // the temperature class of the leaves written here
+  u32 temperature_ = 0;
   std::mutex m_;
 
-  std::unordered_map<page_id_t, Page *> page_table_;
+  // pages in the FIFO and the batches in flight
+  PageTable<Page *> page_table_;
 
   void *read_cache_;
   /* FIFO Write & Read Cacche */
@@ -462,11 +627,11 @@ class ZoneManager {
   /* RingFlusher */
   // CircleBuffer<Slot> *flusher_;
 
-  // Helper variables
-  u64 count_ = 0;
-  u64 hit_ = 0;
-  u64 miss_ = 0;
-  std::unordered_map<page_id_t, frame_id_t> page_id_counts_;
+  // Helper variables, bumped by concurrent readers
+  std::atomic<u64> count_{0};
+  std::atomic<u64> hit_{0};
+  std::atomic<u64> miss_{0};
+  PageTable<u64> page_id_counts_;
 
   ReaderWriterLatch *rw_lock_;
 #ifdef USE_LRU_BUFFER
@@ -477,32 +642,163 @@ class ZoneManager {
 #endif
 };
 
+/* the temperature class of a leaf heat, 0 is the coldest */
+inline u32 HeatToTemperature(u32 heat) {
+  u32 temperature = 0;
+  u64 threshold = HOT_LEAF_HEAT;
+  while (temperature + 1 < NR_TEMPERATURES && heat >= threshold) {
+    temperature++;
+    threshold *= HOT_LEAF_HEAT;
+  }
+  return temperature;
+}
+
 class ZoneManagerPool {
  public:
   ZoneManagerPool() = delete;
-  ZoneManagerPool(u32 pool_size, u32 num_instances_, const char *db_file);
+  /**
+   * db_file lists the devices to stripe over separated by ',', the zone
+   * buffers are spread over them. num_instances is cut down to what the
+   * devices can keep open.
+   */
+  /**
+   * budget_bytes are shared by the FIFOs and read caches of all zone
+   * buffers, 0 gives every buffer MAX_CACHED_PAGES_PER_ZONE and SIEVE_SIZE
+   * pages. See MemoryGovernor.
+   */
+  ZoneManagerPool(u32 pool_size, u32 num_instances, const char *db_file,
+                  u64 budget_bytes = 0);
   ~ZoneManagerPool();
 
+  /**
+   * The pages handed out are not pinned, the caller stays in an epoch until
+   * it unpins them. See Epoch.
+   */
   /* allocate a page in zns
-   * if length > 1 pageid will be consecutive in a zone*/
-  Page *NewPage(page_id_t *page_id, u64 length = 1);
-  Page *NewPageFrom(page_id_t *page_id, u64 length, page_id_t from);
-  /* rewrite a existed page into a new page in CoW-style*/
-  Page *UpdatePage(page_id_t *page_id);
+   * if length > 1 pageid will be consecutive in a zone, see
+   * ZoneManager::NewPage for data */
+  Page *NewPage(page_id_t *page_id, u64 length = 1,
+                u32 temperature = ANY_TEMPERATURE, const char *data = nullptr);
+  Page *NewPageFrom(page_id_t *page_id, u64 length, page_id_t from,
+                    u32 temperature = ANY_TEMPERATURE);
+  /* rewrite a existed page into a new page in CoW-style, the copy goes to
+   * the zone buffers of temperature */
+  Page *UpdatePage(page_id_t *page_id, u32 temperature = ANY_TEMPERATURE);
   /* read a existed page in zns*/
   Page *FetchPage(page_id_t page_id);
+  /**
+   * bring pages into the read caches, the misses are read from the zns ssd
+   * together instead of one by one. Pages held by the FIFO are skipped.
+   */
+  void PrefetchPages(const page_id_t *page_ids, u32 num);
+  /* nothing points to the page any more, it leaves the caches and its slot
+   * on the device counts as garbage */
+  bool DeletePage(page_id_t page_id);
 
   bool UnpinPage(page_id_t page_id, bool is_dirty);
+  /* unpin the page the caller got, by id the page may not be found anymore */
+  bool UnpinPage(Page *page, bool is_dirty);
+
+  /**
+   * Zone garbage collection
+   */
+  /* the index calls migrate to move the leaves out of a victim zone */
+  void StartCleaner(std::function<bool(zns_id_t, u64 *)> migrate);
+  void StopCleaner();
+  /* hand out a free zone of the device, nullptr if only the reserved ones
+   * are left */
+  Zone *AllocateZone(u32 device_id, bool use_reserved = false);
+  /* wait for the cleaner, return false once GC_WAIT_ZONE_MS is over */
+  bool WaitForZone(u32 *waited_ms);
+  /* the page got a new copy, clear its bit in the valid bitmap */
+  void InvalidatePage(page_id_t page_id);
+  /* device-wide totals, zone_id of total is the number of zones */
+  void GetSpaceStats(SpaceStats *total,
+                     std::vector<SpaceStats> *zones = nullptr);
+  void PrintSpaceStats();
+  /* copy a page of a victim zone into a new page owned by leaf_ptr */
+  bool RelocatePage(page_id_t *page_id, void *leaf_ptr);
+  /* drop the stale copies of a zone from all read caches before its reset */
+  void EvictZonePages(Zone *zone);
+
+  /**
+   * Zone append, see ZONE_APPEND. The index hands in how to move a leaf from
+   * its provisional page id to the placed one, it must not block.
+   */
+  void SetPageIdFixup(std::function<bool(void *, page_id_t, page_id_t)> fixup) {
+    fixup_ = fixup;
+  }
+  /* the id the page has on the device, provisional ids are looked up */
+  page_id_t ResolvePageId(page_id_t page_id);
+
+  /**
+   * Hot/cold placement, see NR_TEMPERATURES. The zone buffers of a class
+   * are [begin, begin + return), index is its round robin position.
+   */
+  size_t ClassRange(u32 temperature, size_t *begin,
+                    std::atomic<zns_id_t> **index);
+  /* the clock leaf heat decays by */
+  u64 GetHeatEpoch() { return opened_zones_.load() / num_instances_; }
+
+  /**
+   * Restart from the device, see PAGE_SEQ_LEASE. The index stamps its leaf
+   * pages with NextPageSeq, a number above the lease is only handed out
+   * once the metadata zone holds the next lease.
+   */
+  u64 NextPageSeq();
+  /* the numbers below seq are taken, e.g. found on the device */
+  void AdvancePageSeq(u64 seq);
+  /* persist a lease that covers the numbers below seq */
+  void ExtendSeqLease(u64 seq);
+  /**
+   * call visit(worker, page_id, data) for every page written to the data
+   * zones, threads workers read the zones concurrently
+   */
+  void ScanPages(
+      u32 threads,
+      const std::function<void(u32, page_id_t, const char *)> &visit);
 
   void FlushAllPages();
   void FlushIfFull(page_id_t page_id) {
-    zns_id_t zid = GET_ZONE_ID(page_id);
-    return zone_buffers_[zone_table_[zid]]->FlushIfFull();
+    return GetZone(page_id)->FlushIfFull();
   }
 
   ZoneManager *GetZone(page_id_t page_id) {
-    zns_id_t zid = GET_ZONE_ID(page_id);
-    return zone_buffers_[zone_table_[zid]];
+    return zone_buffers_[BufferIndex(GET_ZONE_ID(page_id))];
+  }
+
+  /* the index in zone_buffers_ of the buffer a zone belongs to, lock free */
+  u32 BufferIndex(zns_id_t zid) {
+#ifdef ZONE_APPEND
+    if (zid >= PROVISIONAL_ZONE_BASE) return zid - PROVISIONAL_ZONE_BASE;
+#endif
+    return zone_table_[zid].load(std::memory_order_acquire);
+  }
+  /* the zone buffer writes to the zone from now on */
+  void MapZone(zns_id_t zid, u32 index) {
+    zone_table_[zid].store(index, std::memory_order_release);
+  }
+
+  /* the zone on the device, zid is the zone id of a placed page id */
+  Zone *LookupZone(zns_id_t zid) {
+    return devices_[GET_DEVICE_ID(zid)]->zbd_->GetZone(GET_ZONE_NR(zid));
+  }
+  u32 GetNrDevices() { return devices_.size(); }
+  /* move memory to the parts of zbf with ghost hits, no lock held */
+  void Rebalance(ZoneManager *zbf) {
+#ifdef ADAPTIVE_BUFFER_SPLIT
+    for (u32 part = 0; part < NR_BUFFER_PARTS; part++) {
+      if (zbf->ghost_hits_[part].load(std::memory_order_relaxed) > 0) {
+        Rebalance(zbf, static_cast<BufferPart>(part));
+      }
+    }
+#endif
+  }
+  void Rebalance(ZoneManager *zbf, BufferPart part);
+
+  /* see ZoneManager::SetBatchSize */
+  void SetBatchSize(u32 pages) {
+    for (auto zbf : zone_buffers_) zbf->SetBatchSize(pages);
   }
 
   /**
@@ -519,22 +815,35 @@ class ZoneManagerPool {
 
  public:
   const u32 pool_size_;
-  // total number of zones
-  const u32 num_instances_;
+  // total number of zone buffers, one open zone each
+  u32 num_instances_;
   // round robin index for zone buffer
   std::atomic<zns_id_t> index_;
+  // zone buffers of each temperature class and their round robin index
+  size_t class_begin_[NR_TEMPERATURES + 1];
+  std::atomic<zns_id_t> class_index_[NR_TEMPERATURES];
+  std::atomic<u64> opened_zones_{0};
+  // next leaf page sequence number, the ones below seq_lease_ are persisted
+  std::atomic<u64> page_seq_{1};
+  std::atomic<u64> seq_lease_{0};
+  std::mutex seq_mtx_;
   std::mutex m_;
+  // the striped devices, the first one holds the metadata of the store
+  std::vector<ZnsManager *> devices_;
   ZnsManager *zns_;
   std::vector<ZoneManager *> zone_buffers_;
-  // key is zone id, value is the offset in zone_buffers_
-  // std::unordered_map<zns_id_t, u32> zone_table_;
-  ThreadSafeMap<zns_id_t, u32> zone_table_;
+  // zone id -> offset in zone_buffers_, a zone no buffer writes to is read
+  // through buffer zid % num_instances_
+  std::unique_ptr<std::atomic<u32>[]> zone_table_;
+  ZoneCleaner *cleaner_ = nullptr;
+  std::function<bool(void *, page_id_t, page_id_t)> fixup_;
+  MemoryGovernor governor_;
 };
 
 class NodeRAII {
  public:
   NodeRAII(void *buffer_pool_manager, page_id_t &page_id,
-           bool read_only = READ_ONLY)
+           bool read_only = READ_ONLY, u32 temperature = ANY_TEMPERATURE)
       : buffer_pool_manager_(buffer_pool_manager), page_id_(page_id) {
     page_ = nullptr;
     dirty_ = false;
@@ -552,7 +861,7 @@ class NodeRAII {
     if (read_only) {
       page_ = zmp->FetchPage(page_id_);
     } else {
-      page_ = zmp->UpdatePage(&page_id_);
+      page_ = zmp->UpdatePage(&page_id_, temperature);
       page_id = page_id_;
     }
     // if(page_ != nullptr) {
@@ -565,7 +874,8 @@ class NodeRAII {
   }
 
   NodeRAII(void *buffer_pool_manager, page_id_t *page_id,
-           page_id_t from = INVALID_PAGE_ID)
+           page_id_t from = INVALID_PAGE_ID,
+           u32 temperature = ANY_TEMPERATURE)
       : buffer_pool_manager_(buffer_pool_manager) {
     page_ = nullptr;
 #ifdef NO_BUFFER_POOL
@@ -582,9 +892,9 @@ class NodeRAII {
 #elif defined(ZNS_BUFFER_POOL)
     ZoneManagerPool *zmp = (ZoneManagerPool *)buffer_pool_manager_;
     if (from != INVALID_PAGE_ID) {
-      page_ = zmp->NewPageFrom(&page_id_, 1, from);
+      page_ = zmp->NewPageFrom(&page_id_, 1, from, temperature);
     } else {
-      page_ = zmp->NewPage(&page_id_);
+      page_ = zmp->NewPage(&page_id_, 1, temperature);
     }
     read_flag_ = WRITE_FLAG;
     CheckAndInitPage();
@@ -617,19 +927,10 @@ class NodeRAII {
       // DEBUG_PRINT("raii unpin\n");
     }
 #elif defined(ZNS_BUFFER_POOL)
-#if defined(USE_LRU_BUFFER) || defined(USE_SIEVE)
     if (page_ != nullptr) {
       ZoneManagerPool *zmp = (ZoneManagerPool *)buffer_pool_manager_;
-      zmp->UnpinPage(page_id_, dirty_);
+      zmp->UnpinPage(page_, dirty_);
     }
-#else
-    if (page_ != nullptr) {
-      page_->Unpin();
-      if (page_->pin_count_ == 0) {
-        DESTROY_PAGE(page_);
-      }
-    }
-#endif
 #endif
   }
 
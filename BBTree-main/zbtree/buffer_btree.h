@@ -7,12 +7,14 @@
 #include <atomic>
 #include <cassert>
 #include <cstring>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <mutex>
 #include <queue>
 #include <shared_mutex>
 #include <thread>
+#include <type_traits>
 #include <unordered_set>
 
 #include "thread_pool.h"
@@ -91,6 +93,11 @@ struct BTreeLeafBase : public NodeBase {
   static const PageType typeMarker = PageType::BTreeLeaf;
 };
 
+/*
+ * A delete is buffered as a tombstone entry, the key with TOMBSTONE_VALUE as
+ * its payload. It shadows the key in the batches and the device tree until
+ * its own batch removes the key there.
+ */
 template <class Key, class Payload>
 struct BTreeLeaf : public BTreeLeafBase {
   struct Entry {
@@ -121,7 +128,16 @@ struct BTreeLeaf : public BTreeLeafBase {
 
   bool isFull() { return count == maxEntries; };
 
-  unsigned lowerBound(Key k) {
+  bool isTombstone(unsigned pos) { return payloads[pos] == TOMBSTONE_VALUE; }
+
+  unsigned lowerBound(Key k) { return lowerBound(keys, count, k); }
+
+  /* for an optimistic reader, a flush may take the arrays of the leaf while
+   * it reads them. It reads keys and count once */
+  static unsigned lowerBound(const Key *keys, unsigned count, Key k) {
+    if constexpr (std::is_same_v<Key, u64>) {
+      return KeySearch::LowerBound(keys, count, k);
+    }
     unsigned lower = 0;
     unsigned upper = count;
     do {
@@ -214,20 +230,14 @@ struct BTreeInner : public BTreeInnerBase {
 
   bool isFull() { return count == (maxEntries - 1); };
 
-  unsigned lowerBoundBF(Key k) {
-    auto base = keys;
-    unsigned n = count;
-    while (n > 1) {
-      const unsigned half = n / 2;
-      base = (base[half] < k) ? (base + half) : base;
-      n -= half;
-    }
-    return (*base < k) + base - keys;
-  }
-
   unsigned lowerBound(Key k) {
+    // the flushed leaves may have left a single child, count is 0 then
+    if constexpr (std::is_same_v<Key, u64>) {
+      return KeySearch::LowerBound(keys, count, k);
+    }
     unsigned lower = 0;
     unsigned upper = count;
+    if (count == 0) return 0;
     do {
       unsigned mid = ((upper - lower) / 2) + lower;
       if (k < keys[mid]) {
@@ -428,7 +438,13 @@ struct BufferBTreeImp {
       }
       // Split
       if (leaf->access_count == LEAF_DELETED_FLAG) {
-        parent->remove_leaf(leaf);
+        // the only child of its parent is reused, the parent had no key left
+        if (parent && parent->count > 0) {
+          parent->remove_leaf(leaf);
+        } else {
+          leaf->access_count = 0;
+          node->writeUnlock();
+        }
       } else {
         Key sep;
         BTreeLeaf<Key, Value> *newLeaf = leaf->split(sep);
@@ -466,6 +482,9 @@ struct BufferBTreeImp {
     }
   }
 
+  /* buffer a tombstone, it is flushed like an insert */
+  void remove(Key k) { insert(k, TOMBSTONE_VALUE); }
+
   struct LeafCompare {
     bool operator()(const leaf_type *lhs, const leaf_type *rhs) const {
       return lhs->access_count < rhs->access_count;
@@ -496,6 +515,14 @@ struct BufferBTreeImp {
 
     // 2. emplace in batch phase
     start = bench_start();
+    // the last batch is done before the leaves are locked
+#ifdef USE_THREAD_POOL
+    while (pool.start.load()) {
+      yield(0);
+    }
+#else
+    _queue.do_all();
+#endif
     thread_pool::q_type q;
     for (leaf_type *leaf : flush_leaf) {
       bool restart = false;
@@ -507,17 +534,7 @@ struct BufferBTreeImp {
       }
       q.emplace_back(leaf->keys, leaf->payloads, leaf->count);
       this->_total_kvs += leaf->count;
-
-      leaf->keys = nullptr;
-      leaf->payloads = nullptr;
-      leaf->count = 0;
-      // means this leaf is deleted
-      leaf->access_count = LEAF_DELETED_FLAG;
-      leaf->writeUnlock();
     }
-    this->_total_batches += 1;
-    this->_total_leaves += flush_leaf.size();
-    leaf_count.fetch_sub(flush_leaf.size());
 #ifdef USE_THREAD_POOL
     pool.queue(q);
 #else
@@ -528,6 +545,19 @@ struct BufferBTreeImp {
     //   delete[] leaf.values;
     // }
 #endif
+    // the entries leave the leaves once the batch holds them, a reader
+    // finds them in one of the two
+    for (leaf_type *leaf : flush_leaf) {
+      leaf->keys = nullptr;
+      leaf->payloads = nullptr;
+      leaf->count = 0;
+      // means this leaf is deleted
+      leaf->access_count = LEAF_DELETED_FLAG;
+      leaf->writeUnlock();
+    }
+    this->_total_batches += 1;
+    this->_total_leaves += flush_leaf.size();
+    leaf_count.fetch_sub(flush_leaf.size());
     end = bench_end();
     _total_inbatch_time += end - start;
 
@@ -780,26 +810,31 @@ struct BufferBTreeImp {
 
     BTreeLeaf<Key, Value> *leaf = static_cast<BTreeLeaf<Key, Value> *>(node);
     // if(leaf->count == 0) return false;
-    if (leaf->keys == nullptr || leaf->count == 0) {
+    // a flush may take the arrays meanwhile, see lowerBound
+    Key *leaf_keys = leaf->keys;
+    Value *leaf_payloads = leaf->payloads;
+    unsigned leaf_count = leaf->count;
+    if (leaf_keys == nullptr || leaf_payloads == nullptr || leaf_count == 0) {
 #ifdef USE_THREAD_POOL
       if (!pool.get(k, result))
 #else
       if (!_queue.get(k, result))
 #endif
         return device_tree->Get(k, result);
-      return true;
+      return result != TOMBSTONE_VALUE;
     }
     // if(!(k>= leaf->keys[0] && k<= leaf->keys[leaf->count-1]))
     // {
     //   printf("finding %ld in leaf %ld %ld\n", k, leaf->keys[0],
     //   leaf->keys[leaf->count-1]);
     // }
-    unsigned pos = leaf->lowerBound(k);
+    unsigned pos = leaf->lowerBound(leaf_keys, leaf_count, k);
+    // a tombstone is found as well, the key is deleted then
     bool success = false;
-    if ((pos < leaf->count) && (leaf->keys[pos] == k)) {
+    if ((pos < leaf_count) && (leaf_keys[pos] == k)) {
       success = true;
       _hit++;
-      result = leaf->payloads[pos];
+      result = leaf_payloads[pos];
     }
     if (parent) {
       parent->readUnlockOrRestart(versionParent, needRestart);
@@ -815,20 +850,22 @@ struct BufferBTreeImp {
       if (!_queue.get(k, result))
 #endif
         return device_tree->Get(k, result);
-      return true;
     }
-    return success;
+    return result != TOMBSTONE_VALUE;
   }
 
-  uint64_t scan(Key k, int range, Value *output) {
+  /* tombstones are returned too, keys receives the key of every value */
+  uint64_t scan(Key k, int range, Value *output, Key *keys) {
     int restartCount = 0;
-    int count = 0;
-    bool next_scan = false;
+    // see BTree::Scan
+    int done = 0;
+    int count;
   restart:
-    bool right_most = true;
-    if (!next_scan && restartCount++) yield(restartCount);
-    next_scan = false;
+    if (restartCount++) yield(restartCount);
+    count = done;
     bool needRestart = false;
+    Key upper = std::numeric_limits<Key>::max();
+    Key fence = upper;
 
     NodeBase *node = root;
     uint64_t versionNode = node->readLockOrRestart(needRestart);
@@ -838,7 +875,7 @@ struct BufferBTreeImp {
     BTreeInner<Key> *parent = nullptr;
     uint64_t versionParent;
 
-    int p = -1;
+    int p = 0;
     while (node->type == PageType::BTreeInner) {
       auto inner = static_cast<BTreeInner<Key> *>(node);
 
@@ -849,43 +886,52 @@ struct BufferBTreeImp {
 
       parent = inner;
       versionParent = versionNode;
+      upper = fence;
 
       p = inner->lowerBound(k);
-      if (p != inner->count) right_most = false;
+      if (p != inner->count) fence = std::min(fence, inner->keys[p]);
       node = inner->children[p];
       inner->checkOrRestart(versionNode, needRestart);
       if (needRestart) goto restart;
       versionNode = node->readLockOrRestart(needRestart);
       if (needRestart) goto restart;
     }
-    while (count != range && p <= parent->count) {
-      auto node1 = parent->children[p];
-      BTreeLeaf<Key, Value> *leaf = static_cast<BTreeLeaf<Key, Value> *>(node1);
-      if (leaf->keys == nullptr) {
-        p++;
-        continue;
-      }
-      unsigned pos = leaf->lowerBound(k);
-      for (unsigned i = pos; i < leaf->count; i++) {
-        if (count == range) break;
-        output[count++] = leaf->payloads[i];
+    {
+      int last = parent ? parent->count : p;
+      for (int i = p; i <= last && count < range; i++) {
+        if (parent) {
+          node = parent->children[i];
+          parent->checkOrRestart(versionParent, needRestart);
+          if (needRestart) goto restart;
+        }
+        BTreeLeaf<Key, Value> *leaf = static_cast<BTreeLeaf<Key, Value> *>(node);
+        uint64_t versionLeaf = leaf->readLockOrRestart(needRestart);
+        if (needRestart) goto restart;
+        Key *leaf_keys = leaf->keys;
+        Value *leaf_payloads = leaf->payloads;
+        unsigned leaf_count = leaf->count;
+        if (leaf_keys != nullptr && leaf_payloads != nullptr) {
+          unsigned pos = leaf->lowerBound(leaf_keys, leaf_count, k);
+          for (unsigned j = pos; j < leaf_count && count < range; j++) {
+            keys[count] = leaf_keys[j];
+            output[count++] = leaf_payloads[j];
+          }
+        }
+        leaf->readUnlockOrRestart(versionLeaf, needRestart);
+        if (needRestart) goto restart;
       }
-      k = output[count - 1] + 1;
-      p++;
     }
 
     if (parent) {
       parent->readUnlockOrRestart(versionParent, needRestart);
       if (needRestart) goto restart;
     }
-    node->readUnlockOrRestart(versionNode, needRestart);
-    if (needRestart) goto restart;
-    // if (count != range && !right_most) {
-    //   k = output[count - 1] + 1;
-    //   next_scan = true;
-    //   goto restart;
-    // }
-
+    done = count;
+    if (count < range && upper != std::numeric_limits<Key>::max()) {
+      k = upper + 1;
+      restartCount = 0;
+      goto restart;
+    }
     return count;
   }
   virtual ~BufferBTreeImp() {
@@ -898,6 +944,104 @@ struct BufferBTreeImp {
   }
 };
 
+/*
+ * Reads one source of a ZBTree scan a chunk at a time. fill scans the source
+ * from a key into keys and values, in key order, and returns how many
+ * entries it found.
+ */
+template <class Key, class Value>
+struct ScanCursor {
+  using fill_type = std::function<uint64_t(Key, int, Key *, Value *)>;
+
+  fill_type fill;
+  int chunk;
+  bool last_chunk = false;
+  int pos = 0;
+  int cnt = 0;
+  Key keys[SCAN_CHUNK];
+  Value values[SCAN_CHUNK];
+
+  ScanCursor(fill_type fill, int chunk) : fill(std::move(fill)), chunk(chunk) {}
+
+  /* read the chunk from key from on, the rest of the last one is dropped */
+  void seek(Key from) {
+    cnt = fill(from, chunk, keys, values);
+    pos = 0;
+    last_chunk = cnt == 0 || cnt < chunk ||
+                 keys[cnt - 1] == std::numeric_limits<Key>::max();
+  }
+  /* the chunk is used up but the source has more */
+  bool drained() const { return pos == cnt && !last_chunk; }
+  bool valid() const { return pos < cnt; }
+  Key key() const { return keys[pos]; }
+  Value value() const { return values[pos]; }
+  void next() { pos++; }
+};
+
+/*
+ * Merges the sources of a scan by key, the sources go from the newest to the
+ * oldest. An entry shadows the same key in the older sources, a tombstone
+ * hides the key. Only the chunks the caller reaches are read.
+ *
+ * A flush moves entries to an older source. The sources are read newest
+ * first from the same key, so an entry moving meanwhile is still found in
+ * the older one and a tombstone is not read without the value it hides, or
+ * the other way round. Once the chunk of one source is used up all of them
+ * are read again from the next key.
+ */
+template <class Key, class Value, int N>
+struct MergeIterator {
+  ScanCursor<Key, Value> *sources[N];
+  // the keys below it are merged
+  Key bound;
+  bool end = false;
+
+  MergeIterator(ScanCursor<Key, Value> *const (&cursors)[N], Key from)
+      : bound(from) {
+    for (int i = 0; i < N; i++) {
+      sources[i] = cursors[i];
+    }
+    seek();
+  }
+
+  void seek() {
+    for (int i = 0; i < N; i++) {
+      sources[i]->seek(bound);
+    }
+  }
+
+  /* @return false once every source is done */
+  bool next(Key &key, Value &value) {
+    while (!end) {
+      for (int i = 0; i < N; i++) {
+        if (sources[i]->drained()) {
+          seek();
+          break;
+        }
+      }
+      int from = -1;
+      for (int i = 0; i < N; i++) {
+        if (sources[i]->valid() &&
+            (from < 0 || sources[i]->key() < sources[from]->key()))
+          from = i;
+      }
+      if (from < 0) return false;
+      key = sources[from]->key();
+      value = sources[from]->value();
+      for (int i = from; i < N; i++) {
+        if (sources[i]->valid() && sources[i]->key() == key) sources[i]->next();
+      }
+      if (key == std::numeric_limits<Key>::max()) {
+        end = true;
+      } else {
+        bound = key + 1;
+      }
+      if (value != TOMBSTONE_VALUE) return true;
+    }
+    return false;
+  }
+};
+
 /*
  *  ZBTree is a thread-safe B+ tree
  */
@@ -976,6 +1120,12 @@ struct ZBTree {
 #endif
   }
 
+  /*
+   * Buffer a tombstone for k, it reaches the device tree with the batch of
+   * its leaf like an insert does. Get and Scan skip k from now on.
+   */
+  void Remove(Key k) { Insert(k, TOMBSTONE_VALUE); }
+
   bool Get(Key k, Value &result) {
     bool done = false;
     int current_jobs = 0;
@@ -1016,7 +1166,8 @@ struct ZBTree {
 #endif
   }
 
-  uint64_t Scan(Key k, int range, Value *output) {
+  /* keys, if given, receives the key of every output value */
+  uint64_t Scan(Key k, int range, Value *output, Key *keys = nullptr) {
     bool done = false;
     int current_jobs = 0;
   restart_scan:
@@ -1045,37 +1196,34 @@ struct ZBTree {
       goto restart_scan;
     } else {
     do_scan:
-      Value buffer_btree_output[range];
-      Value thread_pool_output[range];
-      Value device_tree_output[range];
-      // fix ok
-      uint64_t buffer_btree_cnt = current->scan(k, range, buffer_btree_output);
+      int chunk = std::min(range, SCAN_CHUNK);
+      ScanCursor<Key, Value> buffer(
+          [&](Key from, int n, Key *chunk_keys, Value *chunk_values) {
+            return current->scan(from, n, chunk_values, chunk_keys);
+          },
+          chunk);
+      ScanCursor<Key, Value> batches(
+          [&](Key from, int n, Key *chunk_keys, Value *chunk_values) {
 #ifdef USE_THREAD_POOL
-      uint64_t thread_pool_cnt =
-          current->pool.scan(k, range, thread_pool_output);
+            return current->pool.scan(from, n, chunk_values, chunk_keys);
 #else
-      // fix ok
-      uint64_t thread_pool_cnt =
-          current->_queue.scan(k, range, thread_pool_output);
+            return current->_queue.scan(from, n, chunk_values, chunk_keys);
 #endif
-      uint64_t device_tree_cnt =
-          device_tree->Scan(k, range, device_tree_output);
+          },
+          chunk);
+      ScanCursor<Key, Value> device(
+          [&](Key from, int n, Key *chunk_keys, Value *chunk_values) {
+            return device_tree->Scan(from, n, chunk_values, chunk_keys);
+          },
+          chunk);
+      MergeIterator<Key, Value, 3> it({&buffer, &batches, &device}, k);
       uint64_t cnt = 0;
-      uint64_t a = 0, b = 0, c = 0;
-      vector<Value> tmp;
-      tmp.reserve(3 * range);
-      for (int i = 0; i < buffer_btree_cnt; ++i)
-        tmp.push_back(buffer_btree_output[i]);
-      for (int i = 0; i < thread_pool_cnt; ++i)
-        tmp.push_back(thread_pool_output[i]);
-      for (int i = 0; i < device_tree_cnt; ++i)
-        tmp.push_back(device_tree_output[i]);
-      sort(tmp.begin(), tmp.end());
-      tmp.resize(unique(tmp.begin(), tmp.end()) - tmp.begin());
-      for (int i = 0; i < tmp.size() && i < range; ++i) {
-        output[i] = tmp[i];
+      Key key;
+      while (cnt < (uint64_t)range && it.next(key, output[cnt])) {
+        if (keys) keys[cnt] = key;
+        cnt++;
       }
-      return min(tmp.size(), (uint64_t)range);
+      return cnt;
     }
 #ifndef USE_THREAD_POOL
     if (!done || current->_queue._worker < MAX_BG_FLUSH_THREADS) {
@@ -95,11 +95,27 @@ typedef char *bytes_t;
 typedef u64 page_id_t;
 typedef u64 offset_t;
 
-typedef u64 zns_id_t;  // 16 bit for zone id, 48 bit for zone offset
+typedef u64 zns_id_t;  // see MAKE_PAGE_ID
 typedef std::pair<KeyType, ValueType> PairType;
 static constexpr page_id_t INVALID_PAGE_ID = -1;  // invalid page id
 
+// pages merged into one zone write, see ZoneManager::SetBatchSize
 constexpr int32_t BATCH_SIZE = 4;
+// the most pages one zone write merges, 1 MiB
+constexpr int32_t MAX_BATCH_SIZE = (1 << 20) / PAGE_SIZE;
+// SetBatchSize(AUTO_BATCH_SIZE) tunes the batch size from the append latency
+constexpr u32 AUTO_BATCH_SIZE = 0;
+// appends measured per step of the tuning, a step has to gain this much
+constexpr u32 BATCH_TUNE_APPENDS = 64;
+constexpr double BATCH_TUNE_GAIN = 1.1;
+// batch buffers a zone may have in flight on the io_uring
+constexpr int32_t MAX_INFLIGHT_BATCHES = 4;
+// batches of FIFO victims staged for the flusher before writers wait
+constexpr int32_t MAX_STAGED_BATCHES = 2;
+// most read misses a scan submits at once
+constexpr int32_t MAX_PREFETCH_PAGES = 32;
+// entries a ZBTree scan reads from one of its sources at once
+constexpr int SCAN_CHUNK = 128;
 const int32_t MAX_RESEVER_THR = 1;
 constexpr int MAX_DO_JOBS = 16;
 
@@ -134,11 +150,108 @@ const u32 MAX_BG_FLUSH_THREADS = 14;
 #ifdef USE_LRU_BUFFER
 #define LRU_BUFFER_SIZE MAX_READ_CACHE_PAGES
 #endif
-#define HASH_MAP_SIZE 149
 #ifdef USE_SIEVE
 #define SIEVE_SIZE MAX_READ_CACHE_PAGES
 #endif
 
+/**
+ * memory governor, see MemoryGovernor. The FIFOs and read caches of all zone
+ * buffers share one budget, ghost hits move pages between them. Without it
+ * every part keeps its share of the budget.
+ */
+#if defined(USE_LRU_BUFFER) || defined(USE_SIEVE)
+#define ADAPTIVE_BUFFER_SPLIT
+#endif
+// pages a ghost hit moves
+constexpr u32 GOVERNOR_STEP_PAGES = 4;
+// ghost hits a part is passed over for by the donor clock
+constexpr u32 GOVERNOR_MAX_CREDIT = 3;
+// a part grows up to this many times the even share of a zone buffer
+constexpr u32 GOVERNOR_MAX_SHARE = 4;
+// a FIFO keeps a batch, a read cache its hottest pages
+constexpr u32 MIN_FIFO_PAGES = BATCH_SIZE;
+constexpr u32 MIN_READ_CACHE_PAGES = 16;
+
+/**
+ * read cache admission, see FrequencySketch. New pages wait in a window of
+ * TINYLFU_WINDOW_PERCENT of the read cache, a page leaving the window only
+ * replaces the victim of the cache if it was accessed more often lately
+ */
+#define TINYLFU_ADMISSION
+constexpr u32 TINYLFU_WINDOW_PERCENT = 5;
+// increments per cached page before the sketch ages
+constexpr u32 SKETCH_SAMPLE_FACTOR = 10;
+
+/**
+ * page frame pool
+ */
+// frames carved from the heap at once
+#define PAGE_POOL_SLAB_PAGES (2 * 1024 * 1024 / PAGE_SIZE)
+// released frames a thread keeps before it hands half of them back
+#define PAGE_POOL_CACHE_PAGES (64)
+// ask for transparent hugepages on the slabs
+#define PAGE_POOL_HUGEPAGES
+// pages a thread retires before it tries to advance the epoch and free them
+#define EPOCH_RECLAIM_PAGES (64)
+
+/**
+ * zone garbage collection
+ */
+#define ZONE_GC
+// #define GC_COST_BENEFIT
+// wake up the cleaner when free zones drop to this number
+#define GC_START_FREE_ZONES (MAX_NUMS_ZONE / 2 + 2)
+// the last free zones are only handed out to the cleaner
+#define GC_RESERVED_ZONES (2)
+#define GC_INTERVAL_MS (100)
+// how long a writer waits for a free zone before giving up
+#define GC_WAIT_ZONE_MS (10 * 1000)
+// restarts on a locked node before the cleaner skips its subtree
+#define GC_MAX_RESTARTS (64)
+
+/**
+ * Zone append: FIFO batches are written outside the zone latch by whichever
+ * threads drain them, and the device picks the address. A page has a
+ * provisional id until its batch is placed, the leaf is fixed up after.
+ */
+// #define ZONE_APPEND
+// provisional page ids use zone ids from here on, never found on the device
+#define PROVISIONAL_ZONE_BASE (1ULL << (ZONE_NR_BITS + DEVICE_ID_BITS))
+#define IS_PROVISIONAL(page_id) (GET_ZONE_ID(page_id) >= PROVISIONAL_ZONE_BASE)
+// fixed up ids kept resolvable for readers that still hold them
+#define REMAP_GRACE (4096)
+
+/**
+ * Hot/cold leaf placement: the zone buffers are split into temperature
+ * classes, a rewritten leaf goes to the open zones of its class. 1 turns
+ * it off. The heat of a leaf counts its writes and halves each time as
+ * many zones as there are zone buffers have been opened.
+ */
+#define NR_TEMPERATURES (2)
+// each class needs this many times the heat of the one below
+#define HOT_LEAF_HEAT (4)
+// place the page wherever its zone buffer is
+const u32 ANY_TEMPERATURE = ~0u;
+
+/**
+ * Restart from the device: every leaf page ends with a footer holding its
+ * key range and a sequence number, the inner nodes are rebuilt from the
+ * newest copy of each key range. The metadata zone leases the sequence
+ * numbers this many at a time.
+ */
+#define PAGE_SEQ_LEASE (1ULL << 20)
+// threads reading the zones at restart, and the pages each read takes
+#define RECOVERY_SCAN_THREADS (8)
+#define RECOVERY_SCAN_PAGES (64)
+
+/**
+ * Leaf page layout, see LeafEntries: the keys of a leaf in one block and its
+ * values in the next, a search reads the keys only. Without it the page
+ * holds key value pairs. The footer tells the layouts apart, a device
+ * written with the other one is not recovered.
+ */
+#define LEAF_SOA
+
 const u32 BUFFER_POOL_SIZE = 1024 * 1024 * 16;  // in Bytes
 const u32 INSTANCE_SIZE = 64;
 const u32 PAGES_SIZE = BUFFER_POOL_SIZE / (INSTANCE_SIZE * PAGE_SIZE);
@@ -154,7 +267,16 @@ const std::string DOTFILE_NAME_AFTER = WORK_DIR "bbtree-after.dot";
  * stoage
  */
 #define REGURLAR_DEVICE "/dev/nvme1n1"
+#ifdef ZNS_EMULATED
+// emulated zoned device, "emu:mem" or "emu:/path/to/file"
+#ifdef ZNS_EMULATED_PATH
+#define ZNS_DEVICE "emu:" ZNS_EMULATED_PATH
+#else
+#define ZNS_DEVICE "emu:mem"
+#endif
+#else
 #define ZNS_DEVICE "/dev/nvme0n2"
+#endif
 #define WT_ZNS_DEVICE "/dev/nvme1n2"  // wiredtiger
 const u32 WAL_INSTANCE = 64;
 const std::string WAL_NAME = "/data/public/hjl/bbtree/bbtree.wal";
@@ -165,11 +287,40 @@ const std::string FILE_NAME = "/data/public/hjl/bbtree/f2fs_conv_ssd/bbtree.db";
 
 const KeyType MIN_KEY = std::numeric_limits<KeyType>::min();
 const ValueType INVALID_VALUE = std::numeric_limits<ValueType>::max();
+/* the value of a delete buffered in the ZBTree, it can not be stored */
+const ValueType TOMBSTONE_VALUE = INVALID_VALUE;
+
+/**
+ * striping: ZNS_DEVICE may list several devices separated by ',', the zone
+ * id holds the device above the zone number
+ */
+#define DEVICE_ID_BITS (3)
+#define MAX_NR_DEVICES (1 << DEVICE_ID_BITS)
+#define GET_DEVICE_ID(zone_id) \
+  (((zone_id) >> ZONE_NR_BITS) & (MAX_NR_DEVICES - 1))
+#define GET_ZONE_NR(zone_id) ((u64)((zone_id) & ((1ULL << ZONE_NR_BITS) - 1)))
+#define MAKE_ZONE_ID(device_id, zone_nr) \
+  ((u64)(((u64)(device_id) << ZONE_NR_BITS) | (zone_nr)))
 
-#define GET_ZONE_ID(zid_) ((zid_) >> 48)
-#define GET_ZONE_OFFSET(zid_) ((zid_) & 0x0000FFFFFFFFFFFF)
-#define MAKE_PAGE_ID(zone_id, zone_offset) \
-  (((zone_id) << 48) | ((zone_offset) & 0x0000FFFFFFFFFFFF))
+/**
+ * a page id holds the zone number in its top 16 bits and the page offset in
+ * the zone in the low ZONE_OFFSET_BITS. The bits in between extend the zone
+ * number to the zone id, see MAKE_ZONE_ID and PROVISIONAL_ZONE_BASE.
+ */
+#define ZONE_NR_BITS (16)
+#define ZONE_ID_HIGH_BITS (DEVICE_ID_BITS + 1)
+#define ZONE_OFFSET_BITS (48 - ZONE_ID_HIGH_BITS)
+#define GET_ZONE_ID(zid_)                                          \
+  ((u64)(((u64)(zid_) >> 48) |                                     \
+         ((((u64)(zid_) >> ZONE_OFFSET_BITS) &                     \
+           ((1ULL << ZONE_ID_HIGH_BITS) - 1))                      \
+          << ZONE_NR_BITS)))
+#define GET_ZONE_OFFSET(zid_) \
+  ((u64)((u64)(zid_) & ((1ULL << ZONE_OFFSET_BITS) - 1)))
+#define MAKE_PAGE_ID(zone_id, zone_offset)                         \
+  ((u64)((((u64)(zone_id) & ((1ULL << ZONE_NR_BITS) - 1)) << 48) | \
+         (((u64)(zone_id) >> ZONE_NR_BITS) << ZONE_OFFSET_BITS) |  \
+         ((u64)(zone_offset) & ((1ULL << ZONE_OFFSET_BITS) - 1))))
 
 const u32 SPIN_LIMIT = 6;
 #define ATOMIC_SPIN_UNTIL(ptr, status)                    \
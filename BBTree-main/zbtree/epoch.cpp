@@ -0,0 +1,150 @@
+#include "epoch.h"
+
+#include <atomic>
+#include <cassert>
+#include <mutex>  // NOLINT
+#include <vector>
+
+namespace {
+
+const u64 kIdle = ~0ULL;
+
+struct Retired {
+  u64 epoch;
+  void *object;
+  void (*destroy)(void *);
+};
+
+void DestroyPage(void *object) {
+  Page *page = static_cast<Page *>(object);
+  DESTROY_PAGE(page);
+}
+
+// the epoch a thread is in, alone on its cache line
+struct alignas(64) Slot {
+  std::atomic<u64> epoch{kIdle};
+  std::atomic<bool> in_use{true};
+  Slot *next = nullptr;
+};
+
+struct SharedState {
+  std::atomic<u64> epoch{0};
+  // slots are never freed, a thread takes over the slot of an ended one
+  std::atomic<Slot *> slots{nullptr};
+  std::atomic<u64> retired{0};
+  // what the ended threads retired
+  std::mutex mutex;
+  std::vector<Retired> orphans;
+};
+
+// never destroyed, threads may still retire pages at exit
+SharedState &Shared() {
+  static SharedState *shared = new SharedState();
+  return *shared;
+}
+
+Slot *AcquireSlot() {
+  SharedState &shared = Shared();
+  for (Slot *slot = shared.slots.load(std::memory_order_acquire);
+       slot != nullptr; slot = slot->next) {
+    bool in_use = false;
+    if (slot->in_use.compare_exchange_strong(in_use, true)) return slot;
+  }
+  Slot *slot = new Slot();
+  slot->next = shared.slots.load(std::memory_order_relaxed);
+  while (!shared.slots.compare_exchange_weak(slot->next, slot,
+                                             std::memory_order_release)) {
+  }
+  return slot;
+}
+
+// free what was retired two epochs before epoch
+void Free(std::vector<Retired> *limbo, u64 epoch) {
+  size_t kept = 0;
+  for (auto &retired : *limbo) {
+    if (retired.epoch + 2 <= epoch) {
+      retired.destroy(retired.object);
+    } else {
+      (*limbo)[kept++] = retired;
+    }
+  }
+  Shared().retired.fetch_sub(limbo->size() - kept, std::memory_order_relaxed);
+  limbo->resize(kept);
+}
+
+struct LocalState {
+  Slot *slot = nullptr;
+  u32 depth = 0;
+  std::vector<Retired> limbo;
+  // a stuck epoch is not scanned for on every retire
+  size_t reclaim_at = EPOCH_RECLAIM_PAGES;
+  ~LocalState() {
+    if (slot == nullptr) return;
+    slot->epoch.store(kIdle, std::memory_order_release);
+    if (!limbo.empty()) {
+      std::lock_guard<std::mutex> guard(Shared().mutex);
+      Shared().orphans.insert(Shared().orphans.end(), limbo.begin(),
+                              limbo.end());
+    }
+    slot->in_use.store(false, std::memory_order_release);
+  }
+};
+thread_local LocalState local_state;
+
+}  // namespace
+
+void Epoch::Enter() {
+  LocalState &local = local_state;
+  if (local.depth++ > 0) return;
+  if (local.slot == nullptr) local.slot = AcquireSlot();
+  // a stale epoch only holds the reclaimers back. The store is ordered
+  // before the lookups of the pages
+  local.slot->epoch.store(Shared().epoch.load(std::memory_order_relaxed),
+                          std::memory_order_seq_cst);
+}
+
+void Epoch::Leave() {
+  LocalState &local = local_state;
+  assert(local.depth > 0);
+  if (--local.depth > 0) return;
+  local.slot->epoch.store(kIdle, std::memory_order_release);
+}
+
+void Epoch::Retire(Page *page) { Retire(page, DestroyPage); }
+
+void Epoch::Retire(void *object, void (*destroy)(void *)) {
+  LocalState &local = local_state;
+  // the object was unlinked before the epoch is read
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  local.limbo.push_back(
+      {Shared().epoch.load(std::memory_order_relaxed), object, destroy});
+  Shared().retired.fetch_add(1, std::memory_order_relaxed);
+  if (local.limbo.size() >= local.reclaim_at) {
+    Reclaim();
+    local.reclaim_at = local.limbo.size() + EPOCH_RECLAIM_PAGES;
+  }
+}
+
+void Epoch::Reclaim() {
+  SharedState &shared = Shared();
+  u64 epoch = shared.epoch.load(std::memory_order_seq_cst);
+  bool advance = true;
+  for (Slot *slot = shared.slots.load(std::memory_order_acquire);
+       slot != nullptr && advance; slot = slot->next) {
+    u64 seen = slot->epoch.load(std::memory_order_seq_cst);
+    advance = seen == kIdle || seen == epoch;
+  }
+  // on failure epoch is what another thread advanced it to
+  if (advance && shared.epoch.compare_exchange_strong(epoch, epoch + 1)) {
+    epoch++;
+  }
+  Free(&local_state.limbo, epoch);
+  std::unique_lock<std::mutex> lock(shared.mutex, std::try_to_lock);
+  if (lock.owns_lock() && !shared.orphans.empty()) {
+    Free(&shared.orphans, epoch);
+  }
+}
+
+u64 Epoch::GetRetiredPages() {
+  return Shared().retired.load(std::memory_order_relaxed);
+}
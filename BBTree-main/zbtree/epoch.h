@@ -0,0 +1,43 @@
+#pragma once
+#include "config.h"
+#include "page.h"
+#include "page_pool.h"
+
+/**
+ * Epoch keeps the pages a reader may still look at alive. A thread enters an
+ * epoch before it looks a page up and leaves it once it is done with the
+ * page, both only touch a slot of its own. The FIFO, the flusher and the read
+ * caches pin the pages they hold, whoever drops the last of these pins
+ * retires the page. A retired page goes back to the PagePool once every
+ * thread left the epochs it may have seen the page in. The tree retires the
+ * leaves it merged away the same way, its operations run in an epoch.
+ *
+ * Epochs nest, only the outermost Enter and Leave of a thread count.
+ */
+class Epoch {
+ public:
+  static void Enter();
+  static void Leave();
+  /* no new reader finds the page, it is freed after a grace period */
+  static void Retire(Page *page);
+  /* the same for an object of the caller, destroy frees it */
+  static void Retire(void *object, void (*destroy)(void *));
+  /* try to advance the epoch and free what the threads retired before */
+  static void Reclaim();
+
+  /* pages and objects retired and not freed yet */
+  static u64 GetRetiredPages();
+};
+
+class EpochGuard {
+ public:
+  EpochGuard() { Epoch::Enter(); }
+  ~EpochGuard() { Epoch::Leave(); }
+  DISALLOW_COPY_AND_MOVE(EpochGuard);
+};
+
+#define RETIRE_PAGE(page) \
+  do {                    \
+    Epoch::Retire(page);  \
+    (page) = nullptr;     \
+  } while (0)
@@ -0,0 +1,64 @@
+#include "freq_sketch.h"
+
+#include <algorithm>
+#include <bit>
+
+FrequencySketch::FrequencySketch(u64 capacity) {
+  u64 words = std::bit_ceil(std::max<u64>(capacity, 16));
+  mask_ = words - 1;
+  table_.reset(new std::atomic<u64>[words]);
+  for (u64 i = 0; i < words; i++) {
+    table_[i].store(0, std::memory_order_relaxed);
+  }
+  SetCapacity(capacity);
+}
+
+void FrequencySketch::Increment(page_id_t page_id, u32 times) {
+  if (times == 0) return;
+  u64 h = Hash(page_id);
+  std::atomic<u64> &word = table_[h & mask_];
+  u64 old_word = word.load(std::memory_order_relaxed);
+  while (true) {
+    u64 new_word = old_word;
+    for (u32 i = 0; i < 4; i++) {
+      u32 shift = Shift(h, i);
+      u64 counter = (old_word >> shift) & 0xF;
+      counter = std::min<u64>(counter + times, 0xF);
+      new_word = (new_word & ~(0xFULL << shift)) | (counter << shift);
+    }
+    if (new_word == old_word) return;
+    if (word.compare_exchange_weak(old_word, new_word,
+                                   std::memory_order_relaxed)) {
+      break;
+    }
+  }
+  u64 sample_size = sample_size_.load(std::memory_order_relaxed);
+  // a shrink may leave the count over the sample, the CAS picks one thread
+  u64 additions = additions_.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (additions >= sample_size &&
+      additions_.compare_exchange_strong(additions, additions / 2,
+                                         std::memory_order_relaxed)) {
+    Age();
+  }
+}
+
+u32 FrequencySketch::Estimate(page_id_t page_id) const {
+  u64 h = Hash(page_id);
+  u64 word = table_[h & mask_].load(std::memory_order_relaxed);
+  u32 frequency = 0xF;
+  for (u32 i = 0; i < 4; i++) {
+    frequency = std::min<u32>(frequency, (word >> Shift(h, i)) & 0xF);
+  }
+  return frequency;
+}
+
+void FrequencySketch::Age() {
+  for (u64 i = 0; i <= mask_; i++) {
+    u64 word = table_[i].load(std::memory_order_relaxed);
+    // an increment meanwhile may be halved or lost, it is only a sketch
+    while (!table_[i].compare_exchange_weak(
+        word, (word >> 1) & 0x7777777777777777ULL,
+        std::memory_order_relaxed)) {
+    }
+  }
+}
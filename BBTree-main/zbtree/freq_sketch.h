@@ -0,0 +1,46 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "config.h"
+
+/**
+ * FrequencySketch estimates how often a page id was accessed lately, the
+ * count-min sketch of 4-bit counters TinyLFU admits pages with. The four
+ * counters of an id sit in one 64-bit word, one in each quarter, and are
+ * bumped with a CAS. A word whose counters are saturated is only read, hot
+ * pages do not bounce its cache line between readers.
+ *
+ * Once SKETCH_SAMPLE_FACTOR times as many increments as the cache has pages
+ * went in, all counters are halved, old accesses fade out.
+ */
+class FrequencySketch {
+ public:
+  explicit FrequencySketch(u64 capacity);
+  DISALLOW_COPY_AND_MOVE(FrequencySketch);
+
+  void Increment(page_id_t page_id, u32 times = 1);
+  u32 Estimate(page_id_t page_id) const;
+  /* the cache holds capacity pages now, the table keeps its size */
+  void SetCapacity(u64 capacity) {
+    sample_size_.store(std::max<u64>(capacity, 1) * SKETCH_SAMPLE_FACTOR,
+                       std::memory_order_relaxed);
+  }
+
+ private:
+  static u64 Hash(page_id_t page_id) {
+    u64 h = page_id * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+  }
+  /* the shift of counter i of hash h in its word */
+  static u32 Shift(u64 h, u32 i) {
+    return (i * 4 + ((h >> (32 + i * 8)) & 3)) * 4;
+  }
+  void Age();
+
+  u64 mask_;
+  std::unique_ptr<std::atomic<u64>[]> table_;
+  std::atomic<u64> sample_size_;
+  std::atomic<u64> additions_{0};
+};
@@ -0,0 +1,115 @@
+#include "key_search.h"
+
+#include <immintrin.h>
+
+#include <algorithm>
+
+// the keys the SIMD compare looks at, two cache lines
+static constexpr unsigned SEARCH_WINDOW_BYTES = 128;
+
+std::atomic<KeySearch::Kernel> KeySearch::dense_{KeySearch::ResolveDense};
+std::atomic<KeySearch::Kernel> KeySearch::pairs_{KeySearch::ResolvePairs};
+
+// halve the keys without a branch until the window is left. the keys before
+// the returned one are below k, the ones from the window on are not
+template <int Stride>
+static inline const u64 *Narrow(const u64 *keys, unsigned &n, u64 k) {
+  constexpr unsigned window = SEARCH_WINDOW_BYTES / sizeof(u64) / Stride;
+  const u64 *base = keys;
+  while (n > window) {
+    unsigned half = n / 2;
+    base = base[half * Stride] < k ? base + half * Stride : base;
+    n -= half;
+  }
+  return base;
+}
+
+template <int Stride>
+static unsigned LowerBoundScalar(const u64 *keys, unsigned n, u64 k) {
+  const u64 *base = Narrow<Stride>(keys, n, k);
+  unsigned below = 0;
+  for (unsigned i = 0; i < n; i++) below += base[i * Stride] < k;
+  return (base - keys) / Stride + below;
+}
+
+template <int Stride>
+__attribute__((target("avx2"))) static unsigned LowerBoundAvx2(const u64 *keys,
+                                                               unsigned n,
+                                                               u64 k) {
+  const u64 *base = Narrow<Stride>(keys, n, k);
+  // no unsigned compare, flip the sign bits
+  const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i key = _mm256_xor_si256(_mm256_set1_epi64x(k), sign);
+  const __m256i lane = _mm256_setr_epi64x(0, 1, 2, 3);
+  const int key_lanes = Stride == 2 ? 0x5 : 0xF;
+  unsigned below = 0;
+  unsigned i = 0;
+  for (; i + 4 / Stride <= n; i += 4 / Stride) {
+    __m256i v = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(base + i * Stride));
+    __m256i lt = _mm256_cmpgt_epi64(key, _mm256_xor_si256(v, sign));
+    below += __builtin_popcount(
+        _mm256_movemask_pd(_mm256_castsi256_pd(lt)) & key_lanes);
+  }
+  if (i < n) {
+    // masked lanes are not read, the window may end with the keys
+    __m256i mask = _mm256_cmpgt_epi64(
+        _mm256_set1_epi64x((n - i) * Stride), lane);
+    __m256i v = _mm256_maskload_epi64(
+        reinterpret_cast<const long long *>(base + i * Stride), mask);
+    __m256i lt = _mm256_and_si256(
+        _mm256_cmpgt_epi64(key, _mm256_xor_si256(v, sign)), mask);
+    below += __builtin_popcount(
+        _mm256_movemask_pd(_mm256_castsi256_pd(lt)) & key_lanes);
+  }
+  return (base - keys) / Stride + below;
+}
+
+template <int Stride>
+__attribute__((target("avx512f"))) static unsigned LowerBoundAvx512(
+    const u64 *keys, unsigned n, u64 k) {
+  const u64 *base = Narrow<Stride>(keys, n, k);
+  const __m512i key = _mm512_set1_epi64(k);
+  const unsigned key_lanes = Stride == 2 ? 0x55 : 0xFF;
+  unsigned below = 0;
+  for (unsigned i = 0; i < n; i += 8 / Stride) {
+    unsigned lanes = std::min<unsigned>(8 / Stride, n - i) * Stride;
+    __mmask8 mask = ((1u << lanes) - 1) & key_lanes;
+    __m512i v = _mm512_maskz_loadu_epi64(mask, base + i * Stride);
+    below += __builtin_popcount(_mm512_mask_cmplt_epu64_mask(mask, v, key));
+  }
+  return (base - keys) / Stride + below;
+}
+
+KeySearch::Isa KeySearch::Best() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return AVX512;
+  if (__builtin_cpu_supports("avx2")) return AVX2;
+  return SCALAR;
+}
+
+KeySearch::Kernel KeySearch::Get(Isa isa, bool pairs) {
+  if (isa > Best()) return nullptr;
+  switch (isa) {
+    case AVX512:
+      return pairs ? LowerBoundAvx512<2> : LowerBoundAvx512<1>;
+    case AVX2:
+      return pairs ? LowerBoundAvx2<2> : LowerBoundAvx2<1>;
+    default:
+      return pairs ? LowerBoundScalar<2> : LowerBoundScalar<1>;
+  }
+}
+
+// the first search of a kind installs the kernel, racing threads install
+// the same one
+unsigned KeySearch::ResolveDense(const u64 *keys, unsigned n, u64 k) {
+  Kernel kernel = Get(Best(), false);
+  dense_.store(kernel, std::memory_order_relaxed);
+  return kernel(keys, n, k);
+}
+
+unsigned KeySearch::ResolvePairs(const u64 *pairs, unsigned n, u64 k) {
+  Kernel kernel = Get(Best(), true);
+  pairs_.store(kernel, std::memory_order_relaxed);
+  return kernel(pairs, n, k);
+}
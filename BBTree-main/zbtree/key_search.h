@@ -0,0 +1,38 @@
+#pragma once
+#include <atomic>
+
+#include "config.h"
+
+/**
+ * KeySearch finds the first of n sorted u64 keys not less than k. A
+ * branchless binary search narrows the keys down to the last two cache
+ * lines, one SIMD compare then counts the keys below k in them. The kernel
+ * is picked on the first search by what the CPU supports, AVX-512, AVX2 or
+ * plain scalar code, builds without -mavx2 get the SIMD kernels as well.
+ *
+ * LowerBoundPairs searches the keys of key value pairs, every other u64.
+ */
+class KeySearch {
+ public:
+  enum Isa { SCALAR = 0, AVX2 = 1, AVX512 = 2 };
+  using Kernel = unsigned (*)(const u64 *keys, unsigned n, u64 k);
+
+  static unsigned LowerBound(const u64 *keys, unsigned n, u64 k) {
+    return dense_.load(std::memory_order_relaxed)(keys, n, k);
+  }
+  static unsigned LowerBoundPairs(const u64 *pairs, unsigned n, u64 k) {
+    return pairs_.load(std::memory_order_relaxed)(pairs, n, k);
+  }
+
+  /* the best instruction set of this CPU */
+  static Isa Best();
+  /* the kernel of isa, nullptr if the CPU lacks it */
+  static Kernel Get(Isa isa, bool pairs);
+
+ private:
+  static unsigned ResolveDense(const u64 *keys, unsigned n, u64 k);
+  static unsigned ResolvePairs(const u64 *pairs, unsigned n, u64 k);
+
+  static std::atomic<Kernel> dense_;
+  static std::atomic<Kernel> pairs_;
+};
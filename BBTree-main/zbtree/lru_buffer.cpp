@@ -1,14 +1,27 @@
 #include "lru_buffer.h"
 
 lru_buffer::lru_buffer(size_t num_pages)
-    : _size(0), _num_pages(num_pages), _hit(0), _miss(0) {
+    : _hit(0),
+      _miss(0),
+      _size(0),
+      _num_pages(num_pages),
+      _window_pages(admission_window(num_pages)),
+      _sketch(num_pages) {
   _head.next = &_head;
   _head.prev = &_head;
   _head.page = nullptr;
+  _window.next = &_window;
+  _window.prev = &_window;
+  _window.page = nullptr;
 }
 
 lru_buffer::~lru_buffer() {
   std::unique_lock<decltype(_lock)> l(_lock);
+  _ghost = nullptr;
+  while (_window.next != &_window) {
+    Page* page = delete_node(_window.next);
+    DESTROY_PAGE(page);
+  }
   while (size() > 0) {
     // todo delete page
     Page* page = delete_last();
@@ -28,7 +41,11 @@ bool lru_buffer::insert(page_id_t page_id, Page* page) {
     return false;
   }
   node* n = new node{.page = page};
-  add_front(n);
+  if (_window_pages > 0) {
+    add_window(n);
+  } else {
+    add_front(n);
+  }
   _page_table[page_id] = n;
   return true;
 }
@@ -40,11 +57,17 @@ bool lru_buffer::find(page_id_t page_id) {
 
 Page* lru_buffer::fetch(page_id_t page_id) {
   std::unique_lock<decltype(_lock)> l(_lock);
+#ifdef TINYLFU_ADMISSION
+  _sketch.Increment(page_id);
+#endif
   if (_page_table.find(page_id) == _page_table.end()) {
     return nullptr;
   }
   node* n = _page_table[page_id];
-  move_front(n);
+  // the window is a FIFO
+  if (!n->window) {
+    move_front(n);
+  }
   return n->page;
 }
 
@@ -70,23 +93,52 @@ Page* lru_buffer::evict(page_id_t page_id) {
   return page;
 }
 
-Page* lru_buffer::evict_and_insert(page_id_t page_id, Page* page) {
+void lru_buffer::evict_zone(zns_id_t zone_id, std::vector<Page*>* victims) {
+  std::unique_lock<decltype(_lock)> l(_lock);
+  for (node* list : {&_head, &_window}) {
+    for (node* n = list->next; n != list;) {
+      node* next = n->next;
+      if (GET_ZONE_ID(n->page->GetPageId()) == zone_id) {
+        victims->push_back(delete_node(n));
+      }
+      n = next;
+    }
+  }
+}
+
+void lru_buffer::resize(size_t num_pages, std::vector<Page*>* victims) {
+  std::unique_lock<decltype(_lock)> l(_lock);
+  _num_pages = num_pages;
+  _window_pages = admission_window(num_pages);
+  _sketch.SetCapacity(num_pages);
+  while (Page* victim = shrink()) {
+    victims->push_back(victim);
+  }
+}
+
+size_t lru_buffer::capacity() {
+  std::unique_lock<decltype(_lock)> l(_lock);
+  return _num_pages;
+}
+
+Page* lru_buffer::evict_and_insert(page_id_t page_id, Page* page, u32 hits) {
   std::unique_lock<decltype(_lock)> l(_lock);
   if (_page_table.find(page_id) != _page_table.end()) {
+    // the replaced copy goes like a victim, see sieve_buffer
     node* n = _page_table[page_id];
+    Page* old = n->page;
     n->page = page;
-    return nullptr;
+    return old != page ? old : nullptr;
   }
+#ifdef TINYLFU_ADMISSION
+  _sketch.Increment(page_id, hits);
+#endif
   Page* p = nullptr;
-  if (_size >= _num_pages) {
+  if (_window_pages == 0 && (size_t)_size >= _num_pages) {
     p = delete_last();
   }
-  if (_size >= _num_pages) {
-    printf("size: %d\n", _size.load());
-    assert(false);
-  }
   insert(page_id, page);
-  return p;
+  return p != nullptr ? p : shrink();
 }
 
 Page* lru_buffer::evict() {
@@ -94,6 +146,9 @@ Page* lru_buffer::evict() {
   if (size() == 0) {
     return nullptr;
   }
+  if (_head.prev == &_head) {
+    return delete_node(_window.prev);
+  }
   return delete_last();
 }
 
@@ -105,9 +160,23 @@ void lru_buffer::add_front(node* n) {
   _size++;
 }
 
+void lru_buffer::add_window(node* n) {
+  n->next = _window.next;
+  n->prev = &_window;
+  _window.next->prev = n;
+  _window.next = n;
+  n->window = true;
+  _wsize++;
+  _size++;
+}
+
 void lru_buffer::remove_node(node* n) {
   n->prev->next = n->next;
   n->next->prev = n->prev;
+  if (n->window) {
+    n->window = false;
+    _wsize--;
+  }
   _size--;
 }
 
@@ -116,20 +185,54 @@ void lru_buffer::move_front(node* n) {
   add_front(n);
 }
 
+Page* lru_buffer::delete_node(node* n) {
+  remove_node(n);
+  _page_table.erase(n->page->GetPageId());
+  Page* page = n->page;
+  delete n;
+  return page;
+}
+
+// a page evicted for room, see sieve_buffer::free_node
+Page* lru_buffer::evict_node(node* n) {
+  Page* page = delete_node(n);
+  if (_ghost != nullptr) _ghost->Add(page->GetPageId());
+  return page;
+}
+
 Page* lru_buffer::delete_last() {
   assert(_size > 0);
-  node* last = _head.prev;
-  remove_node(last);
-  _page_table.erase(last->page->GetPageId());
-  Page* page = last->page;
-  delete last;
-  return page;
+  return evict_node(_head.prev);
+}
+
+Page* lru_buffer::shrink() {
+  size_t cache_pages = _num_pages - std::min(_window_pages, _num_pages);
+  while (_wsize > _window_pages) {
+    // the oldest page of the window against the least recently used one
+    node* candidate = _window.prev;
+    if ((size_t)_size - _wsize < cache_pages) {
+      move_front(candidate);
+      continue;
+    }
+    if ((size_t)_size == _wsize ||
+        _sketch.Estimate(candidate->page->GetPageId()) <=
+            _sketch.Estimate(_head.prev->page->GetPageId())) {
+      return evict_node(candidate);
+    }
+    Page* page = delete_last();
+    move_front(candidate);
+    return page;
+  }
+  if ((size_t)_size > _num_pages) {
+    return delete_last();
+  }
+  return nullptr;
 }
 
 void sieve_buffer::print_all() {
   std::unique_lock<decltype(_lock)> l(_lock);
   for (sieve_node* n = _head.next; n != &_head; n = n->next) {
-    printf("%ld ", n->p->GetPageId());
+    printf("%ld ", n->p.load()->GetPageId());
   }
   printf("\n");
 }
\ No newline at end of file
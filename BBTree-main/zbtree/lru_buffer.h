@@ -8,10 +8,23 @@
 
 #include "../zns/zone_device.h"
 #include "config.h"
+#include "freq_sketch.h"
+#include "mem_governor.h"
 #include "page.h"
+#include "page_pool.h"
+#include "page_table.h"
 #include "replacer.h"
 #include "storage.h"
 
+/* the admission window of a read cache of num_pages, see TINYLFU_ADMISSION */
+inline size_t admission_window(size_t num_pages) {
+#ifdef TINYLFU_ADMISSION
+  return std::max<size_t>(num_pages * TINYLFU_WINDOW_PERCENT / 100, 1);
+#else
+  return 0;
+#endif
+}
+
 // lru read buffer only
 class lru_buffer {
  public:
@@ -26,7 +39,15 @@ class lru_buffer {
   Page* touch(page_id_t page_id);
   Page* evict(page_id_t page_id);
   Page* evict();
-  Page* evict_and_insert(page_id_t page_id, Page* page);
+  /* see sieve_buffer::evict_zone */
+  void evict_zone(zns_id_t zone_id, std::vector<Page*>* victims);
+  /* see sieve_buffer::resize */
+  void resize(size_t num_pages, std::vector<Page*>* victims);
+  size_t capacity();
+  // the ids of the evicted pages go here if set
+  GhostList* _ghost = nullptr;
+  /* see sieve_buffer::evict_and_insert */
+  Page* evict_and_insert(page_id_t page_id, Page* page, u32 hits = 0);
   void Print();
 
  private:
@@ -35,18 +56,28 @@ class lru_buffer {
     node* prev;
     node* next;
     Page* page;
+    bool window = false;
   };
   std::unordered_map<page_id_t, node*> _page_table;
   node _head;
+  // new pages wait here, like in sieve_buffer
+  node _window;
   std::atomic_int _size;
+  size_t _wsize = 0;
   size_t _num_pages;
+  size_t _window_pages;
+  FrequencySketch _sketch;
   // std::mutex _lock;
   std::shared_mutex _lock;
 
   void add_front(node* n);
+  void add_window(node* n);
   void remove_node(node* n);
   void move_front(node* n);
+  Page* delete_node(node* n);
+  Page* evict_node(node* n);
   Page* delete_last();
+  Page* shrink();
 };
 
 #ifndef SIEVE
@@ -54,14 +85,16 @@ class lru_buffer {
 struct sieve_node {
   sieve_node* prev;
   sieve_node* next;
-  Page* p;
-  int visited;
-  Page* unlink() {
+  std::atomic<Page*> p{nullptr};
+  std::atomic<int> visited{0};
+  bool in_window = false;
+  void remove() {
     next->prev = prev;
     prev->next = next;
-    Page* t = p;
-    p = nullptr;
-    return t;
+  }
+  Page* unlink() {
+    remove();
+    return p.exchange(nullptr);
   }
   void add_after(sieve_node* n) {
     n->next->prev = this;
@@ -71,174 +104,192 @@ struct sieve_node {
   }
   bool empty() { return next == this; }
 };
-struct hash_map {
-  std::vector<std::list<std::pair<page_id_t, sieve_node*>>> _table;
-  hash_map() : _table(HASH_MAP_SIZE) {}
-
-  void insert(page_id_t page_id, sieve_node* page) {
-    size_t idx = std::hash<int64_t>()(page_id) % HASH_MAP_SIZE;
-    auto it =
-        std::find_if(_table[idx].begin(), _table[idx].end(),
-                     [page_id](const std::pair<page_id_t, sieve_node*>& p) {
-                       return p.first == page_id;
-                     });
-    if (it != _table[idx].end()) {
-      it->second = page;
-    } else {
-      _table[idx].push_front(std::make_pair(page_id, page));
-    }
-  }
-  sieve_node* erase(page_id_t page_id) {
-    size_t idx = std::hash<int64_t>()(page_id) % HASH_MAP_SIZE;
-    auto it =
-        std::find_if(_table[idx].begin(), _table[idx].end(),
-                     [page_id](const std::pair<page_id_t, sieve_node*>& p) {
-                       return p.first == page_id;
-                     });
-    if (it != _table[idx].end()) {
-      sieve_node* page = it->second;
-      _table[idx].erase(it);
-      return page;
-    }
-    return nullptr;
-  }
-  bool find(page_id_t page_id) {
-    size_t idx = std::hash<int64_t>()(page_id) % HASH_MAP_SIZE;
-    auto it =
-        std::find_if(_table[idx].begin(), _table[idx].end(),
-                     [page_id](const std::pair<page_id_t, sieve_node*>& p) {
-                       return p.first == page_id;
-                     });
-    return it != _table[idx].end();
-  }
-  sieve_node* fetch(page_id_t page_id) {
-    size_t idx = std::hash<int64_t>()(page_id) % HASH_MAP_SIZE;
-    auto it =
-        std::find_if(_table[idx].begin(), _table[idx].end(),
-                     [page_id](const std::pair<page_id_t, sieve_node*>& p) {
-                       return p.first == page_id;
-                     });
-    if (it != _table[idx].end()) {
-      return it->second;
-    }
-    return nullptr;
-  }
-};
 
+/**
+ * SIEVE read cache. Hits only read the page table and set the visited bit,
+ * they take no lock. Inserts, evictions and the hand sweep hold _lock.
+ * A reader may find a node the hand just recycled for another page, so it
+ * checks the page id of what it got.
+ *
+ * With TINYLFU_ADMISSION a new page first waits in a small FIFO window. The
+ * oldest page of a full window replaces the victim of the hand only if the
+ * sketch counted more accesses to it, pages read once by a scan leave
+ * through the window instead of washing out the cache.
+ */
 class sieve_buffer {
  public:
-  hash_map _table;
+  PageTable<sieve_node*> _table;
   sieve_node _head;
+  sieve_node _window;
   sieve_node _free;
-  sieve_node* _pstart;
+  // nodes come in chunks as the capacity grows, a shrink keeps them free
+  std::vector<sieve_node*> _chunks;
+  size_t _nodes = 0;
   sieve_node* _hand = nullptr;
-  const size_t _num_pages;
+  // capacity, see resize
+  size_t _num_pages;
+  // the ids of the evicted pages go here if set
+  GhostList* _ghost = nullptr;
   size_t _sz;
+  // pages in the window and its capacity, part of _sz and _num_pages
+  size_t _wsz = 0;
+  size_t _window_pages;
+  FrequencySketch _sketch;
   std::atomic_int64_t _hit;
   std::atomic_int64_t _miss;
-  explicit sieve_buffer(size_t num_pages) : _num_pages(num_pages) {
+  explicit sieve_buffer(size_t num_pages)
+      : _table(2 * num_pages),
+        _num_pages(num_pages),
+        _window_pages(admission_window(num_pages)),
+        _sketch(num_pages) {
     _head.next = &_head;
     _head.prev = &_head;
+    _window.next = &_window;
+    _window.prev = &_window;
     _free.next = &_free;
     _free.prev = &_free;
-    _pstart = new sieve_node[num_pages];
     _sz = 0;
     // printf("[sieve_buffer] %ld\n", _num_pages);
-    for (int i = 0; i < num_pages; ++i) {
-      _pstart[i].add_after(&_free);
-    }
+    // a page is inserted before the victim leaves
+    add_nodes(num_pages + 1);
   }
   ~sieve_buffer() {
     std::unique_lock<decltype(_lock)> l(_lock);
     // Print();
-    for (sieve_node* n = _head.next; n != &_head; n = n->next) {
-      DESTROY_PAGE(n->p);
+    for (sieve_node* list : {&_head, &_window}) {
+      for (sieve_node* n = list->next; n != list; n = n->next) {
+        Page* page = n->p;
+        DESTROY_PAGE(page);
+      }
     }
-    delete[] _pstart;
+    for (auto chunk : _chunks) delete[] chunk;
   }
-  std::shared_mutex _lock;
+  std::mutex _lock;
 
   size_t size() {
-    std::shared_lock<decltype(_lock)> l(_lock);
+    std::unique_lock<decltype(_lock)> l(_lock);
     return _sz;
   }
-  bool find(page_id_t page_id) {
-    std::shared_lock<decltype(_lock)> l(_lock);
-    return _table.find(page_id);
-  }
+  bool find(page_id_t page_id) { return touch(page_id) != nullptr; }
   Page* fetch(page_id_t page_id) {
-    std::shared_lock<decltype(_lock)> l(_lock);
-    sieve_node* p = _table.fetch(page_id);
-    if (p != nullptr) {
-      p->visited = 1;
-      _hit++;
-      return p->p;
+#ifdef TINYLFU_ADMISSION
+    // misses count too, the next insert of the page is a read
+    _sketch.Increment(page_id);
+#endif
+    sieve_node* n = nullptr;
+    if (_table.Find(page_id, &n)) {
+      Page* page = n->p.load(std::memory_order_acquire);
+      if (page != nullptr && page->GetPageId() == page_id) {
+        // a hot page keeps its cache line shared
+        if (n->visited.load(std::memory_order_relaxed) == 0) {
+          n->visited.store(1, std::memory_order_relaxed);
+        }
+        _hit++;
+        return page;
+      }
     }
     _miss++;
     return nullptr;
   }
   Page* touch(page_id_t page_id) {
-    std::shared_lock<decltype(_lock)> l(_lock);
-    sieve_node* p = _table.fetch(page_id);
-    if (p != nullptr) {
-      return p->p;
+    sieve_node* n = nullptr;
+    if (_table.Find(page_id, &n)) {
+      Page* page = n->p.load(std::memory_order_acquire);
+      if (page != nullptr && page->GetPageId() == page_id) {
+        return page;
+      }
     }
     return nullptr;
   }
   Page* evict(page_id_t page_id) {
     std::unique_lock<decltype(_lock)> l(_lock);
-    sieve_node* p = _table.erase(page_id);
-    if (p != nullptr) {
-      if (_hand == p) {
-        _hand = nullptr;
-      }
-      p->visited = 0;
-      Page* page = p->unlink();
-      p->add_after(&_free);
-      --_sz;
-      return page;
+    sieve_node* p = nullptr;
+    if (_table.Find(page_id, &p)) {
+      _table.Erase(page_id);
+      return drop(p);
     }
     return nullptr;
   }
+  /**
+   * evict the pages of zone zone_id into victims, their ids are reused once
+   * the zone is written again. The caller releases them like the victims of
+   * evict_and_insert.
+   */
+  void evict_zone(zns_id_t zone_id, std::vector<Page*>* victims) {
+    std::unique_lock<decltype(_lock)> l(_lock);
+    for (sieve_node* list : {&_head, &_window}) {
+      for (sieve_node* n = list->next; n != list;) {
+        sieve_node* next = n->next;
+        page_id_t page_id = n->p.load(std::memory_order_relaxed)->GetPageId();
+        if (GET_ZONE_ID(page_id) == zone_id) {
+          _table.Erase(page_id);
+          victims->push_back(drop(n));
+        }
+        n = next;
+      }
+    }
+  }
   Page* evict() {
     assert(false);
     return nullptr;
   }
-  Page* evict_and_insert(page_id_t page_id, Page* page) {
+  /**
+   * insert page, return the page evicted for it or nullptr. hits are
+   * accesses to the page the sketch has not seen, e.g. while it was in the
+   * FIFO under this id. A cached copy of page_id is replaced, it is returned
+   * like a victim so the caller drops its pin.
+   */
+  Page* evict_and_insert(page_id_t page_id, Page* page, u32 hits = 0) {
     std::unique_lock<decltype(_lock)> l(_lock);
     assert(page_id == page->GetPageId());
-    if (_table.find(page_id)) {
-      sieve_node* n = _table.fetch(page_id);
-      n->p = page;
-      return nullptr;
+    sieve_node* n = nullptr;
+    if (_table.Find(page_id, &n)) {
+      // e.g. two readers missed on the page
+      Page* old = n->p.exchange(page, std::memory_order_acq_rel);
+      return old != page ? old : nullptr;
     }
+#ifdef TINYLFU_ADMISSION
+    _sketch.Increment(page_id, hits);
+#endif
     Page* victim = nullptr;
-    if (_sz >= _num_pages) {
-      sieve_node* o = _hand;
-      if (o == nullptr || o == &_head) {
-        o = _head.prev;
-      }
-      while (o->visited == 1) {
-        o->visited = 0;
-        o = o->prev;
-        if (o == &_head) {
-          o = _head.prev;
-        }
-      }
-      _hand = o->prev;
-      victim = o->unlink();
-      _table.erase(victim->GetPageId());
-      o->add_after(&_free);
-      _sz--;
+    if (_window_pages == 0 && _sz >= _num_pages) {
+      // before the insert, the page must not be its own victim
+      victim = free_node(sweep());
     }
     _sz++;
     sieve_node* p = _free.next;
     p->unlink();
-    p->add_after(&_head);
-    _table.insert(page_id, p);
-    p->p = page;
+    if (_window_pages > 0) {
+      p->add_after(&_window);
+      p->in_window = true;
+      _wsz++;
+    } else {
+      p->add_after(&_head);
+    }
     p->visited = 0;
-    return victim;
+    // the page is there before a reader can find the node
+    p->p.store(page, std::memory_order_release);
+    _table.Insert(page_id, p);
+    // the new page is the youngest of the window, it never loses the duel
+    return victim != nullptr ? victim : shrink_one();
+  }
+  /**
+   * change the capacity, the pages over it are evicted into victims. The
+   * caller releases them like the victims of evict_and_insert.
+   */
+  void resize(size_t num_pages, std::vector<Page*>* victims) {
+    std::unique_lock<decltype(_lock)> l(_lock);
+    if (num_pages + 1 > _nodes) add_nodes(num_pages + 1 - _nodes);
+    _num_pages = num_pages;
+    _window_pages = admission_window(num_pages);
+    _sketch.SetCapacity(num_pages);
+    while (Page* victim = shrink_one()) {
+      victims->push_back(victim);
+    }
+  }
+  size_t capacity() {
+    std::unique_lock<decltype(_lock)> l(_lock);
+    return _num_pages;
   }
   void Print() {
     double hit_ratio = (_hit == 0 ? 0.0 : (double)_hit / (_hit + _miss)) * 100;
@@ -246,5 +297,95 @@ class sieve_buffer {
            _miss.load(), hit_ratio);
   }
   void print_all();
+
+ private:
+  void add_nodes(size_t n) {
+    sieve_node* chunk = new sieve_node[n];
+    _chunks.push_back(chunk);
+    _nodes += n;
+    for (size_t i = 0; i < n; ++i) {
+      chunk[i].add_after(&_free);
+    }
+  }
+  // move the hand to an unvisited node of the cache, _lock held
+  sieve_node* sweep() {
+    sieve_node* o = _hand;
+    if (o == nullptr || o == &_head) {
+      o = _head.prev;
+    }
+    while (o->visited.load(std::memory_order_relaxed) == 1) {
+      o->visited.store(0, std::memory_order_relaxed);
+      o = o->prev;
+      if (o == &_head) {
+        o = _head.prev;
+      }
+    }
+    _hand = o;
+    return o;
+  }
+  // move a node out of the page table to the free list, _lock held
+  Page* drop(sieve_node* p) {
+    if (_hand == p) {
+      _hand = nullptr;
+    }
+    if (p->in_window) {
+      p->in_window = false;
+      --_wsz;
+    }
+    p->visited = 0;
+    Page* page = p->unlink();
+    p->add_after(&_free);
+    --_sz;
+    return page;
+  }
+  Page* free_node(sieve_node* o) {
+    if (_hand == o) {
+      _hand = o->prev;
+    }
+    if (o->in_window) {
+      o->in_window = false;
+      _wsz--;
+    }
+    Page* victim = o->unlink();
+    _table.Erase(victim->GetPageId());
+    if (_ghost != nullptr) _ghost->Add(victim->GetPageId());
+    o->add_after(&_free);
+    _sz--;
+    return victim;
+  }
+  void promote(sieve_node* o) {
+    o->remove();
+    o->in_window = false;
+    _wsz--;
+    o->add_after(&_head);
+  }
+  u32 frequency(sieve_node* o) {
+    return _sketch.Estimate(o->p.load(std::memory_order_relaxed)->GetPageId());
+  }
+  // evict a page while over the capacity, nullptr once within, _lock held
+  Page* shrink_one() {
+    while (_wsz > _window_pages) {
+      sieve_node* candidate = _window.prev;
+      if (_sz - _wsz < _num_pages - std::min(_window_pages, _num_pages)) {
+        promote(candidate);
+        continue;
+      }
+      if (_sz == _wsz) {
+        return free_node(candidate);
+      }
+      // ties keep the page of the cache
+      sieve_node* victim = sweep();
+      if (frequency(candidate) <= frequency(victim)) {
+        return free_node(candidate);
+      }
+      Page* page = free_node(victim);
+      promote(candidate);
+      return page;
+    }
+    if (_sz > _num_pages) {
+      return free_node(sweep());
+    }
+    return nullptr;
+  }
 };
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,77 @@
+#include "mem_governor.h"
+
+#include <algorithm>
+#include <bit>
+
+void GhostList::Reset(u64 capacity) {
+  capacity = std::bit_ceil(std::max<u64>(capacity, 16));
+  shift_ = 64 - std::countr_zero(capacity);
+  ids_.reset(new std::atomic<page_id_t>[capacity]);
+  for (u64 i = 0; i < capacity; i++) {
+    ids_[i].store(INVALID_PAGE_ID, std::memory_order_relaxed);
+  }
+}
+
+void GhostList::Add(page_id_t page_id) {
+  ids_[Slot(page_id)].store(page_id, std::memory_order_relaxed);
+}
+
+bool GhostList::Hit(page_id_t page_id) {
+  auto &slot = ids_[Slot(page_id)];
+  if (slot.load(std::memory_order_relaxed) != page_id) return false;
+  // a page counts once, however many readers missed it
+  return slot.compare_exchange_strong(page_id, INVALID_PAGE_ID,
+                                      std::memory_order_relaxed);
+}
+
+void MemoryGovernor::Init(u32 nr_buffers, u64 fifo_pages, u64 cache_pages) {
+  nr_parts_ = nr_buffers * NR_BUFFER_PARTS;
+  min_capacity_[FIFO_PART] = std::min<u64>(MIN_FIFO_PAGES, fifo_pages);
+  min_capacity_[READ_CACHE_PART] =
+      std::min<u64>(MIN_READ_CACHE_PAGES, cache_pages);
+  budget_ = nr_buffers * (fifo_pages + cache_pages);
+  // a part grows up to GOVERNOR_MAX_SHARE even shares of a whole buffer
+  u64 share = GOVERNOR_MAX_SHARE * (fifo_pages + cache_pages);
+  max_capacity_[FIFO_PART] = std::max(fifo_pages, share);
+  max_capacity_[READ_CACHE_PART] = std::max(cache_pages, share);
+  capacity_.reset(new std::atomic<u64>[nr_parts_]);
+  credit_.reset(new u32[nr_parts_]);
+  for (u32 i = 0; i < nr_parts_; i++) {
+    capacity_[i].store(i % NR_BUFFER_PARTS == FIFO_PART ? fifo_pages
+                                                         : cache_pages,
+                       std::memory_order_relaxed);
+    credit_[i] = 0;
+  }
+}
+
+bool MemoryGovernor::Grow(u32 buffer, BufferPart part, u32 *donor,
+                          BufferPart *donor_part) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  u32 taker = Index(buffer, part);
+  credit_[taker] = std::min<u32>(credit_[taker] + 1, GOVERNOR_MAX_CREDIT);
+  u64 step = GOVERNOR_STEP_PAGES;
+  if (capacity_[taker].load(std::memory_order_relaxed) + step >
+      max_capacity_[part]) {
+    return false;
+  }
+  // every credit is gone after that many rounds
+  for (u32 n = 0; n < nr_parts_ * (GOVERNOR_MAX_CREDIT + 1); n++) {
+    u32 i = hand_;
+    hand_ = (hand_ + 1) % nr_parts_;
+    if (i == taker) continue;
+    u64 capacity = capacity_[i].load(std::memory_order_relaxed);
+    if (capacity < min_capacity_[i % NR_BUFFER_PARTS] + step) continue;
+    if (credit_[i] > 0) {
+      credit_[i]--;
+      continue;
+    }
+    // the donor shrinks before the taker grows, the pool applies it so
+    capacity_[i].store(capacity - step, std::memory_order_release);
+    capacity_[taker].fetch_add(step, std::memory_order_release);
+    moved_pages_ += step;
+    *donor = i / NR_BUFFER_PARTS;
+    *donor_part = static_cast<BufferPart>(i % NR_BUFFER_PARTS);
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>  // NOLINT
+
+#include "config.h"
+
+/* the two parts of a zone buffer the memory budget is split into */
+enum BufferPart : u32 { FIFO_PART = 0, READ_CACHE_PART, NR_BUFFER_PARTS };
+
+/**
+ * GhostList remembers the ids of pages that left a FIFO or read cache,
+ * hashed into a fixed array. Ids hashing alike overwrite each other, so it
+ * forgets more than a list of the same length, but takes no lock.
+ */
+class GhostList {
+ public:
+  GhostList() = default;
+  DISALLOW_COPY_AND_MOVE(GhostList);
+
+  /* before the first Add, capacity is rounded up to a power of 2 */
+  void Reset(u64 capacity);
+  void Add(page_id_t page_id);
+  /* true once for a page id added and not overwritten since */
+  bool Hit(page_id_t page_id);
+
+ private:
+  u64 Slot(page_id_t page_id) const {
+    return (page_id * 0x9E3779B97F4A7C15ULL) >> shift_;
+  }
+  u32 shift_ = 64;
+  std::unique_ptr<std::atomic<page_id_t>[]> ids_;
+};
+
+/**
+ * MemoryGovernor splits one page budget over the FIFOs and read caches of
+ * all zone buffers. Like ARC it adapts on ghost hits: a part that misses a
+ * page it evicted lately would have kept it with more room, so it takes
+ * GOVERNOR_STEP_PAGES from another part, of the same or any other zone
+ * buffer.
+ *
+ * The donor is picked by a clock over all parts. A ghost hit gives its part
+ * a credit, the hand takes a credit away instead of taking pages, so parts
+ * that keep having ghost hits are passed over and idle ones give up their
+ * room. No part drops below its floor or grows beyond GOVERNOR_MAX_SHARE
+ * times its even share of the budget.
+ *
+ * The governor only keeps the capacities, the pool applies them.
+ */
+class MemoryGovernor {
+ public:
+  MemoryGovernor() = default;
+  DISALLOW_COPY_AND_MOVE(MemoryGovernor);
+
+  /* fifo_pages and cache_pages are the initial split of every buffer */
+  void Init(u32 nr_buffers, u64 fifo_pages, u64 cache_pages);
+
+  /**
+   * part of buffer had a ghost hit, move a step to it
+   * @return false if it is at its limit or no part could give
+   */
+  bool Grow(u32 buffer, BufferPart part, u32 *donor, BufferPart *donor_part);
+
+  u64 GetCapacity(u32 buffer, BufferPart part) const {
+    return capacity_[Index(buffer, part)].load(std::memory_order_acquire);
+  }
+  u64 GetMaxCapacity(BufferPart part) const { return max_capacity_[part]; }
+  u64 GetBudget() const { return budget_; }
+  u64 GetMovedPages() const { return moved_pages_; }
+
+ private:
+  static u32 Index(u32 buffer, BufferPart part) {
+    return buffer * NR_BUFFER_PARTS + part;
+  }
+
+  u32 nr_parts_ = 0;
+  u64 budget_ = 0;
+  u64 min_capacity_[NR_BUFFER_PARTS] = {0};
+  u64 max_capacity_[NR_BUFFER_PARTS] = {0};
+  std::unique_ptr<std::atomic<u64>[]> capacity_;
+  // guarded by mutex_
+  std::unique_ptr<u32[]> credit_;
+  u32 hand_ = 0;
+  std::atomic<u64> moved_pages_{0};
+  std::mutex mutex_;
+};
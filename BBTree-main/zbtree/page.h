@@ -9,10 +9,6 @@
 #include "config.h"
 #include "rwlatch.h"
 
-#define DESTROY_PAGE(page) \
-  free(page->GetData());   \
-  delete[] page;           \
-  page = nullptr;
 /**
  * Page is the basic unit of storage within the database system. Page provides a
  * wrapper for actual data pages being held in main memory. Page also contains
@@ -85,6 +81,11 @@ class Page {
   inline bool IsFlushed() {
     return status_.load(std::memory_order_acquire) == FLUSHED;
   }
+  /* still in the FIFO under page_id and not staged, a write reaches the
+   * device. Check it under the write latch. */
+  inline bool IsWritable(page_id_t page_id) {
+    return IsActive() && page_id_ == page_id;
+  }
 
   //  protected:
   static const size_t SIZE_PAGE_HEADER = 8;
@@ -100,7 +101,8 @@ class Page {
   /** The ID of this page. */
   page_id_t page_id_ = INVALID_PAGE_ID;
   void *leaf_ptr_ = nullptr;
-  /** The pin count of this page. */
+  /** The pin count of this page. Only the buffers holding it pin a page of
+   * a zone buffer, readers keep it alive by their epoch, see Epoch. */
   std::atomic_int pin_count_ = 0;
   /** True if the page is dirty, i.e. it is different from its corresponding
    * page on disk. */
@@ -108,6 +110,8 @@ class Page {
   /** The read count of this page. */
   std::atomic<int> read_count_{0};
   std::atomic<int> status_{0};
+  /** True if the page came from the PagePool. */
+  bool pooled_ = false;
   /** Page latch. */
   ReaderWriterLatch rwlatch_;
 };
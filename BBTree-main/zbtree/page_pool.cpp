@@ -0,0 +1,118 @@
+#include "page_pool.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>  // NOLINT
+#include <new>
+
+namespace {
+
+const u64 kSlabPages = std::max<u64>(PAGE_POOL_SLAB_PAGES, 1);
+
+struct SharedList {
+  std::mutex mutex;
+  std::vector<Page *> pages;
+  std::atomic<u64> carved{0};
+};
+
+// never destroyed, threads may still release pages at exit
+SharedList &Shared() {
+  static SharedList *shared = new SharedList();
+  return *shared;
+}
+
+// the released pages of a thread, handed back when the thread ends
+struct LocalCache {
+  std::vector<Page *> pages;
+  ~LocalCache() {
+    std::lock_guard<std::mutex> guard(Shared().mutex);
+    Shared().pages.insert(Shared().pages.end(), pages.begin(), pages.end());
+  }
+};
+thread_local LocalCache local_cache;
+
+char *AllocateSlab(u64 bytes) {
+#ifdef PAGE_POOL_HUGEPAGES
+  const u64 huge = 2 * 1024 * 1024;
+  char *slab = (char *)aligned_alloc(huge, (bytes + huge - 1) / huge * huge);
+  if (slab != nullptr) madvise(slab, bytes, MADV_HUGEPAGE);
+#else
+  char *slab = (char *)aligned_alloc(PAGE_SIZE, bytes);
+#endif
+  // fault the frames in here rather than on the first write of a page
+  if (slab != nullptr) memset(slab, 0, bytes);
+  return slab;
+}
+
+}  // namespace
+
+bool PagePool::Refill(std::vector<Page *> *cache) {
+  {
+    SharedList &shared = Shared();
+    std::lock_guard<std::mutex> guard(shared.mutex);
+    size_t n = std::min<size_t>(shared.pages.size(), PAGE_POOL_CACHE_PAGES / 2);
+    if (n > 0) {
+      cache->insert(cache->end(), shared.pages.end() - n, shared.pages.end());
+      shared.pages.resize(shared.pages.size() - n);
+      return true;
+    }
+  }
+  // carve a new slab without holding the lock, the rest of it is shared
+  char *frames = AllocateSlab(kSlabPages * PAGE_SIZE);
+  Page *pages = nullptr;
+  if (frames != nullptr) pages = new (std::nothrow) Page[kSlabPages];
+  if (pages == nullptr) {
+    free(frames);
+    return false;
+  }
+  for (u64 i = 0; i < kSlabPages; i++) {
+    pages[i].SetData(frames + i * PAGE_SIZE);
+    pages[i].pooled_ = true;
+    cache->push_back(&pages[i]);
+  }
+  Shared().carved.fetch_add(kSlabPages, std::memory_order_relaxed);
+  Drain(cache, PAGE_POOL_CACHE_PAGES / 2);
+  return true;
+}
+
+void PagePool::Drain(std::vector<Page *> *cache, size_t keep) {
+  if (cache->size() <= keep) return;
+  SharedList &shared = Shared();
+  std::lock_guard<std::mutex> guard(shared.mutex);
+  shared.pages.insert(shared.pages.end(), cache->begin() + keep, cache->end());
+  cache->resize(keep);
+}
+
+Page *PagePool::Grab() {
+  std::vector<Page *> &cache = local_cache.pages;
+  if (cache.empty() && !Refill(&cache)) return nullptr;
+  Page *page = cache.back();
+  cache.pop_back();
+  // start over from a fresh descriptor, the frame stays
+  char *data = page->GetData();
+  page->~Page();
+  new (page) Page();
+  page->SetData(data);
+  page->pooled_ = true;
+  return page;
+}
+
+void PagePool::Release(Page *page) {
+  if (!page->pooled_) {
+    free(page->GetData());
+    delete[] page;
+    return;
+  }
+  std::vector<Page *> &cache = local_cache.pages;
+  cache.push_back(page);
+  if (cache.size() > PAGE_POOL_CACHE_PAGES) {
+    Drain(&cache, PAGE_POOL_CACHE_PAGES / 2);
+  }
+}
+
+u64 PagePool::GetCarvedPages() {
+  return Shared().carved.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+
+#include "config.h"
+#include "page.h"
+
+/**
+ * PagePool hands out page descriptors with one PAGE_SIZE aligned frame each.
+ * Frames are carved from slabs of PAGE_POOL_SLAB_PAGES that are faulted in
+ * once, a released page goes back to a free list instead of the heap. Every
+ * thread keeps up to PAGE_POOL_CACHE_PAGES released pages to itself, the
+ * shared list is locked only to move half a cache at a time.
+ *
+ * Slabs are never given back, the pool stays as large as the most pages that
+ * were alive at once.
+ */
+class PagePool {
+ public:
+  /* a fresh page, unpinned and without page id */
+  static Page *Grab();
+  /* the page may come from the heap, see DESTROY_PAGE */
+  static void Release(Page *page);
+
+  /* frames carved so far */
+  static u64 GetCarvedPages();
+
+ private:
+  static bool Refill(std::vector<Page *> *cache);
+  static void Drain(std::vector<Page *> *cache, size_t keep);
+};
+
+#define DESTROY_PAGE(page)   \
+  do {                       \
+    PagePool::Release(page); \
+    (page) = nullptr;        \
+  } while (0)
@@ -0,0 +1,208 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <functional>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <type_traits>
+#include <vector>
+
+#include "config.h"
+
+/**
+ * PageTable maps page ids to 8-byte values in a single open-addressing array
+ * with linear probing, a hit costs about one cache miss instead of a bucket
+ * walk. Lookups take no lock, they read optimistically and restart once a
+ * writer moved entries meanwhile, like the readers of the index nodes.
+ * Writers are serialized by write_mtx_.
+ *
+ * An erase shifts the entries behind it back instead of leaving tombstones,
+ * the page ids of a FIFO come and go all the time. The array doubles once it
+ * is half full, an entry being moved holds kMoved. Replaced arrays stay until
+ * the table is destroyed, a reader may still walk them, and they add up to
+ * less than the live one.
+ */
+template <typename V>
+class PageTable {
+  static_assert(sizeof(V) == sizeof(u64), "values are stored in 8 bytes");
+  static constexpr page_id_t kEmpty = INVALID_PAGE_ID;
+  static constexpr u64 kMoved = ~0ULL;
+
+  struct Slot {
+    std::atomic<page_id_t> key{kEmpty};
+    std::atomic<u64> value{0};
+  };
+  struct Array {
+    explicit Array(u64 capacity)
+        : mask(capacity - 1), slots(new Slot[capacity]) {}
+    u64 mask;
+    std::unique_ptr<Slot[]> slots;
+  };
+
+ public:
+  explicit PageTable(u64 capacity = 64)
+      : array_(new Array(std::bit_ceil(std::max<u64>(capacity, 16)))) {}
+  ~PageTable() {
+    delete array_.load();
+    for (auto array : retired_) delete array;
+  }
+  DISALLOW_COPY_AND_MOVE(PageTable);
+
+  /* lock free, value is left untouched if the key is absent */
+  bool Find(page_id_t key, V *value = nullptr) const {
+    while (true) {
+      u64 version = version_.load(std::memory_order_acquire);
+      if (version & 1) {
+        _mm_pause();
+        continue;
+      }
+      Array *array = array_.load(std::memory_order_acquire);
+      Slot *slot = Probe(array, key);
+      u64 raw =
+          slot == nullptr ? 0 : slot->value.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (raw == kMoved ||
+          version_.load(std::memory_order_relaxed) != version) {
+        continue;
+      }
+      if (slot == nullptr) return false;
+      if (value != nullptr) *value = std::bit_cast<V>(raw);
+      return true;
+    }
+  }
+
+  /* insert or overwrite */
+  void Insert(page_id_t key, V value) {
+    std::lock_guard<std::mutex> guard(write_mtx_);
+    Slot *slot = Probe(array_.load(std::memory_order_relaxed), key);
+    if (slot != nullptr) {
+      slot->value.store(std::bit_cast<u64>(value), std::memory_order_release);
+      return;
+    }
+    InsertNew(key, std::bit_cast<u64>(value));
+  }
+
+  /**
+   * add delta to the value of key, a missing key starts from 0. Lock free
+   * while the key is present, but not against Erase: a table that counts
+   * is never erased from.
+   */
+  void Add(page_id_t key, u64 delta) {
+    static_assert(std::is_integral_v<V>, "only counters are added to");
+    while (true) {
+      Slot *slot = Probe(array_.load(std::memory_order_acquire), key);
+      if (slot == nullptr) break;
+      u64 cur = slot->value.load(std::memory_order_relaxed);
+      while (cur != kMoved &&
+             !slot->value.compare_exchange_weak(cur, cur + delta)) {
+      }
+      // the array grew meanwhile, add to the new one
+      if (cur != kMoved) return;
+    }
+    std::lock_guard<std::mutex> guard(write_mtx_);
+    Slot *slot = Probe(array_.load(std::memory_order_relaxed), key);
+    if (slot != nullptr) {
+      slot->value.fetch_add(delta);
+      return;
+    }
+    InsertNew(key, delta);
+  }
+
+  bool Erase(page_id_t key) {
+    std::lock_guard<std::mutex> guard(write_mtx_);
+    Array *array = array_.load(std::memory_order_relaxed);
+    Slot *slot = Probe(array, key);
+    if (slot == nullptr) return false;
+    version_.fetch_add(1);
+    // move every following entry of the cluster which may live in the hole
+    u64 hole = slot - array->slots.get();
+    for (u64 i = (hole + 1) & array->mask;; i = (i + 1) & array->mask) {
+      page_id_t k = array->slots[i].key.load(std::memory_order_relaxed);
+      if (k == kEmpty) break;
+      u64 home = Hash(k) & array->mask;
+      if (((i - home) & array->mask) < ((i - hole) & array->mask)) continue;
+      u64 raw = array->slots[i].value.exchange(kMoved);
+      array->slots[hole].value.store(raw, std::memory_order_relaxed);
+      array->slots[hole].key.store(k, std::memory_order_relaxed);
+      hole = i;
+    }
+    array->slots[hole].key.store(kEmpty, std::memory_order_relaxed);
+    array->slots[hole].value.store(0, std::memory_order_relaxed);
+    version_.fetch_add(1, std::memory_order_release);
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  u64 Size() const { return size_.load(std::memory_order_relaxed); }
+
+  /* visit every entry, writers wait meanwhile */
+  void ForEach(const std::function<void(page_id_t, V)> &visit) {
+    std::lock_guard<std::mutex> guard(write_mtx_);
+    Array *array = array_.load(std::memory_order_relaxed);
+    for (u64 i = 0; i <= array->mask; i++) {
+      page_id_t k = array->slots[i].key.load(std::memory_order_relaxed);
+      if (k == kEmpty) continue;
+      visit(k, std::bit_cast<V>(array->slots[i].value.load()));
+    }
+  }
+
+ private:
+  static u64 Hash(page_id_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+  static Slot *Probe(Array *array, page_id_t key) {
+    for (u64 i = Hash(key) & array->mask;; i = (i + 1) & array->mask) {
+      page_id_t k = array->slots[i].key.load(std::memory_order_acquire);
+      if (k == key) return &array->slots[i];
+      if (k == kEmpty) return nullptr;
+    }
+  }
+
+  /* write_mtx_ held, key is absent */
+  void InsertNew(page_id_t key, u64 raw) {
+    Array *array = array_.load(std::memory_order_relaxed);
+    if ((size_.load(std::memory_order_relaxed) + 1) * 2 > array->mask + 1) {
+      array = Grow(array);
+    }
+    u64 i = Hash(key) & array->mask;
+    while (array->slots[i].key.load(std::memory_order_relaxed) != kEmpty) {
+      i = (i + 1) & array->mask;
+    }
+    // the value is there before a reader can find the key
+    array->slots[i].value.store(raw, std::memory_order_relaxed);
+    array->slots[i].key.store(key, std::memory_order_release);
+    size_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  Array *Grow(Array *old_array) {
+    Array *array = new Array((old_array->mask + 1) * 2);
+    version_.fetch_add(1);
+    for (u64 i = 0; i <= old_array->mask; i++) {
+      page_id_t k = old_array->slots[i].key.load(std::memory_order_relaxed);
+      if (k == kEmpty) continue;
+      u64 raw = old_array->slots[i].value.exchange(kMoved);
+      u64 j = Hash(k) & array->mask;
+      while (array->slots[j].key.load(std::memory_order_relaxed) != kEmpty) {
+        j = (j + 1) & array->mask;
+      }
+      array->slots[j].value.store(raw, std::memory_order_relaxed);
+      array->slots[j].key.store(k, std::memory_order_relaxed);
+    }
+    array_.store(array, std::memory_order_release);
+    version_.fetch_add(1, std::memory_order_release);
+    retired_.push_back(old_array);
+    return array;
+  }
+
+  std::atomic<Array *> array_;
+  // odd while a writer moves entries
+  std::atomic<u64> version_{0};
+  std::atomic<u64> size_{0};
+  std::mutex write_mtx_;
+  std::vector<Array *> retired_;
+};
@@ -165,6 +165,42 @@ page_id_t ZnsManager::GetNextWritePageId(zns_id_t zone_id) {
   return MAKE_PAGE_ID(zone_id, zone->wp_);
 }
 
+bool ZnsManager::ReadMeta(MetaRecord *meta) {
+  Zone *zone = zbd_->GetMetaZone();
+  if (zone == nullptr) return false;
+  char *buf = (char *)aligned_alloc(ZNS_PAGE_SIZE, ZNS_PAGE_SIZE);
+  bool found = false;
+  // records are appended, the newest one is right below the write pointer
+  for (uint64_t offset = zone->wp_; offset > zone->start_;) {
+    offset -= ZNS_PAGE_SIZE;
+    if (zone->Read(buf, ZNS_PAGE_SIZE, offset) != OK()) break;
+    auto record = reinterpret_cast<MetaRecord *>(buf);
+    if (record->magic == META_RECORD_MAGIC) {
+      *meta = *record;
+      found = true;
+      break;
+    }
+  }
+  free(buf);
+  return found;
+}
+
+IOStatus ZnsManager::WriteMeta(const MetaRecord &meta) {
+  Zone *zone = zbd_->GetMetaZone();
+  if (zone == nullptr) return NotSupported("no metadata zone");
+  if (zone->GetCapacityLeft() < ZNS_PAGE_SIZE) {
+    zone->ClearValid();
+    IOStatus s = zone->Reset();
+    if (s != OK()) return s;
+  }
+  char *buf = (char *)aligned_alloc(ZNS_PAGE_SIZE, ZNS_PAGE_SIZE);
+  memset(buf, 0, ZNS_PAGE_SIZE);
+  memcpy(buf, &meta, sizeof(meta));
+  IOStatus s = zone->Append(buf, ZNS_PAGE_SIZE);
+  free(buf);
+  return s;
+}
+
 offset_t ZnsManager::write_page(page_id_t page_id, const char *page_data) {
   return write_n_pages(page_id, 1, page_data);
 }
@@ -68,6 +68,24 @@ class DiskManager : public StorageManager {
 
 // extern DiskManager *db_io;
 
+/**
+ * the superblock of the store. Every change appends one page to the metadata
+ * zone of the device, the last valid one counts.
+ */
+struct MetaRecord {
+  u64 magic;
+  u32 page_size;
+  u32 key_size;
+  u32 value_size;
+  /* the devices of a striped store, each carries its own record */
+  u32 device_id;
+  u32 nr_devices;
+  /* every leaf page sequence number below was possibly handed out, only
+   * the first device keeps it */
+  u64 seq_lease;
+};
+const u64 META_RECORD_MAGIC = 0x4242545245454d44;  // "BBTREEMD"
+
 class ZnsManager : public StorageManager {
  public:
   ZnsManager() = delete;
@@ -84,6 +102,11 @@ class ZnsManager : public StorageManager {
   zns_id_t GetEmptyZoneId();
   page_id_t GetNextWritePageId(zns_id_t zone_id);
 
+  /* the last record of the metadata zone, false on a fresh device */
+  bool ReadMeta(MetaRecord *meta);
+  /* the metadata zone is reset once it is full */
+  IOStatus WriteMeta(const MetaRecord &meta);
+
   offset_t write_page(page_id_t page_id, const char *page_data) override;
   offset_t read_page(page_id_t page_id, char *page_data) override;
   offset_t write_n_pages(page_id_t page_id, size_t nr_pages,
@@ -100,4 +123,9 @@ class ZnsManager : public StorageManager {
   std::atomic_uint64_t read_count_;
 };
 
+/* the zone id in page ids, see MAKE_ZONE_ID */
+inline zns_id_t GetZoneId(Zone *zone) {
+  return MAKE_ZONE_ID(zone->GetDevice()->GetDeviceId(), zone->GetZoneNr());
+}
+
 // }  // namespace BTree
@@ -94,7 +94,8 @@ bool thread_pool::get(KeyType key, ValueType& value) {
   return false;
 }
 
-uint64_t thread_pool::scan(KeyType key, int range, ValueType* values) {
+uint64_t thread_pool::scan(KeyType key, int range, ValueType* values,
+                           KeyType* keys) {
   uint64_t count = 0;
   if (!start.load()) return count;
   start_rdlock.RLock();
@@ -109,6 +110,7 @@ uint64_t thread_pool::scan(KeyType key, int range, ValueType* values) {
   work w = *wp;
   auto start = std::lower_bound(w.keys, w.keys + w.count, key) - w.keys;
   for (auto i = start; i < w.count && count < range; ++i) {
+    if (keys) keys[count] = w.keys[i];
     values[count++] = w.values[i];
   }
   // ++wp;
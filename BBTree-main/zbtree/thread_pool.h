@@ -51,8 +51,10 @@ struct thread_pool {
   void run();
   void do_work(const int index);
   void notify_all();
+  /* see work_queue::get and work_queue::scan */
   bool get(KeyType, ValueType&);
-  uint64_t scan(KeyType k, int range, ValueType* values);
+  uint64_t scan(KeyType k, int range, ValueType* values,
+                KeyType* keys = nullptr);
 };
 }  // namespace btreeolc
 
@@ -95,7 +95,8 @@ bool work_queue::get(KeyType key, ValueType& value) {
   return false;
 }
 
-uint64_t work_queue::scan(KeyType key, int range, ValueType* values) {
+uint64_t work_queue::scan(KeyType key, int range, ValueType* values,
+                          KeyType* keys) {
   uint64_t count = 0;
   if (_done >= _size) return count;
   _rdlock.RLock();
@@ -110,6 +111,7 @@ uint64_t work_queue::scan(KeyType key, int range, ValueType* values) {
     work& w = *wp;
     auto start = std::lower_bound(w.keys, w.keys + w.count, key) - w.keys;
     for (int i = start; i < w.count && count < range; i++) {
+      if (keys) keys[count] = w.keys[i];
       values[count++] = w.values[i];
     }
     wp = std::next(wp);
@@ -33,7 +33,10 @@ struct work_queue {
     device_tree->BatchInsert(w.keys, w.values, w.count);
 #else
     for (int i = 0; i < w.count; i++) {
-      device_tree->Insert(w.keys[i], w.values[i]);
+      if (w.values[i] == TOMBSTONE_VALUE)
+        device_tree->Remove(w.keys[i]);
+      else
+        device_tree->Insert(w.keys[i], w.values[i]);
     }
 #endif
 
@@ -46,8 +49,12 @@ struct work_queue {
   void queue(q_type& w);
   void yield();
 
+  /* a buffered delete is found with TOMBSTONE_VALUE, the device tree may
+   * still hold the key until the batch is done */
   bool get(KeyType key, ValueType& value);
-  uint64_t scan(KeyType key, int range, ValueType* values);
+  /* tombstones are returned too, keys receives the key of every value */
+  uint64_t scan(KeyType key, int range, ValueType* values,
+                KeyType* keys = nullptr);
 };
 }  // namespace btreeolc
 
@@ -1,34 +1,26 @@
 /*
  * BTreeOLC_child_layout.h - This file contains a modified version that
- *                           uses the key-value pair layout
+ *                           uses the key-value pair layout, or separate key
+ *                           and value blocks with LEAF_SOA
  *
  * We use this to test whether child node layout will affect performance
  */
 
 #include "zbtree.h"
 
+#include <chrono>
+#include <map>
+#include <optional>
+
 namespace btreeolc {
 BTreeLeaf::BTreeLeaf() { Init(); }
 
 bool BTreeLeaf::isFull() { return count == LeafNodeMaxEntries; };
 
-unsigned BTreeLeaf::lowerBound(Key k) {
-  unsigned lower = 0;
-  unsigned upper = count;
-  do {
-    unsigned mid = ((upper - lower) / 2) + lower;
-    // This is the key at the pivot position
-    const Key& middle_key = data[mid].first;
-
-    if (k < middle_key) {
-      upper = mid;
-    } else if (k > middle_key) {
-      lower = mid + 1;
-    } else {
-      return mid;
-    }
-  } while (lower < upper);
-  return lower;
+unsigned BTreeLeaf::lowerBound(Key k) { return lowerBound(data, k); }
+
+unsigned BTreeLeaf::lowerBound(const LeafEntries& entries, Key k) {
+  return entries.lowerBound(count, k);
 }
 
 /**
@@ -41,140 +33,250 @@ unsigned BTreeLeaf::lowerBound(Key k) {
  */
 bool BTreeLeaf::insert(Key k, Value p) {
   assert(count < LeafNodeMaxEntries);
-  if (count) {
-    unsigned pos = lowerBound(k);
-    if ((pos < count) && (data[pos].first == k)) {
-      // Upsert
-      data[pos].second = p;
-      return false;
-    }
-    memmove(data + pos + 1, data + pos, sizeof(KeyValueType) * (count - pos));
-    // memmove(payloads+pos+1,payloads+pos,sizeof(Payload)*(count-pos));
-    data[pos].first = k;
-    data[pos].second = p;
-  } else {
-    data[0].first = k;
-    data[0].second = p;
+  unsigned pos = count ? lowerBound(k) : 0;
+  if ((pos < count) && (data.key(pos) == k)) {
+    // Upsert
+    data.value(pos) = p;
+    return false;
   }
+  data.copy(pos + 1, data, pos, count - pos);
+  data.set(pos, k, p);
   count++;
   return true;
 }
 
 int BTreeLeaf::BatchInsert(Key* keys, Value* values, int num) {
   assert(count < LeafNodeMaxEntries);
+  unsigned pos = count ? lowerBound(keys[0]) : 0;
+  // the entries before pos stay, the ones after are merged with the new
+  // keys from a copy
+  unsigned tail = count - pos;
+  alignas(CacheLineSize) char buffer[LeafNodeSize];
+  LeafEntries original(buffer);
+  original.copy(0, data, pos, tail);
+  unsigned can_insert = LeafNodeMaxEntries - count;
+  unsigned ori_pos = 0;
+  unsigned insert_pos = pos;
+  // write_cnt is the pos of new write data
   int write_cnt = 0;
-  if (count) {
-    unsigned pos = lowerBound(keys[0]);
-    // std::unique_ptr<KeyValueType[]> original(new KeyValueType[count]);
-    KeyValueType original[count];
-    memcpy(original, data, sizeof(KeyValueType) * count);
-    // iter original data and write data in order
-    // original data position
-    int can_insert = LeafNodeMaxEntries - count;
-    unsigned ori_pos = pos;
-    // insert position
-    auto insert_pos = pos;
-    // write_cnt is the pos of new write data
-    while (ori_pos < count && write_cnt < num &&
-           insert_pos < LeafNodeMaxEntries && can_insert >= 0) {
-      auto kv = original[ori_pos];
-      if (kv.first == keys[write_cnt]) {
-        // upsert
-        data[insert_pos] = std::make_pair(keys[write_cnt], values[write_cnt]);
-        ori_pos++;
-        write_cnt++;
-      } else if (kv.first < keys[write_cnt]) {
-        data[insert_pos] = kv;
-        ori_pos++;
-      } else
-      // kv.first > keys[write_cnt]
-      {
-        if (can_insert > 0) {
-          data[insert_pos] = std::make_pair(keys[write_cnt], values[write_cnt]);
-          write_cnt++;
-          can_insert--;
-        } else {
-          break;
-        }
-      }
-      insert_pos++;
-    }
-    if (can_insert == 0 && ori_pos < count) {
-      memcpy(data + insert_pos, original + ori_pos,
-             sizeof(KeyValueType) * (count - ori_pos));
-      insert_pos += count - ori_pos;
-      count = insert_pos;
-      return write_cnt;
-    }
-    if (ori_pos < count) {
-      // copy the rest data
-      memcpy(data + insert_pos, original + ori_pos,
-             sizeof(KeyValueType) * (count - ori_pos));
-      insert_pos += count - ori_pos;
-    } else if (write_cnt < num) {
-      // copy the rest data
-      while (write_cnt < num && insert_pos < LeafNodeMaxEntries) {
-        *(data + insert_pos) =
-            std::make_pair(keys[write_cnt], values[write_cnt]);
-        insert_pos++;
-        write_cnt++;
-      }
+  while (ori_pos < tail && write_cnt < num) {
+    Key next = keys[write_cnt];
+    // the original entries below the next new key move as one run
+    unsigned run_end = ori_pos;
+    while (run_end < tail && original.key(run_end) < next) run_end++;
+    data.copy(insert_pos, original, ori_pos, run_end - ori_pos);
+    insert_pos += run_end - ori_pos;
+    ori_pos = run_end;
+    if (ori_pos < tail && original.key(ori_pos) == next) {
+      // upsert
+      ori_pos++;
+    } else if (can_insert > 0) {
+      can_insert--;
+    } else {
+      break;
     }
-    count = insert_pos;
-    return write_cnt;
+    data.set(insert_pos++, next, values[write_cnt]);
+    write_cnt++;
   }
-  // there is no key
-  // so we can directly copy the data
-  while (write_cnt < num && write_cnt < LeafNodeMaxEntries) {
-    data[write_cnt] = std::make_pair(keys[write_cnt], values[write_cnt]);
+  // the rest of the original data, or of the new keys as long as they fit
+  data.copy(insert_pos, original, ori_pos, tail - ori_pos);
+  insert_pos += tail - ori_pos;
+  while (write_cnt < num && can_insert > 0) {
+    data.set(insert_pos++, keys[write_cnt], values[write_cnt]);
     write_cnt++;
+    can_insert--;
   }
-  count = write_cnt;
+  count = insert_pos;
   return write_cnt;
 }
 
+int BTreeLeaf::remove(const Key* keys, int num) {
+  if (count == 0 || num == 0) return 0;
+  unsigned in = lowerBound(keys[0]);
+  unsigned out = in;
+  int i = 0;
+  for (; in < count; in++) {
+    while (i < num && keys[i] < data.key(in)) i++;
+    if (i == num) {
+      data.copy(out, data, in, count - in);
+      out += count - in;
+      break;
+    }
+    if (keys[i] == data.key(in)) {
+      i++;
+      continue;
+    }
+    data.set(out++, data.key(in), data.value(in));
+  }
+  int removed = count - out;
+  count = out;
+  return removed;
+}
+
+void BTreeLeaf::merge(BTreeLeaf* sibling) {
+  assert(count + sibling->count <= LeafNodeMaxEntries);
+  if (sibling->high_key < low_key) {
+    data.copy(sibling->count, data, 0, count);
+    data.copy(0, sibling->data, 0, sibling->count);
+    low_key = sibling->low_key;
+  } else {
+    data.copy(count, sibling->data, 0, sibling->count);
+    high_key = sibling->high_key;
+  }
+  count += sibling->count;
+}
+
+Key BTreeLeaf::rebalance(BTreeLeaf* right) {
+  unsigned total = count + right->count;
+  unsigned left_count = total / 2;
+  assert(left_count > 0);
+  if (count > left_count) {
+    // the tail of this leaf goes to the head of right
+    unsigned n = count - left_count;
+    right->data.copy(n, right->data, 0, right->count);
+    right->data.copy(0, data, left_count, n);
+  } else {
+    unsigned n = left_count - count;
+    data.copy(count, right->data, 0, n);
+    right->data.copy(0, right->data, n, right->count - n);
+  }
+  count = left_count;
+  right->count = total - left_count;
+  high_key = data.key(count - 1);
+  right->low_key = high_key + 1;
+  return high_key;
+}
+
 void BTreeLeaf::Init(uint16_t num, page_id_t id) {
   count = num;
   page_id = id;
   type = typeMarker;
-  data = NULL;
+  data = nullptr;
+}
+
+u32 BTreeLeaf::Temperature(void* bpm) {
+#ifdef ZNS_BUFFER_POOL
+  u32 epoch = ((ZoneManagerPool*)bpm)->GetHeatEpoch();
+  u32 age = epoch - heat_epoch;
+  heat = age >= 32 ? 0 : heat >> age;
+  heat_epoch = epoch;
+  return HeatToTemperature(heat);
+#else
+  return ANY_TEMPERATURE;
+#endif
+}
+
+void BTreeLeaf::RecordWrite(page_id_t old_page_id) {
+  if (page_id != old_page_id && heat < UINT32_MAX) heat++;
+}
+
+void BTreeLeaf::Stamp(void* bpm) {
+#ifdef ZNS_BUFFER_POOL
+  LeafFooter* footer = LeafFooter::Of(data.page);
+  footer->magic = LEAF_FOOTER_MAGIC;
+  footer->seq = ((ZoneManagerPool*)bpm)->NextPageSeq();
+  footer->low_key = low_key;
+  footer->high_key = high_key;
+  footer->count = count;
+#endif
+}
+
+bool LeafFooter::IsValid() const {
+  return magic == LEAF_FOOTER_MAGIC && low_key <= high_key &&
+         count <= LeafNodeMaxEntries;
+}
+
+// a new page latched for its first write. another thread switching the zone
+// may stage it before, then it goes to the device unwritten and nothing points
+// to it, take the next one
+static void NewLatchedPage(std::optional<NodeRAII>* page, void* bpm,
+                           page_id_t* page_id, page_id_t from,
+                           u32 temperature) {
+  while (true) {
+    page->emplace(bpm, page_id, from, temperature);
+    (*page)->GetPage()->WLatch();
+    if ((*page)->GetPage()->IsWritable(*page_id)) return;
+    (*page)->GetPage()->WUnlatch();
+    ((ZoneManagerPool*)bpm)->InvalidatePage(*page_id);
+  }
+}
+
+// the page of a write locked leaf for a write, a copy if it left the FIFO.
+// It is latched by LatchLeafPage once all pages of the write are taken, a
+// zone buffer latches the pages of its FIFO under its lock
+static void TakeLeafPage(std::optional<NodeRAII>* page, BTreeLeaf* leaf,
+                         void* bpm) {
+  page_id_t old_page_id = leaf->page_id;
+  page->emplace(bpm, leaf->page_id, WRITE_FLAG, leaf->Temperature(bpm));
+  leaf->RecordWrite(old_page_id);
+  (*page)->SetLeafPtr(leaf);
+}
+
+// false if a zone switch staged the page meanwhile, see BTree::Insert
+static bool LatchLeafPage(std::optional<NodeRAII>* page, BTreeLeaf* leaf) {
+  (*page)->GetPage()->WLatch();
+  if (!(*page)->GetPage()->IsWritable(leaf->page_id)) {
+    (*page)->GetPage()->WUnlatch();
+    return false;
+  }
+  (*page)->SetDirty(true);
+  leaf->data = (*page)->GetNode();
+  return true;
 }
 
 BTreeLeaf* BTreeLeaf::split(Key& sep, void* bpm) {
   BTreeLeaf* newLeaf = new BTreeLeaf();
   page_id_t new_page_id;
-  NodeRAII new_page(bpm, &new_page_id);
+  // both halves keep the heat of the leaf
+  std::optional<NodeRAII> new_page;
+  NewLatchedPage(&new_page, bpm, &new_page_id, INVALID_PAGE_ID,
+                 Temperature(bpm));
+  newLeaf->heat = heat;
+  newLeaf->heat_epoch = heat_epoch;
 
-  new_page.SetDirty(true);
-  new_page.SetLeafPtr(reinterpret_cast<void*>(newLeaf));
+  new_page->SetDirty(true);
+  new_page->SetLeafPtr(reinterpret_cast<void*>(newLeaf));
 
   newLeaf->Init(count - (count / 2), new_page_id);
-  newLeaf->data = reinterpret_cast<KeyValueType*>(new_page.GetNode());
+  newLeaf->data = new_page->GetNode();
 
   count = count - newLeaf->count;
-  memcpy(newLeaf->data, data + count, sizeof(KeyValueType) * newLeaf->count);
-  sep = data[count - 1].first;
+  newLeaf->data.copy(0, data, count, newLeaf->count);
+  sep = data.key(count - 1);
+  // the page of this leaf keeps its wider range until the next write, the
+  // newer footer of the new leaf wins the upper half at restart
+  newLeaf->low_key = sep + 1;
+  newLeaf->high_key = high_key;
+  high_key = sep;
+  newLeaf->Stamp(bpm);
+  new_page->GetPage()->WUnlatch();
   return newLeaf;
 }
 
 BTreeLeaf* BTreeLeaf::splitFrom(Key& sep, void* bpm, page_id_t from) {
   BTreeLeaf* newLeaf = new BTreeLeaf();
   page_id_t new_page_id;
-  NodeRAII new_page(bpm, &new_page_id, from);
-  new_page.GetPage()->WLatch();
+  std::optional<NodeRAII> new_page;
+  NewLatchedPage(&new_page, bpm, &new_page_id, from, Temperature(bpm));
+  newLeaf->heat = heat;
+  newLeaf->heat_epoch = heat_epoch;
   ZoneManagerPool* zmp = (ZoneManagerPool*)bpm;
   assert(GET_ZONE_ID(from) != GET_ZONE_ID(new_page_id));
   // zmp->m_.lock();
 
-  new_page.SetDirty(true);
-  new_page.SetLeafPtr(reinterpret_cast<void*>(newLeaf));
+  new_page->SetDirty(true);
+  new_page->SetLeafPtr(reinterpret_cast<void*>(newLeaf));
   newLeaf->Init(count - (count / 2), new_page_id);
-  newLeaf->data = reinterpret_cast<KeyValueType*>(new_page.GetNode());
+  newLeaf->data = new_page->GetNode();
 
   count = count - newLeaf->count;
-  memcpy(newLeaf->data, data + count, sizeof(KeyValueType) * newLeaf->count);
-  sep = data[count - 1].first;
-  new_page.GetPage()->WUnlatch();
+  newLeaf->data.copy(0, data, count, newLeaf->count);
+  sep = data.key(count - 1);
+  newLeaf->low_key = sep + 1;
+  newLeaf->high_key = high_key;
+  high_key = sep;
+  newLeaf->Stamp(bpm);
+  new_page->GetPage()->WUnlatch();
   zmp->FlushIfFull(new_page_id);
   // zmp->m_.unlock();
   return newLeaf;
@@ -184,10 +286,10 @@ void BTreeLeaf::Print(void* bpm) {
   INFO_PRINT("[LeafNode page_id:%lu addr:%p count: %3u ", this->page_id, this,
              this->count);
   NodeRAII node(bpm, this->page_id);
-  this->data = reinterpret_cast<KeyValueType*>(node.GetNode());
+  this->data = node.GetNode();
   for (int i = 0; i < count; i++) {
-    INFO_PRINT(" %lu->%lu ", reinterpret_cast<u64>(this->data[i].first),
-               reinterpret_cast<u64>(this->data[i].second))
+    INFO_PRINT(" %lu->%lu ", reinterpret_cast<u64>(this->data.key(i)),
+               reinterpret_cast<u64>(this->data.value(i)))
   }
   INFO_PRINT("]\n");
 }
@@ -211,9 +313,9 @@ void BTreeLeaf::ToGraph(std::ofstream& out, void* bpm) {
   out << "<TR>";
 
   NodeRAII node(bpm, this->page_id);
-  this->data = reinterpret_cast<KeyValueType*>(node.GetNode());
+  this->data = node.GetNode();
   for (int i = 0; i < this->count; i++) {
-    out << "<TD>" << this->data[i].first << "</TD>\n";
+    out << "<TD>" << this->data.key(i) << "</TD>\n";
   }
   out << "</TR>";
   // Print table end
@@ -229,31 +331,9 @@ BTreeInner::BTreeInner() {
 // ensure correct when maxEntries is even: 3,5
 bool BTreeInner::isFull() { return count == (InnerNodeMaxEntries + 1); };
 
-unsigned BTreeInner::lowerBoundBF(Key k) {
-  auto base = keys;
-  unsigned n = count;
-  while (n > 1) {
-    const unsigned half = n / 2;
-    base = (base[half] < k) ? (base + half) : base;
-    n -= half;
-  }
-  return (*base < k) + base - keys;
-}
-
 unsigned BTreeInner::lowerBound(Key k) {
-  unsigned lower = 0;
-  unsigned upper = count;
-  do {
-    unsigned mid = ((upper - lower) / 2) + lower;
-    if (k < keys[mid]) {
-      upper = mid;
-    } else if (k > keys[mid]) {
-      lower = mid + 1;
-    } else {
-      return mid;
-    }
-  } while (lower < upper);
-  return lower;
+  // merges may leave a parent with one child, count is 0 then
+  return KeySearch::LowerBound(keys, count, k);
 }
 
 BTreeInner* BTreeInner::split(Key& sep) {
@@ -279,6 +359,14 @@ void BTreeInner::insert(Key k, NodeBase* child) {
   count++;
 }
 
+void BTreeInner::remove(unsigned pos) {
+  assert(pos < count);
+  memmove(keys + pos, keys + pos + 1, sizeof(Key) * (count - pos - 1));
+  memmove(children + pos + 1, children + pos + 2,
+          sizeof(NodeBase*) * (count - pos - 1));
+  count--;
+}
+
 void BTreeInner::Print(void* bpm) {
   INFO_PRINT("[Internal Page: %4p count: %3u ", this, this->count);
   for (int i = 0; i < this->count; i++) {
@@ -365,18 +453,43 @@ void BTreeInner::ToGraph(std::ofstream& out, void* bpm) {
   }
 };
 
-BTree::BTree(void* buffer) {
+BTree::BTree(void* buffer, bool recover) {
   bpm = buffer;
-  auto tem = new BTreeLeaf();
-  root.store(tem, std::memory_order_release);
-
-  page_id_t new_page_id;
-  NodeRAII new_page(bpm, &new_page_id);
-  new_page.SetDirty(true);
-  new_page.SetLeafPtr(reinterpret_cast<void*>(tem));
+#if defined(ZNS_BUFFER_POOL) && defined(ZONE_APPEND)
+  // a placed page gets its final id once nobody holds the leaf
+  ((ZoneManagerPool*)bpm)
+      ->SetPageIdFixup([](void* leaf_ptr, page_id_t from, page_id_t to) {
+        auto leaf = reinterpret_cast<BTreeLeaf*>(leaf_ptr);
+        bool needRestart = false;
+        leaf->writeLockOrRestart(needRestart);
+        if (needRestart) return false;
+        bool fixed = leaf->page_id == from;
+        if (fixed) leaf->page_id = to;
+        leaf->writeUnlock();
+        return fixed;
+      });
+#endif
+  if (!recover || !Recover()) {
+    auto tem = new BTreeLeaf();
+    root.store(tem, std::memory_order_release);
+
+    page_id_t new_page_id;
+    NodeRAII new_page(bpm, &new_page_id);
+    new_page.SetDirty(true);
+    new_page.SetLeafPtr(reinterpret_cast<void*>(tem));
+
+    auto leaf = reinterpret_cast<BTreeLeaf*>(root.load());
+    leaf->Init(0, new_page_id);
+    leaf->data = new_page.GetNode();
+    // claims the whole key space, the copies of an older tree lose
+    leaf->Stamp(bpm);
+  }
 
-  auto leaf = reinterpret_cast<BTreeLeaf*>(root.load());
-  leaf->Init(0, new_page_id);
+#if defined(ZNS_BUFFER_POOL) && defined(ZONE_GC)
+  ((ZoneManagerPool*)bpm)->StartCleaner([this](zns_id_t zid, u64* moved) {
+    return MigrateZone(zid, moved);
+  });
+#endif
 
   /*   INFO_PRINT(
       "Nodebase size = %lu leaf node size = %lu entries = %lu inner "
@@ -434,6 +547,13 @@ void BTree::DestroyNode() {
 }
 
 BTree::~BTree() {
+#if defined(ZNS_BUFFER_POOL) && defined(ZONE_GC)
+  ((ZoneManagerPool*)bpm)->StopCleaner();
+#endif
+#if defined(ZNS_BUFFER_POOL) && defined(ZONE_APPEND)
+  // the leaves are gone, pages still in flight keep their provisional ids
+  ((ZoneManagerPool*)bpm)->SetPageIdFixup(nullptr);
+#endif
   GetNodeNums();
   delete root.load();
   root.store(nullptr);
@@ -465,6 +585,8 @@ void BTree::yield(int count) {
 }
 
 bool BTree::Insert(Key k, Value v) {
+  // see Get
+  EpochGuard epoch;
   int restartCount = 0;
 restart:
   if (restartCount++) yield(restartCount);
@@ -550,7 +672,7 @@ restart:
     {
       NodeRAII leaf_page(bpm, leaf->page_id);
       leaf_page.SetDirty(true);
-      leaf->data = reinterpret_cast<KeyValueType*>(leaf_page.GetNode());
+      leaf->data = leaf_page.GetNode();
       newLeaf = leaf->split(sep, bpm);
     }
     if (parent)
@@ -572,10 +694,22 @@ restart:
         goto restart;
       }
     }
-    NodeRAII leaf_page(bpm, leaf->page_id, WRITE_FLAG);
+    page_id_t old_page_id = leaf->page_id;
+    NodeRAII leaf_page(bpm, leaf->page_id, WRITE_FLAG, leaf->Temperature(bpm));
+    leaf->RecordWrite(old_page_id);
+    leaf_page.SetLeafPtr(leaf);
+    leaf_page.GetPage()->WLatch();
+    if (!leaf_page.GetPage()->IsWritable(leaf->page_id)) {
+      // a zone switch staged it meanwhile, the next update copies it
+      leaf_page.GetPage()->WUnlatch();
+      node->writeUnlock();
+      goto restart;
+    }
     leaf_page.SetDirty(true);
-    leaf->data = reinterpret_cast<KeyValueType*>(leaf_page.GetNode());
+    leaf->data = leaf_page.GetNode();
     auto ret = leaf->insert(k, v);
+    leaf->Stamp(bpm);
+    leaf_page.GetPage()->WUnlatch();
     node->writeUnlock();
     return ret;
   }
@@ -584,9 +718,29 @@ restart:
 
 void BTree::BatchInsert(Key* keys, Value* values, int num) {
 #ifdef BATCH_INSERT
+  // see Get
+  EpochGuard epoch;
   int restartCount = 0;
   // KVHolder holder(keys, values, num);
   if (num == 0) return;
+  // a batch of the ZBTree carries its buffered deletes as tombstones. The
+  // runs of them are removed and the runs between them inserted, readers may
+  // look at the batch meanwhile so it stays as it is
+  if (std::find(values, values + num, TOMBSTONE_VALUE) != values + num) {
+    int begin = 0;
+    while (begin < num) {
+      bool dead = values[begin] == TOMBSTONE_VALUE;
+      int end = begin + 1;
+      while (end < num && (values[end] == TOMBSTONE_VALUE) == dead) end++;
+      if (dead) {
+        BatchRemove(keys + begin, end - begin);
+      } else {
+        BatchInsert(keys + begin, values + begin, end - begin);
+      }
+      begin = end;
+    }
+    return;
+  }
 
 restart:
   if (restartCount++) yield(restartCount);
@@ -679,7 +833,7 @@ restart:
     {
       ZoneManagerPool* zmp = (ZoneManagerPool*)bpm;
       NodeRAII leaf_page(bpm, leaf->page_id);
-      leaf->data = reinterpret_cast<KeyValueType*>(leaf_page.GetNode());
+      leaf->data = leaf_page.GetNode();
       newLeaf = leaf->splitFrom(sep, bpm, leaf->page_id);
     }
     if (parent)
@@ -702,19 +856,27 @@ restart:
       }
     }
     ZoneManagerPool* zmp = (ZoneManagerPool*)bpm;
-    NodeRAII leaf_page(bpm, leaf->page_id, WRITE_FLAG);
+    page_id_t old_page_id = leaf->page_id;
+    NodeRAII leaf_page(bpm, leaf->page_id, WRITE_FLAG, leaf->Temperature(bpm));
+    leaf->RecordWrite(old_page_id);
+    leaf_page.SetLeafPtr(leaf);
     leaf_page.GetPage()->WLatch();
+    if (!leaf_page.GetPage()->IsWritable(leaf->page_id)) {
+      // see Insert
+      leaf_page.GetPage()->WUnlatch();
+      node->writeUnlock();
+      goto restart;
+    }
     leaf_page.SetDirty(true);
-    leaf->data = reinterpret_cast<KeyValueType*>(leaf_page.GetNode());
+    leaf->data = leaf_page.GetNode();
     unsigned upper = 0;
     while (upper < num && keys[upper] <= max_key) {
       upper++;
     }
     auto insert_num = leaf->BatchInsert(keys, values, upper);
+    leaf->Stamp(bpm);
     leaf_page.GetPage()->WUnlatch();
 
-    assert(!leaf_page.GetPage()->IsFlushed());
-
     zmp->FlushIfFull(leaf->page_id);
     node->writeUnlock();
     num -= insert_num;
@@ -730,6 +892,8 @@ restart:
 }
 
 bool BTree::Get(Key k, Value& result) {
+  // a leaf merged away meanwhile is freed once the thread left the epoch
+  EpochGuard epoch;
   int restartCount = 0;
 restart:
   if (restartCount++) yield(restartCount);
@@ -767,18 +931,19 @@ restart:
     BTreeLeaf* leaf = static_cast<BTreeLeaf*>(node);
     // printf("%d\n", leaf->page_id);
     NodeRAII leaf_page(bpm, leaf->page_id);
-    leaf->data = reinterpret_cast<KeyValueType*>(leaf_page.GetNode());
-    // if(!(k >= leaf->data[0].first && k <= leaf->data[leaf->count - 1].first))
+    // a writer of the leaf may hold data
+    LeafEntries entries(leaf_page.GetNode());
+    // if(!(k >= entries[0].first && k <= entries[leaf->count - 1].first))
     // {
-    //   printf("k = %lu, first = %lu, last = %lu\n", k, leaf->data[0].first,
-    //   leaf->data[leaf->count - 1].first); printf("page_id = %lu\n",
+    //   printf("k = %lu, first = %lu, last = %lu\n", k, entries[0].first,
+    //   entries[leaf->count - 1].first); printf("page_id = %lu\n",
     //   leaf->page_id); printf("parent: %p\n", parent);
     // }
-    unsigned pos = leaf->lowerBound(k);
+    unsigned pos = leaf->lowerBound(entries, k);
 
-    if ((pos < leaf->count) && (leaf->data[pos].first == k)) {
+    if ((pos < leaf->count) && (entries.key(pos) == k)) {
       success = true;
-      result = leaf->data[pos].second;
+      result = entries.value(pos);
       // todo
       // debug
       // if (result != k) {
@@ -797,14 +962,23 @@ restart:
   return success;
 }
 
-uint64_t BTree::Scan(Key k, int range, Value* output) {
+uint64_t BTree::Scan(Key k, int range, Value* output, Key* keys) {
+  // see Get
+  EpochGuard epoch;
   int restartCount = 0;
-  int count = 0;
+  // the entries of the parents scanned before, a restart only drops the ones
+  // of the current parent
+  int done = 0;
+  int count;
   int p;
 restart:
-  bool right_most = true;
   if (restartCount++) yield(restartCount);
+  count = done;
   bool needRestart = false;
+  // the largest key under the parent, the scan goes on after it, and the one
+  // under node
+  Key upper = std::numeric_limits<Key>::max();
+  Key fence = upper;
 
   NodeBase* node = root;
   uint64_t versionNode = node->readLockOrRestart(needRestart);
@@ -813,6 +987,7 @@ restart:
   // Parent of current node
   BTreeInner* parent = nullptr;
   uint64_t versionParent;
+  p = 0;
 
   while (node->type == PageType::BTreeInner) {
     auto inner = static_cast<BTreeInner*>(node);
@@ -824,10 +999,11 @@ restart:
 
     parent = inner;
     versionParent = versionNode;
+    upper = fence;
 
     p = inner->lowerBound(k);
     if (p != inner->count) {
-      right_most = false;
+      fence = std::min(fence, inner->keys[p]);
     }
     node = inner->children[p];
     inner->checkOrRestart(versionNode, needRestart);
@@ -836,28 +1012,510 @@ restart:
     if (needRestart) goto restart;
   }
 
-  for (int i = p; i <= parent->count; ++i) {
-    node = parent->children[i];
-    BTreeLeaf* leaf = static_cast<BTreeLeaf*>(node);
-    NodeRAII leaf_page(bpm, leaf->page_id);
-    leaf->data = reinterpret_cast<KeyValueType*>(leaf_page.GetNode());
-    unsigned pos = leaf->lowerBound(k);
-    for (unsigned i = pos; i < leaf->count; i++) {
-      if (count == range) break;
-      output[count++] = leaf->data[i].second;
+  {
+    int last = parent ? parent->count : p;
+#ifdef ZNS_BUFFER_POOL
+    // read the leaves the range needs together, leaves are half full at least
+    int leaves = (range - count) / (LeafNodeMaxEntries / 2) + 2;
+    if (std::min(last, p + leaves - 1) > p) {
+      page_id_t page_ids[MAX_PREFETCH_PAGES];
+      u32 num = 0;
+      for (int i = p; i <= last && i < p + leaves && num < MAX_PREFETCH_PAGES;
+           ++i) {
+        page_ids[num++] = static_cast<BTreeLeaf*>(parent->children[i])->page_id;
+      }
+      ((ZoneManagerPool*)bpm)->PrefetchPages(page_ids, num);
+    }
+#endif
+    for (int i = p; i <= last && count < range; ++i) {
+      if (parent) {
+        node = parent->children[i];
+        parent->checkOrRestart(versionParent, needRestart);
+        if (needRestart) goto restart;
+      }
+      BTreeLeaf* leaf = static_cast<BTreeLeaf*>(node);
+      uint64_t versionLeaf = leaf->readLockOrRestart(needRestart);
+      if (needRestart) goto restart;
+      {
+        NodeRAII leaf_page(bpm, leaf->page_id);
+        // see Get
+        LeafEntries entries(leaf_page.GetNode());
+        unsigned pos = leaf->lowerBound(entries, k);
+        for (unsigned j = pos; j < leaf->count && count < range; j++) {
+          if (keys) keys[count] = entries.key(j);
+          output[count++] = entries.value(j);
+        }
+      }
+      // a writer changed the leaf while it was copied
+      leaf->readUnlockOrRestart(versionLeaf, needRestart);
+      if (needRestart) goto restart;
     }
-    if (count == range) break;
   }
-  node = parent->children[p];
 
   if (parent) {
     parent->readUnlockOrRestart(versionParent, needRestart);
     if (needRestart) goto restart;
   }
-  node->readUnlockOrRestart(versionNode, needRestart);
+  done = count;
+  if (count < range && upper != std::numeric_limits<Key>::max()) {
+    // go on under the next parent
+    k = upper + 1;
+    restartCount = 0;
+    goto restart;
+  }
+  return count;
+}
+
+bool BTree::Remove(Key k) {
+  // see Get, it also keeps the leaves this thread merged away alive
+  EpochGuard epoch;
+  uint64_t removed = 0;
+  RemoveFromLeaf(&k, 1, &removed);
+  return removed == 1;
+}
+
+uint64_t BTree::BatchRemove(Key* keys, int num) {
+  EpochGuard epoch;
+  uint64_t removed = 0;
+  while (num > 0) {
+    unsigned consumed = RemoveFromLeaf(keys, num, &removed);
+    keys += consumed;
+    num -= consumed;
+  }
+  return removed;
+}
+
+unsigned BTree::RemoveFromLeaf(Key* keys, unsigned num, uint64_t* removed) {
+  int restartCount = 0;
+restart:
+  if (restartCount++) yield(restartCount);
+  bool needRestart = false;
+
+  NodeBase* node = root.load();
+  uint64_t versionNode = node->readLockOrRestart(needRestart);
+  if (needRestart || (node != root)) goto restart;
+
+  // Parent of current node
+  BTreeInner* parent = nullptr;
+  uint64_t versionParent;
+  unsigned pos = 0;
+
+  while (node->type == PageType::BTreeInner) {
+    auto inner = static_cast<BTreeInner*>(node);
+
+    if (parent) {
+      parent->readUnlockOrRestart(versionParent, needRestart);
+      if (needRestart) goto restart;
+    }
+
+    parent = inner;
+    versionParent = versionNode;
+
+    pos = inner->lowerBound(keys[0]);
+    node = inner->children[pos];
+    inner->checkOrRestart(versionNode, needRestart);
+    if (needRestart) goto restart;
+    versionNode = node->readLockOrRestart(needRestart);
+    if (needRestart) goto restart;
+  }
+
+  auto leaf = static_cast<BTreeLeaf*>(node);
+  unsigned upper = 1;
+  while (upper < num && keys[upper] <= leaf->high_key) upper++;
+  // look the keys up first, a miss writes no page
+  unsigned hits = 0;
+  {
+    NodeRAII leaf_page(bpm, leaf->page_id);
+    LeafEntries entries(leaf_page.GetNode());
+    for (unsigned i = 0; i < upper; i++) {
+      if (i > 0 && keys[i] == keys[i - 1]) continue;
+      unsigned at = leaf->lowerBound(entries, keys[i]);
+      if (at < leaf->count && entries.key(at) == keys[i]) hits++;
+    }
+  }
+  node->checkOrRestart(versionNode, needRestart);
   if (needRestart) goto restart;
+  if (hits == 0) {
+    if (parent) {
+      parent->readUnlockOrRestart(versionParent, needRestart);
+      if (needRestart) goto restart;
+    }
+    return upper;
+  }
 
-  return count;
+  if (!parent || parent->count == 0 ||
+      leaf->count - hits >= LeafNodeMinEntries) {
+    // only lock leaf node
+    node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+    if (needRestart) goto restart;
+    if (parent) {
+      parent->readUnlockOrRestart(versionParent, needRestart);
+      if (needRestart) {
+        node->writeUnlock();
+        goto restart;
+      }
+    }
+    std::optional<NodeRAII> leaf_page;
+    TakeLeafPage(&leaf_page, leaf, bpm);
+    if (!LatchLeafPage(&leaf_page, leaf)) {
+      node->writeUnlock();
+      goto restart;
+    }
+    *removed += leaf->remove(keys, upper);
+    leaf->Stamp(bpm);
+    leaf_page->GetPage()->WUnlatch();
+    node->writeUnlock();
+    return upper;
+  }
+
+  // Underflow, lock the leaf and a sibling and take their pages. The parent
+  // is locked last, a writer waiting for a free zone must not keep the
+  // cleaner off the whole subtree
+  node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+  if (needRestart) goto restart;
+  {
+    unsigned sib = pos < parent->count ? pos + 1 : pos - 1;
+    auto sibling = static_cast<BTreeLeaf*>(parent->children[sib]);
+    parent->checkOrRestart(versionParent, needRestart);
+    if (needRestart) {
+      node->writeUnlock();
+      goto restart;
+    }
+    sibling->writeLockOrRestart(needRestart);
+    if (needRestart) {
+      node->writeUnlock();
+      goto restart;
+    }
+    // the leaf takes the entries of the sibling, whose page is only read.
+    // Otherwise both are rebalanced and written
+    bool merge = leaf->count - hits + sibling->count <= LeafNodeMergeEntries;
+    std::optional<NodeRAII> leaf_page;
+    std::optional<NodeRAII> sibling_page;
+    if (merge) {
+      sibling_page.emplace(bpm, sibling->page_id);
+      sibling->data = sibling_page->GetNode();
+    } else {
+      TakeLeafPage(&sibling_page, sibling, bpm);
+    }
+    TakeLeafPage(&leaf_page, leaf, bpm);
+    parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
+    if (needRestart) {
+      sibling->writeUnlock();
+      node->writeUnlock();
+      goto restart;
+    }
+    bool latched = LatchLeafPage(&leaf_page, leaf);
+    if (latched && !merge && !LatchLeafPage(&sibling_page, sibling)) {
+      leaf_page->GetPage()->WUnlatch();
+      latched = false;
+    }
+    if (!latched) {
+      parent->writeUnlock();
+      sibling->writeUnlock();
+      node->writeUnlock();
+      goto restart;
+    }
+    *removed += leaf->remove(keys, upper);
+    if (merge) {
+      // the newer footer of the leaf wins both ranges at restart
+      leaf->merge(sibling);
+      leaf->Stamp(bpm);
+      leaf_page->GetPage()->WUnlatch();
+      if (sib < pos) parent->children[sib] = leaf;
+      parent->remove(std::min(pos, sib));
+      sibling->writeUnlockObsolete();
+      node->writeUnlock();
+      parent->writeUnlock();
+      sibling_page.reset();
+      ((ZoneManagerPool*)bpm)->DeletePage(sibling->page_id);
+      Epoch::Retire(sibling, [](void* retired) {
+        delete static_cast<BTreeLeaf*>(retired);
+      });
+      return upper;
+    }
+    BTreeLeaf* left = sib < pos ? sibling : leaf;
+    BTreeLeaf* right = sib < pos ? leaf : sibling;
+    parent->keys[std::min(pos, sib)] = left->rebalance(right);
+    left->Stamp(bpm);
+    right->Stamp(bpm);
+    sibling_page->GetPage()->WUnlatch();
+    leaf_page->GetPage()->WUnlatch();
+    sibling->writeUnlock();
+    node->writeUnlock();
+    parent->writeUnlock();
+  }
+  return upper;
+}
+
+/**
+ * Visit the leaves in key order. Every step descends from the root to the
+ * leaf holding cursor, and moves on to the upper fence key of that leaf, so
+ * concurrent splits never hide a leaf from the cleaner.
+ */
+bool BTree::MigrateZone(zns_id_t zone_id, u64* moved) {
+  ZoneManagerPool* zmp = (ZoneManagerPool*)bpm;
+  bool complete = true;
+  Key cursor = std::numeric_limits<Key>::min();
+  int restartCount = 0;
+  // see Get
+  EpochGuard epoch;
+next:
+  // the epoch moves on between the leaves
+  Epoch::Leave();
+  Epoch::Enter();
+  restartCount = 0;
+restart:
+  if (restartCount++) yield(restartCount);
+  bool needRestart = false;
+  // the visited subtree holds the keys <= fence
+  Key fence = std::numeric_limits<Key>::max();
+  bool rightmost = true;
+
+  NodeBase* node = root.load();
+  uint64_t versionNode = node->readLockOrRestart(needRestart);
+  if (needRestart || (node != root)) {
+    if (restartCount > GC_MAX_RESTARTS) return false;
+    goto restart;
+  }
+
+  BTreeInner* parent = nullptr;
+  uint64_t versionParent;
+
+  while (node->type == PageType::BTreeInner) {
+    auto inner = static_cast<BTreeInner*>(node);
+
+    if (parent) {
+      parent->readUnlockOrRestart(versionParent, needRestart);
+      if (needRestart) goto restart;
+    }
+
+    parent = inner;
+    versionParent = versionNode;
+
+    unsigned pos = inner->lowerBound(cursor);
+    if (pos < inner->count) {
+      fence = inner->keys[pos];
+      rightmost = false;
+    }
+    node = inner->children[pos];
+    inner->checkOrRestart(versionNode, needRestart);
+    if (needRestart) goto restart;
+    versionNode = node->readLockOrRestart(needRestart);
+    if (needRestart) {
+      // the writer holding the child may wait for a free zone, skip it.
+      // a locked leaf outside the zone only gets a new page in another zone
+      if (restartCount > GC_MAX_RESTARTS && !node->isObsolete(versionNode)) {
+        inner->checkOrRestart(versionParent, needRestart);
+        if (!needRestart) {
+          if (node->type != PageType::BTreeLeaf ||
+              GET_ZONE_ID(zmp->ResolvePageId(
+                  static_cast<BTreeLeaf*>(node)->page_id)) == zone_id) {
+            complete = false;
+          }
+          goto advance;
+        }
+      }
+      goto restart;
+    }
+  }
+
+  {
+    auto leaf = static_cast<BTreeLeaf*>(node);
+    if (GET_ZONE_ID(zmp->ResolvePageId(leaf->page_id)) == zone_id) {
+      node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+      if (needRestart) goto restart;
+      if (parent) {
+        parent->readUnlockOrRestart(versionParent, needRestart);
+        if (needRestart) {
+          node->writeUnlock();
+          goto restart;
+        }
+      }
+      page_id_t page_id = leaf->page_id;
+      bool relocated = zmp->RelocatePage(&page_id, leaf);
+      if (relocated) {
+        leaf->page_id = page_id;
+        (*moved)++;
+      }
+      node->writeUnlock();
+      // no zone left to write to
+      if (!relocated) return false;
+    } else {
+      node->readUnlockOrRestart(versionNode, needRestart);
+      if (needRestart) goto restart;
+      if (parent) {
+        parent->readUnlockOrRestart(versionParent, needRestart);
+        if (needRestart) goto restart;
+      }
+    }
+  }
+
+advance:
+  if (rightmost || fence == std::numeric_limits<Key>::max()) {
+    return complete;
+  }
+  cursor = fence + 1;
+  goto next;
+}
+
+bool BTree::Recover() {
+#ifdef ZNS_BUFFER_POOL
+  ZoneManagerPool* zmp = (ZoneManagerPool*)bpm;
+  auto start = std::chrono::steady_clock::now();
+  struct Copy {
+    page_id_t page_id;
+    LeafFooter footer;
+  };
+  // 1. the footers of all pages, every worker fills its own vectors
+  std::vector<std::vector<Copy>> scanned(RECOVERY_SCAN_THREADS);
+  std::vector<std::vector<page_id_t>> garbage(RECOVERY_SCAN_THREADS);
+  zmp->ScanPages(RECOVERY_SCAN_THREADS,
+                 [&](u32 worker, page_id_t page_id, const char* data) {
+                   auto footer = LeafFooter::Of(const_cast<char*>(data));
+                   if (footer->IsValid()) {
+                     scanned[worker].push_back({page_id, *footer});
+                   } else {
+                     garbage[worker].push_back(page_id);
+                   }
+                 });
+  std::vector<Copy> copies;
+  for (auto& c : scanned) {
+    copies.insert(copies.end(), c.begin(), c.end());
+  }
+  for (auto& g : garbage) {
+    for (auto page_id : g) zmp->InvalidatePage(page_id);
+  }
+  if (copies.empty()) return false;
+
+  // 2. newest first, a copy keeps the parts of its range no newer one took.
+  // a leaf that split keeps its old range on the device until its next write
+  std::sort(copies.begin(), copies.end(), [](const Copy& a, const Copy& b) {
+    return a.footer.seq > b.footer.seq;
+  });
+  zmp->AdvancePageSeq(copies[0].footer.seq + 1);
+  struct Piece {
+    Key low;
+    Key high;
+    size_t copy;
+  };
+  std::vector<Piece> pieces;
+  std::map<Key, Key> taken;
+  for (size_t i = 0; i < copies.size(); i++) {
+    Key low = copies[i].footer.low_key;
+    Key high = copies[i].footer.high_key;
+    size_t first = pieces.size();
+    auto it = taken.upper_bound(low);
+    if (it != taken.begin() && std::prev(it)->second >= low) --it;
+    Key cur = low;
+    while (true) {
+      if (it == taken.end() || it->first > high) {
+        pieces.push_back({cur, high, i});
+        break;
+      }
+      if (it->first > cur) pieces.push_back({cur, it->first - 1, i});
+      if (it->second >= high) break;
+      cur = std::max(cur, it->second + 1);
+      ++it;
+    }
+    for (size_t p = first; p < pieces.size(); p++) {
+      taken[pieces[p].low] = pieces[p].high;
+    }
+  }
+
+  // 3. a leaf per piece, a piece starting at the first entry of its page
+  // keeps the page, the others are copied to a new one
+  std::sort(pieces.begin(), pieces.end(),
+            [](const Piece& a, const Piece& b) { return a.low < b.low; });
+  std::vector<bool> kept(copies.size(), false);
+  std::vector<BTreeLeaf*> leaves;
+  u64 copied = 0;
+  for (auto& piece : pieces) {
+    Copy& copy = copies[piece.copy];
+    unsigned end = copy.footer.count;
+    // only a cut page is read again
+    if (piece.low == copy.footer.low_key &&
+        piece.high == copy.footer.high_key) {
+      if (end == 0) continue;
+      auto leaf = new BTreeLeaf();
+      leaf->Init(end, copy.page_id);
+      leaf->low_key = piece.low;
+      leaf->high_key = piece.high;
+      kept[piece.copy] = true;
+      leaves.push_back(leaf);
+      continue;
+    }
+    page_id_t page_id = copy.page_id;
+    NodeRAII page(bpm, page_id);
+    LeafEntries entries(page.GetNode());
+    unsigned begin = 0;
+    while (begin < end && entries.key(begin) < piece.low) begin++;
+    end = begin;
+    while (end < copy.footer.count && entries.key(end) <= piece.high) end++;
+    if (begin == end) continue;
+
+    auto leaf = new BTreeLeaf();
+    leaf->low_key = piece.low;
+    leaf->high_key = piece.high;
+    if (begin == 0 && !kept[piece.copy]) {
+      kept[piece.copy] = true;
+      leaf->Init(end, copy.page_id);
+    } else {
+      page_id_t new_page_id;
+      NodeRAII new_page(bpm, &new_page_id);
+      new_page.SetDirty(true);
+      new_page.SetLeafPtr(reinterpret_cast<void*>(leaf));
+      leaf->Init(end - begin, new_page_id);
+      leaf->data = new_page.GetNode();
+      leaf->data.copy(0, entries, begin, leaf->count);
+      leaf->Stamp(bpm);
+      copied++;
+    }
+    leaves.push_back(leaf);
+  }
+  for (size_t i = 0; i < copies.size(); i++) {
+    if (!kept[i]) zmp->InvalidatePage(copies[i].page_id);
+  }
+  if (leaves.empty()) return false;
+
+  // the key ranges nobody holds go to the leaf on their left
+  std::vector<std::pair<NodeBase*, Key>> level;
+  leaves.front()->low_key = std::numeric_limits<Key>::min();
+  for (size_t i = 0; i < leaves.size(); i++) {
+    leaves[i]->high_key = i + 1 < leaves.size()
+                              ? leaves[i + 1]->low_key - 1
+                              : std::numeric_limits<Key>::max();
+    level.push_back({leaves[i], leaves[i]->high_key});
+  }
+
+  // 4. the inner nodes bottom up, a quarter of each is left for inserts
+  const size_t fanout = (InnerNodeMaxEntries + 1) * 3 / 4;
+  while (level.size() > 1) {
+    size_t groups = (level.size() + fanout - 1) / fanout;
+    std::vector<std::pair<NodeBase*, Key>> upper;
+    for (size_t g = 0, begin = 0; g < groups; g++) {
+      size_t end = level.size() * (g + 1) / groups;
+      auto inner = new BTreeInner();
+      inner->count = end - begin - 1;
+      for (size_t c = begin; c < end; c++) {
+        inner->children[c - begin] = level[c].first;
+        if (c + 1 < end) inner->keys[c - begin] = level[c].second;
+      }
+      upper.push_back({inner, level[end - 1].second});
+      begin = end;
+    }
+    level.swap(upper);
+  }
+  root.store(level[0].first, std::memory_order_release);
+
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  INFO_PRINT("[Recover] pages:%8lu leaves:%8lu copied:%6lu in %.1f ms\n",
+             copies.size(), leaves.size(), copied, ms);
+  return true;
+#else
+  return false;
+#endif
 }
 
 void BTree::Print() const {
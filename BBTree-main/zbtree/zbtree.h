@@ -12,6 +12,7 @@
 
 #include "buffer.h"
 #include "config.h"
+#include "key_search.h"
 #include "page.h"
 
 namespace btreeolc {
@@ -34,6 +35,12 @@ static const uint64_t LeafNodeMaxEntries =
     (LeafNodeSize - BaseNodeSize - sizeof(uint64_t) - sizeof(void *)) /
     (sizeof(KeyValueType));
 
+// a leaf below it after a delete is merged with or refilled from a sibling
+static const uint64_t LeafNodeMinEntries = LeafNodeMaxEntries / 4;
+// two leaves are merged if they fit into it, so the merged leaf does not
+// split again with the next few inserts
+static const uint64_t LeafNodeMergeEntries = LeafNodeMaxEntries * 3 / 4;
+
 static const uint64_t InnerNodeMaxEntries =
     (InnerNodeSize - BaseNodeSize) / (sizeof(Key) + sizeof(void *)) - 2;
 
@@ -96,18 +103,125 @@ struct BTreeLeafBase : public NodeBase {
   static const PageType typeMarker = PageType::BTreeLeaf;
 };
 
+/**
+ * the tail of a leaf page, it makes the zones self-describing. The copy with
+ * the highest seq wins a key range at restart, see BTree::Recover.
+ */
+struct LeafFooter {
+  uint64_t magic;
+  uint64_t seq;
+  // the leaf holds the keys in [low_key, high_key]
+  Key low_key;
+  Key high_key;
+  uint16_t count;
+
+  static LeafFooter *Of(void *page_data) {
+    return reinterpret_cast<LeafFooter *>(reinterpret_cast<char *>(page_data) +
+                                          LeafNodeSize - sizeof(LeafFooter));
+  }
+  bool IsValid() const;
+};
+#ifdef LEAF_SOA
+const uint64_t LEAF_FOOTER_MAGIC = 0x4242545245454c53;  // "BBTREELS"
+#else
+const uint64_t LEAF_FOOTER_MAGIC = 0x4242545245454c46;  // "BBTREELF"
+#endif
+static_assert(LeafNodeMaxEntries * sizeof(KeyValueType) + sizeof(LeafFooter) <=
+                  LeafNodeSize,
+              "the leaf footer overlaps the entries");
+
+/**
+ * the entries of a leaf page. With LEAF_SOA the keys of all
+ * LeafNodeMaxEntries slots come first and the values follow, otherwise the
+ * page is an array of key value pairs.
+ */
+struct LeafEntries {
+  char *page;
+
+  LeafEntries(void *page_data = nullptr)
+      : page(reinterpret_cast<char *>(page_data)) {}
+
+#ifdef LEAF_SOA
+  Key *keys() const { return reinterpret_cast<Key *>(page); }
+  Value *values() const {
+    return reinterpret_cast<Value *>(page + LeafNodeMaxEntries * sizeof(Key));
+  }
+  Key &key(unsigned i) const { return keys()[i]; }
+  Value &value(unsigned i) const { return values()[i]; }
+#else
+  KeyValueType *pairs() const {
+    return reinterpret_cast<KeyValueType *>(page);
+  }
+  Key &key(unsigned i) const { return pairs()[i].first; }
+  Value &value(unsigned i) const { return pairs()[i].second; }
+#endif
+
+  void set(unsigned i, Key k, Value v) const {
+    key(i) = k;
+    value(i) = v;
+  }
+
+  /* n entries of src from entry from on to entry to, src may be this page
+   * and the two ranges may overlap */
+  void copy(unsigned to, const LeafEntries &src, unsigned from,
+            unsigned n) const {
+#ifdef LEAF_SOA
+    memmove(keys() + to, src.keys() + from, sizeof(Key) * n);
+    memmove(values() + to, src.values() + from, sizeof(Value) * n);
+#else
+    memmove(pairs() + to, src.pairs() + from, sizeof(KeyValueType) * n);
+#endif
+  }
+
+  /* the first of the leading n entries whose key is not less than k */
+  unsigned lowerBound(unsigned n, Key k) const {
+#ifdef LEAF_SOA
+    if constexpr (sizeof(Key) == sizeof(u64)) {
+      return KeySearch::LowerBound(reinterpret_cast<const u64 *>(keys()), n,
+                                   k);
+    }
+#else
+    if constexpr (sizeof(KeyValueType) == 2 * sizeof(u64)) {
+      return KeySearch::LowerBoundPairs(reinterpret_cast<const u64 *>(pairs()),
+                                        n, k);
+    }
+#endif
+    // larger values, see MULT_VALUE_SIZE
+    unsigned lower = 0;
+    unsigned upper = n;
+    while (lower < upper) {
+      unsigned mid = ((upper - lower) / 2) + lower;
+      if (key(mid) < k) {
+        lower = mid + 1;
+      } else {
+        upper = mid;
+      }
+    }
+    return lower;
+  }
+};
+
 // template <class Key, class Payload>
 
 struct BTreeLeaf : public BTreeLeafBase {
   page_id_t page_id;
-  // This is the array that we perform search on
-  KeyValueType *data = nullptr;
+  // This is the page that we perform search on
+  LeafEntries data;
+  // decayed number of page copies and the heat epoch it was taken at
+  uint32_t heat = 0;
+  uint32_t heat_epoch = 0;
+  // fences of the leaf, narrowed by splits
+  Key low_key = std::numeric_limits<Key>::min();
+  Key high_key = std::numeric_limits<Key>::max();
 
   BTreeLeaf();
 
   bool isFull();
 
   unsigned lowerBound(Key k);
+  /* in the entries of a page the caller fetched. Readers hold no lock, they
+   * must not set data under a writer */
+  unsigned lowerBound(const LeafEntries &entries, Key k);
 
   /**
    * @brief
@@ -121,8 +235,25 @@ struct BTreeLeaf : public BTreeLeafBase {
 
   int BatchInsert(Key *keys, Value *values, int num);
 
+  /* remove the sorted keys found in the leaf, @return how many */
+  int remove(const Key *keys, int num);
+  /* take all entries and the outer fence of a neighbour on either side */
+  void merge(BTreeLeaf *sibling);
+  /* even out the entries with the right neighbour, @return the new
+   * separator */
+  Key rebalance(BTreeLeaf *right);
+
   void Init(uint16_t num = 0, page_id_t id = 0);
 
+  /* the temperature class the page of this leaf is placed by,
+   * write lock held */
+  u32 Temperature(void *bpm);
+  /* heat the leaf if the write copied its page, rewrites absorbed by the
+   * FIFO leave no garbage behind */
+  void RecordWrite(page_id_t old_page_id);
+  /* write the footer of the page, after every change of the entries */
+  void Stamp(void *bpm);
+
   BTreeLeaf *split(Key &sep, void *bpm);
   BTreeLeaf *splitFrom(Key &sep, void *bpm, page_id_t from);
 
@@ -162,14 +293,16 @@ struct alignas(CacheLineSize) BTreeInner : public BTreeInnerBase {
   // ensure correct when maxEntries is even: 3,5
   bool isFull();
 
-  unsigned lowerBoundBF(Key k);
-
   unsigned lowerBound(Key k);
 
   BTreeInner *split(Key &sep);
 
   void insert(Key k, NodeBase *child);
 
+  /* drop the key at pos and the child right of it, after the child was
+   * merged into its left neighbour */
+  void remove(unsigned pos);
+
   void Print(void *bpm);
 
   void ToGraph(std::ofstream &out, ParallelBufferPoolManager *bpm);
@@ -187,7 +320,8 @@ struct alignas(CacheLineSize) BTree {
   std::atomic<NodeBase *> root;
   void *bpm;
 
-  BTree(void *buffer);
+  /* recover rebuilds the tree from the leaves on the device, if any */
+  BTree(void *buffer, bool recover = false);
 
   virtual ~BTree();
 
@@ -197,13 +331,45 @@ struct alignas(CacheLineSize) BTree {
 
   void yield(int count);
 
+  /* remove the leading keys that fall into one leaf, @return how many keys
+   * were consumed, removed counts the ones found */
+  unsigned RemoveFromLeaf(Key *keys, unsigned num, uint64_t *removed);
+
   bool Insert(Key k, Value v);
 
+  /* insert the sorted keys, a TOMBSTONE_VALUE removes its key instead */
   void BatchInsert(Key *keys, Value *values, int num);
 
   bool Get(Key k, Value &result);
 
-  uint64_t Scan(Key k, int range, Value *output);
+  /* keys, if given, receives the key of every output value */
+  uint64_t Scan(Key k, int range, Value *output, Key *keys = nullptr);
+
+  /**
+   * @brief remove k. A leaf below LeafNodeMinEntries is merged with or
+   * refilled from a sibling under the same parent, the page of a merged leaf
+   * is released. Inner nodes are not merged.
+   * @return false if k is not in the tree
+   */
+  bool Remove(Key k);
+
+  /* remove the sorted keys, every leaf is written once. @return how many
+   * were in the tree */
+  uint64_t BatchRemove(Key *keys, int num);
+
+  /**
+   * @brief move every leaf stored in zone_id to other zones, called by the
+   * zone cleaner. Leaves held by a writer are skipped.
+   * @return false if some leaves are still in the zone
+   */
+  bool MigrateZone(zns_id_t zone_id, u64 *moved);
+
+  /**
+   * @brief rebuild the inner nodes from a scan of the zones. The newest copy
+   * of every key range is kept, the other pages are invalidated.
+   * @return false if the device holds no leaf
+   */
+  bool Recover();
 
   void DestroyNode();
 
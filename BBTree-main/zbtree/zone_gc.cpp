@@ -0,0 +1,150 @@
+#include "zone_gc.h"
+
+#include "buffer.h"
+
+ZoneCleaner::ZoneCleaner(ZoneManagerPool *zmp, MigrateFunc migrate,
+                         GCPolicy policy)
+    : zmp_(zmp),
+      migrate_(std::move(migrate)),
+      policy_(policy) {
+  worker_ = std::thread(&ZoneCleaner::Run, this);
+}
+
+ZoneCleaner::~ZoneCleaner() { Stop(); }
+
+void ZoneCleaner::Wake() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  wake_ = true;
+  cv_.notify_one();
+}
+
+void ZoneCleaner::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+    cv_.notify_one();
+  }
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+}
+
+bool ZoneCleaner::NeedCollect(ZonedBlockDevice *zbd) {
+  return zbd->GetFreeZones() <= GC_START_FREE_ZONES;
+}
+
+bool ZoneCleaner::NeedCollect() {
+  for (auto zns : zmp_->devices_) {
+    if (NeedCollect(zns->zbd_)) return true;
+  }
+  return false;
+}
+
+void ZoneCleaner::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    cv_.wait_for(lock, std::chrono::milliseconds(GC_INTERVAL_MS),
+                 [this] { return wake_ || stop_; });
+    wake_ = false;
+    lock.unlock();
+    {
+      std::lock_guard<std::mutex> guard(collect_mutex_);
+      retry_later_.clear();
+    }
+    while (!stop_ && NeedCollect()) {
+      if (!CollectOnce()) break;
+    }
+    lock.lock();
+  }
+}
+
+/**
+ * greedy: the zone with the least valid bytes.
+ * cost-benefit: (1 - u) * age / (1 + u) as in LFS, the age is the number of
+ * zones finished since the zone itself got full.
+ */
+Zone *ZoneCleaner::PickVictim() {
+  Zone *victim = nullptr;
+  double best = 0;
+  // only the devices short of zones, a zone buffer stays on its device
+  for (auto zns : zmp_->devices_) {
+    auto zbd = zns->zbd_;
+    if (!NeedCollect(zbd)) continue;
+    u64 now = zbd->GetFinishSeq();
+    for (const auto z : zbd->GetIOZones()) {
+      if (!z->IsFull() || z->IsBusy()) continue;
+      if (retry_later_.count(GetZoneId(z))) continue;
+      u64 valid = z->GetValidPages();
+      u64 max_pages = z->GetMaxCapacity() / PAGE_SIZE;
+      // nothing to win
+      if (max_pages == 0 || valid >= max_pages) continue;
+      double u = valid * 1.0 / max_pages;
+      double score = 1.0 - u;
+      if (policy_ == GCPolicy::kCostBenefit) {
+        score = score * (now - z->finish_seq_ + 1) / (1.0 + u);
+      }
+      if (score > best) {
+        best = score;
+        victim = z;
+      }
+    }
+  }
+  if (victim == nullptr || !victim->Acquire()) {
+    return nullptr;
+  }
+  // raced with a writer which reset or reused the zone
+  if (!victim->IsFull()) {
+    victim->Release();
+    return nullptr;
+  }
+  return victim;
+}
+
+bool ZoneCleaner::CollectOnce() {
+  std::lock_guard<std::mutex> guard(collect_mutex_);
+  Zone *victim = PickVictim();
+  if (victim == nullptr) {
+    return false;
+  }
+
+  u64 moved = 0;
+  bool done = migrate_(GetZoneId(victim), &moved);
+  migrated_pages_ += moved;
+  victim->GetDevice()->AddGCBytesWritten(moved * PAGE_SIZE);
+
+  if (done) {
+    // what is left in the zone are stale copies
+    victim->ClearValid();
+    zmp_->EvictZonePages(victim);
+    IOStatus s = victim->Reset();
+    if (s != OK()) {
+      DEBUG_PRINT("reset zone %lu failed\n", victim->GetZoneNr());
+      done = false;
+    }
+  }
+  if (done) {
+    collected_zones_++;
+    retry_later_.clear();
+  } else {
+    failed_zones_++;
+    retry_later_.insert(GetZoneId(victim));
+  }
+  victim->Release();
+  return true;
+}
+
+void ZoneCleaner::Print() {
+  u32 free_zones = 0;
+  u64 reclaimable = 0;
+  for (auto zns : zmp_->devices_) {
+    free_zones += zns->zbd_->GetFreeZones();
+    reclaimable += zns->zbd_->GetReclaimableSpace();
+  }
+  INFO_PRINT("[ZoneCleaner] policy:%s collected zones:%4lu failed:%4lu "
+             "migrated pages:%8lu gc written:%s free zones:%3u "
+             "reclaimable:%s\n",
+             policy_ == GCPolicy::kGreedy ? "greedy" : "cost-benefit",
+             collected_zones_, failed_zones_, migrated_pages_,
+             CalSize(migrated_pages_ * PAGE_SIZE).c_str(),
+             free_zones, CalSize(reclaimable).c_str());
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>  // NOLINT
+#include <functional>
+#include <mutex>   // NOLINT
+#include <thread>  // NOLINT
+#include <unordered_set>
+
+#include "../zns/zone_device.h"
+#include "config.h"
+
+class ZoneManagerPool;
+
+enum class GCPolicy : uint8_t { kGreedy = 0, kCostBenefit };
+
+/**
+ * ZoneCleaner reclaims the zones filled with stale copy-on-write leaves.
+ * Once free zones of a device drop to GC_START_FREE_ZONES it picks a full
+ * zone of that device, asks the index to move the leaves still stored there
+ * and resets the zone.
+ */
+class ZoneCleaner {
+ public:
+  /**
+   * moves every leaf stored in zone zid, adds the moved pages to *moved
+   * @return false if some leaves are still in the zone
+   */
+  using MigrateFunc = std::function<bool(zns_id_t zid, u64 *moved)>;
+
+  ZoneCleaner(ZoneManagerPool *zmp, MigrateFunc migrate,
+              GCPolicy policy = GCPolicy::kGreedy);
+  ~ZoneCleaner();
+  DISALLOW_COPY_AND_MOVE(ZoneCleaner);
+
+  void Wake();
+  void Stop();
+  bool IsRunning() { return !stop_.load(); }
+
+  bool NeedCollect();
+  /* try to collect one victim zone, return false if there is none */
+  bool CollectOnce();
+
+  void Print();
+  u64 GetCollectedZones() { return collected_zones_; }
+  u64 GetMigratedPages() { return migrated_pages_; }
+
+ private:
+  void Run();
+  /* @return the acquired victim zone or nullptr */
+  Zone *PickVictim();
+
+  /* the device is short of free zones */
+  bool NeedCollect(ZonedBlockDevice *zbd);
+
+  ZoneManagerPool *zmp_;
+  MigrateFunc migrate_;
+  GCPolicy policy_;
+
+  std::thread worker_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool wake_ = false;
+  std::atomic_bool stop_{false};
+  // only one collection at a time
+  std::mutex collect_mutex_;
+  // victims with leaves held by writers, retried in the next round
+  std::unordered_set<zns_id_t> retry_later_;
+
+  // Helper variables
+  u64 collected_zones_ = 0;
+  u64 failed_zones_ = 0;
+  u64 migrated_pages_ = 0;
+};
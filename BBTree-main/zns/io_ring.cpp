@@ -0,0 +1,210 @@
+#include "io_ring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+                          unsigned int min_complete, unsigned int flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      nullptr, 0);
+}
+
+int IOHandle::Wait() {
+  if (!IsDone() && ring_ != nullptr) ring_->Wait(this);
+  return res_;
+}
+
+IORing::~IORing() {
+  if (ring_fd_ < 0) return;
+  while (inflight_.load() > 0) {
+    if (Reap(nullptr) < 0) break;
+  }
+  if (sqes_ != nullptr) munmap(sqes_, sqes_size_);
+  if (cq_ptr_ != nullptr && cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_size_);
+  if (sq_ptr_ != nullptr) munmap(sq_ptr_, sq_size_);
+  close(ring_fd_);
+  ring_fd_ = -1;
+}
+
+bool IORing::Init(unsigned int depth) {
+  if (depth == 0 || ring_fd_ >= 0) return ring_fd_ >= 0;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = io_uring_setup(depth, &p);
+  if (fd < 0) return false;
+
+  sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    if (cq_size_ > sq_size_) sq_size_ = cq_size_;
+    cq_size_ = sq_size_;
+  }
+
+  sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED) {
+    sq_ptr_ = nullptr;
+    close(fd);
+    return false;
+  }
+  if (single_mmap) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED) {
+      cq_ptr_ = nullptr;
+      munmap(sq_ptr_, sq_size_);
+      sq_ptr_ = nullptr;
+      close(fd);
+      return false;
+    }
+  }
+  sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    if (cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_size_);
+    munmap(sq_ptr_, sq_size_);
+    sq_ptr_ = cq_ptr_ = nullptr;
+    close(fd);
+    return false;
+  }
+  sqes_ = (struct io_uring_sqe *)sqes;
+
+  char *sq = (char *)sq_ptr_;
+  char *cq = (char *)cq_ptr_;
+  sq_tail_ = (unsigned int *)(sq + p.sq_off.tail);
+  sq_mask_ = (unsigned int *)(sq + p.sq_off.ring_mask);
+  sq_array_ = (unsigned int *)(sq + p.sq_off.array);
+  cq_head_ = (unsigned int *)(cq + p.cq_off.head);
+  cq_tail_ = (unsigned int *)(cq + p.cq_off.tail);
+  cq_mask_ = (unsigned int *)(cq + p.cq_off.ring_mask);
+  cqes_ = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  depth_ = p.sq_entries;
+  ring_fd_ = fd;
+  return true;
+}
+
+void IORing::Drain() {
+  unsigned int reaped = 0;
+  unsigned int head = *cq_head_;
+  unsigned int tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+    IOHandle *handle = (IOHandle *)cqe->user_data;
+    if (handle != nullptr) handle->Complete(cqe->res);
+    head++;
+    reaped++;
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  inflight_ -= reaped;
+}
+
+int IORing::Reap(IOHandle *handle) {
+  std::unique_lock<std::mutex> lock(cq_mutex_);
+  if (reaping_) {
+    /* another thread is in the kernel, it wakes us up when it reaped */
+    uint64_t round = reap_round_;
+    reaped_cv_.wait(lock, [&] {
+      return reap_round_ != round || (handle != nullptr && handle->IsDone());
+    });
+    return 0;
+  }
+  reaping_ = true;
+  lock.unlock();
+  int ret = 0;
+  if (inflight_.load() > 0) {
+    ret = io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS);
+    ret = ret < 0 && errno != EINTR ? -errno : 0;
+  }
+  lock.lock();
+  Drain();
+  reaping_ = false;
+  reap_round_++;
+  lock.unlock();
+  reaped_cv_.notify_all();
+  return ret;
+}
+
+int IORing::Submit(uint8_t opcode, int fd, char *buf, uint32_t size,
+                   uint64_t pos, IOHandle *handle) {
+  handle->Prepare(this);
+  std::unique_lock<std::mutex> lock(sq_mutex_);
+  /* the ring is full, make room first */
+  while (inflight_.load() >= depth_) {
+    lock.unlock();
+    int err = Reap(nullptr);
+    lock.lock();
+    if (err < 0 && inflight_.load() >= depth_) {
+      handle->Complete(-EBUSY);
+      return -EBUSY;
+    }
+  }
+
+  unsigned int tail = *sq_tail_;
+  unsigned int index = tail & *sq_mask_;
+  struct io_uring_sqe *sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)buf;
+  sqe->len = size;
+  sqe->off = pos;
+  sqe->user_data = (uint64_t)handle;
+  sq_array_[index] = index;
+  /* counted first, the request may be reaped before the enter returns */
+  inflight_++;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+  int ret;
+  do {
+    ret = io_uring_enter(ring_fd_, 1, 0, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret != 1) {
+    /* the kernel did not take the entry, roll it back */
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    inflight_--;
+    int err = ret < 0 ? -errno : -EAGAIN;
+    handle->Complete(err);
+    return err;
+  }
+  return 0;
+}
+
+int IORing::SubmitRead(int fd, char *buf, uint32_t size, uint64_t pos,
+                       IOHandle *handle) {
+  return Submit(IORING_OP_READ, fd, buf, size, pos, handle);
+}
+
+int IORing::SubmitWrite(int fd, char *buf, uint32_t size, uint64_t pos,
+                        IOHandle *handle) {
+  return Submit(IORING_OP_WRITE, fd, buf, size, pos, handle);
+}
+
+int IORing::SubmitWritev(int fd, const struct iovec *iov, int iovcnt,
+                         uint64_t pos, IOHandle *handle) {
+  return Submit(IORING_OP_WRITEV, fd, (char *)iov, iovcnt, pos, handle);
+}
+
+void IORing::Wait(IOHandle *handle) {
+  while (!handle->IsDone()) {
+    /* a request is completed before it is uncounted */
+    if (inflight_.load() == 0 && !handle->IsDone()) {
+      /* lost completion, should not happen */
+      handle->Complete(-EIO);
+      break;
+    }
+    Reap(handle);
+  }
+}
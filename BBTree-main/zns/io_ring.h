@@ -0,0 +1,111 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+/**
+ * Queue depth of the io_uring of a backend, 0 keeps the synchronous
+ * pread/pwrite path.
+ */
+#ifndef IO_URING_DEPTH
+#define IO_URING_DEPTH (64)
+#endif
+
+class IORing;
+
+/**
+ * Completion handle of an asynchronous read or write. The buffer must stay
+ * alive until Wait() returns.
+ */
+class IOHandle {
+ public:
+  IOHandle() = default;
+  IOHandle(const IOHandle &) = delete;
+  IOHandle &operator=(const IOHandle &) = delete;
+
+  /* called before the request is submitted */
+  void Prepare(IORing *ring) {
+    ring_ = ring;
+    res_ = 0;
+    done_.store(false, std::memory_order_relaxed);
+  }
+  void Complete(int res) {
+    res_ = res;
+    done_.store(true, std::memory_order_release);
+  }
+  bool IsDone() { return done_.load(std::memory_order_acquire); }
+  /* @return bytes transferred, or -errno */
+  int Wait();
+
+ private:
+  std::atomic_bool done_{true};
+  int res_ = 0;
+  IORing *ring_ = nullptr;
+};
+
+/**
+ * A minimal io_uring on top of the raw syscalls, so no liburing is needed.
+ * Submissions are serialized by a lock. Whoever waits for a handle reaps the
+ * completions of everybody: one waiter at a time blocks in the kernel
+ * without holding a lock, the others sleep until it has reaped.
+ */
+class IORing {
+ public:
+  IORing() = default;
+  ~IORing();
+  IORing(const IORing &) = delete;
+  IORing &operator=(const IORing &) = delete;
+
+  /* @return false if the kernel has no io_uring, callers stay synchronous */
+  bool Init(unsigned int depth);
+  bool IsReady() { return ring_fd_ >= 0; }
+
+  int SubmitRead(int fd, char *buf, uint32_t size, uint64_t pos,
+                 IOHandle *handle);
+  int SubmitWrite(int fd, char *buf, uint32_t size, uint64_t pos,
+                  IOHandle *handle);
+  /* the kernel may read iov until the request completes */
+  int SubmitWritev(int fd, const struct iovec *iov, int iovcnt, uint64_t pos,
+                   IOHandle *handle);
+  void Wait(IOHandle *handle);
+
+ private:
+  int Submit(uint8_t opcode, int fd, char *buf, uint32_t size, uint64_t pos,
+             IOHandle *handle);
+  /* wait until some requests finished and reap them, or until handle is
+   * done if another thread reaps. @return -errno if the kernel failed */
+  int Reap(IOHandle *handle);
+  /* complete the finished requests, cq_mutex_ held */
+  void Drain();
+
+  int ring_fd_ = -1;
+  unsigned int depth_ = 0;
+  // submitted and not reaped, counted before the kernel sees a request
+  std::atomic<unsigned int> inflight_{0};
+  std::mutex sq_mutex_;
+  std::mutex cq_mutex_;
+  std::condition_variable reaped_cv_;
+  // a thread waits in the kernel, and how often one came back
+  bool reaping_ = false;
+  uint64_t reap_round_ = 0;
+
+  void *sq_ptr_ = nullptr;
+  void *cq_ptr_ = nullptr;
+  size_t sq_size_ = 0;
+  size_t cq_size_ = 0;
+  struct io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned int *sq_tail_ = nullptr;
+  unsigned int *sq_mask_ = nullptr;
+  unsigned int *sq_array_ = nullptr;
+  unsigned int *cq_head_ = nullptr;
+  unsigned int *cq_tail_ = nullptr;
+  unsigned int *cq_mask_ = nullptr;
+  struct io_uring_cqe *cqes_ = nullptr;
+};
@@ -1,7 +1,12 @@
 #include "zone_backend.h"
 
 #include <fcntl.h>
+#include <linux/nvme_ioctl.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -113,9 +118,55 @@ IOStatus ZbdlibBackend::Open(bool readonly, bool exclusive,
   nr_zones_ = info.nr_zones;
   *max_active_zones = info.max_nr_active_zones;
   *max_open_zones = info.max_nr_open_zones;
+  if (!ring_.Init(IO_URING_DEPTH) && IO_URING_DEPTH > 0) {
+    printf("[ZbdlibBackend] io_uring is not available, use pread/pwrite\n");
+  }
+  if (!readonly) ProbeZoneAppend(info);
   return OK();
 }
 
+// the NVMe zone append command of the zoned namespace command set
+static const uint8_t NVME_ZONE_APPEND_OPCODE = 0x7d;
+
+void ZbdlibBackend::ProbeZoneAppend(const zbd_info &info) {
+  int nsid = ioctl(write_f_, NVME_IOCTL_ID);
+  std::ifstream f("/sys/block/" + filename_.substr(5) +
+                  "/queue/zone_append_max_bytes");
+  uint64_t max_bytes = 0;
+  if (nsid <= 0 || !(f >> max_bytes) || max_bytes == 0) {
+    printf("[ZbdlibBackend] %s has no zone append, appends are serialized\n",
+           filename_.c_str());
+    return;
+  }
+  nsid_ = nsid;
+  lba_size_ = info.lblock_size;
+  zone_append_max_ = std::min<uint64_t>(max_bytes, UINT32_MAX);
+}
+
+int ZbdlibBackend::ZoneAppend(char *data, uint32_t size, uint64_t zone_start,
+                              uint64_t *placed) {
+  if (nsid_ == 0 || size > zone_append_max_) return -EOPNOTSUPP;
+
+  uint64_t zslba = zone_start / lba_size_;
+  struct nvme_passthru_cmd64 cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opcode = NVME_ZONE_APPEND_OPCODE;
+  cmd.nsid = nsid_;
+  cmd.addr = (uint64_t)data;
+  cmd.data_len = size;
+  cmd.cdw10 = zslba & 0xffffffff;
+  cmd.cdw11 = zslba >> 32;
+  // 0's based number of logical blocks
+  cmd.cdw12 = size / lba_size_ - 1;
+  int ret = ioctl(write_f_, NVME_IOCTL_IO64_CMD, &cmd);
+  if (ret < 0) return -errno;
+  // a positive value is the NVMe status of a failed command
+  if (ret > 0) return -EIO;
+  // the result is the first logical block the device wrote
+  *placed = cmd.result * lba_size_;
+  return size;
+}
+
 std::unique_ptr<ZoneList> ZbdlibBackend::ListZones() {
   int ret;
   void *zones;
@@ -200,3 +251,404 @@ int ZbdlibBackend::Read(char *buf, int size, uint64_t pos, bool direct) {
 int ZbdlibBackend::Write(char *data, uint32_t size, uint64_t pos) {
   return pwrite(write_f_, data, size, pos);
 }
+
+int ZbdlibBackend::Writev(const struct iovec *iov, int iovcnt,
+                          uint32_t /* size */, uint64_t pos) {
+  return pwritev(write_f_, iov, iovcnt, pos);
+}
+
+int ZbdlibBackend::SubmitRead(char *buf, uint32_t size, uint64_t pos,
+                              IOHandle *handle) {
+  if (!ring_.IsReady()) {
+    return ZonedBlockDeviceBackend::SubmitRead(buf, size, pos, handle);
+  }
+  return ring_.SubmitRead(read_direct_f_, buf, size, pos, handle);
+}
+
+int ZbdlibBackend::SubmitWrite(char *data, uint32_t size, uint64_t pos,
+                               IOHandle *handle) {
+  if (!ring_.IsReady()) {
+    return ZonedBlockDeviceBackend::SubmitWrite(data, size, pos, handle);
+  }
+  return ring_.SubmitWrite(write_f_, data, size, pos, handle);
+}
+
+int ZbdlibBackend::SubmitWritev(const struct iovec *iov, int iovcnt,
+                                uint32_t size, uint64_t pos, IOHandle *handle) {
+  if (!ring_.IsReady()) {
+    return ZonedBlockDeviceBackend::SubmitWritev(iov, iovcnt, size, pos,
+                                                 handle);
+  }
+  return ring_.SubmitWritev(write_f_, iov, iovcnt, pos, handle);
+}
+
+/* ===== EmulatedBackend ==================================================== */
+
+EmulatedBackend::EmulatedBackend(std::string path)
+    : filename_(path),
+      fd_(-1),
+      mem_(nullptr),
+      readonly_(false),
+      zone_cap_(0),
+      max_active_(0),
+      max_open_(0),
+      nr_active_(0),
+      nr_open_(0) {}
+
+EmulatedBackend::~EmulatedBackend() {
+  if (IsMemory()) {
+    if (mem_ != nullptr) munmap(mem_, zone_sz_ * nr_zones_);
+  } else {
+    if (!readonly_) SaveState();
+    close(fd_);
+  }
+}
+
+IOStatus EmulatedBackend::Open(bool readonly, bool exclusive,
+                               unsigned int *max_active_zones,
+                               unsigned int *max_open_zones) {
+  block_sz_ = EMU_BLOCK_SIZE;
+  zone_sz_ = (uint64_t)EMU_ZONE_SIZE_MB * 1024 * 1024;
+  nr_zones_ = EMU_NR_ZONES;
+  zone_cap_ = (uint64_t)EMU_ZONE_CAPACITY_MB * 1024 * 1024;
+  max_active_ = EMU_MAX_ACTIVE_ZONES;
+  max_open_ = EMU_MAX_OPEN_ZONES;
+  readonly_ = readonly;
+  if (zone_cap_ > zone_sz_ || zone_cap_ % block_sz_ != 0) {
+    return InvalidArgument("Bad emulated zone capacity");
+  }
+
+  uint64_t dev_size = zone_sz_ * nr_zones_;
+  if (filename_ == EMULATED_MEMORY_DEVICE) {
+    /* only the pages that are written get backed by memory */
+    void *mem = mmap(nullptr, dev_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+      return IOError("Failed to map emulated zoned device: " +
+                     std::string(strerror(errno)));
+    }
+    mem_ = (char *)mem;
+  } else {
+    fd_ = open(filename_.c_str(), readonly ? O_RDONLY : (O_RDWR | O_CREAT),
+               S_IRUSR | S_IWUSR);
+    if (fd_ < 0) {
+      return InvalidArgument("Failed to open emulated zoned device " +
+                             filename_ + ": " + strerror(errno));
+    }
+    if (exclusive && flock(fd_, LOCK_EX | LOCK_NB) != 0) {
+      return InvalidArgument("Emulated zoned device is busy: " + filename_);
+    }
+    if (!readonly && ftruncate(fd_, dev_size) != 0) {
+      return IOError("Failed to resize emulated zoned device: " +
+                     std::string(strerror(errno)));
+    }
+    ring_.Init(IO_URING_DEPTH);
+  }
+
+  zones_.resize(nr_zones_);
+  for (uint32_t i = 0; i < nr_zones_; i++) {
+    struct zbd_zone *z = &zones_[i];
+    memset(z, 0, sizeof(*z));
+    z->start = i * zone_sz_;
+    z->len = zone_sz_;
+    z->capacity = zone_cap_;
+    z->wp = z->start;
+    z->type = ZBD_ZONE_TYPE_SWR;
+    z->cond = ZBD_ZONE_COND_EMPTY;
+  }
+  if (!IsMemory()) LoadState();
+
+  *max_active_zones = max_active_;
+  *max_open_zones = max_open_;
+  return OK();
+}
+
+std::unique_ptr<ZoneList> EmulatedBackend::ListZones() {
+  std::lock_guard<std::mutex> lock(zone_mtx_);
+  size_t bytes = sizeof(struct zbd_zone) * zones_.size();
+  void *zones = malloc(bytes);
+  if (zones == nullptr) return nullptr;
+  memcpy(zones, zones_.data(), bytes);
+  return std::unique_ptr<ZoneList>(new ZoneList(zones, zones_.size()));
+}
+
+bool EmulatedBackend::IsActiveCond(unsigned int cond) {
+  return cond == ZBD_ZONE_COND_IMP_OPEN || cond == ZBD_ZONE_COND_EXP_OPEN ||
+         cond == ZBD_ZONE_COND_CLOSED;
+}
+
+// drop the open/active resources held by a zone, caller holds zone_mtx_
+void EmulatedBackend::LeaveActive(struct zbd_zone *z) {
+  if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z)) nr_open_--;
+  if (IsActiveCond(z->cond)) nr_active_--;
+}
+
+/**
+ * @brief move an empty or closed zone to implicit open before a write, like
+ * the device does: an implicitly opened zone is closed to make room when the
+ * open limit is hit, and the active limit can not be exceeded.
+ * caller holds zone_mtx_
+ */
+bool EmulatedBackend::OpenImplicitly(struct zbd_zone *z) {
+  if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z)) return true;
+
+  if (zbd_zone_empty(z) && nr_active_ >= max_active_) {
+    errno = EOVERFLOW;
+    return false;
+  }
+  if (nr_open_ >= max_open_) {
+    struct zbd_zone *victim = nullptr;
+    for (auto &other : zones_) {
+      if (zbd_zone_imp_open(&other)) {
+        victim = &other;
+        break;
+      }
+    }
+    if (victim == nullptr) {
+      errno = ETOOMANYREFS;
+      return false;
+    }
+    victim->cond = ZBD_ZONE_COND_CLOSED;
+    nr_open_--;
+  }
+
+  if (zbd_zone_empty(z)) nr_active_++;
+  nr_open_++;
+  z->cond = ZBD_ZONE_COND_IMP_OPEN;
+  return true;
+}
+
+void EmulatedBackend::DropData(uint64_t pos, uint64_t size) {
+  if (IsMemory()) {
+    madvise(mem_ + pos, size, MADV_DONTNEED);
+  } else {
+    fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, size);
+  }
+}
+
+IOStatus EmulatedBackend::Reset(uint64_t start, bool *offline,
+                                uint64_t *max_capacity) {
+  if (readonly_) return IOError("Zone reset failed\n");
+  {
+    std::lock_guard<std::mutex> lock(zone_mtx_);
+    struct zbd_zone *z = GetZone(start);
+    LeaveActive(z);
+    z->cond = ZBD_ZONE_COND_EMPTY;
+    z->wp = z->start;
+  }
+  DropData(start, zone_sz_);
+
+  *offline = false;
+  *max_capacity = zone_cap_;
+  return OK();
+}
+
+IOStatus EmulatedBackend::Finish(uint64_t start) {
+  if (readonly_) return IOError("Zone finish failed\n");
+  std::lock_guard<std::mutex> lock(zone_mtx_);
+  struct zbd_zone *z = GetZone(start);
+  LeaveActive(z);
+  z->cond = ZBD_ZONE_COND_FULL;
+  z->wp = z->start + z->len;
+  return OK();
+}
+
+IOStatus EmulatedBackend::Close(uint64_t start) {
+  if (readonly_) return IOError("Zone close failed\n");
+  std::lock_guard<std::mutex> lock(zone_mtx_);
+  struct zbd_zone *z = GetZone(start);
+  if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z)) {
+    nr_open_--;
+    if (z->wp == z->start) {
+      nr_active_--;
+      z->cond = ZBD_ZONE_COND_EMPTY;
+    } else {
+      z->cond = ZBD_ZONE_COND_CLOSED;
+    }
+  }
+  return OK();
+}
+
+int EmulatedBackend::InvalidateCache(uint64_t pos, uint64_t size) {
+  if (IsMemory()) return 0;
+  return posix_fadvise(fd_, pos, size, POSIX_FADV_DONTNEED);
+}
+
+int EmulatedBackend::Read(char *buf, int size, uint64_t pos,
+                          bool /* direct */) {
+  uint64_t dev_size = zone_sz_ * nr_zones_;
+  if (pos >= dev_size) return 0;
+  if (pos + size > dev_size) size = dev_size - pos;
+
+  if (IsMemory()) {
+    memcpy(buf, mem_ + pos, size);
+    return size;
+  }
+  return pread(fd_, buf, size, pos);
+}
+
+bool EmulatedBackend::ClaimWrite(uint64_t *pos_out, uint32_t size,
+                                 bool append) {
+  uint64_t pos = *pos_out;
+  if (readonly_) {
+    errno = EBADF;
+    return false;
+  }
+  if (pos % block_sz_ != 0 || size % block_sz_ != 0 ||
+      pos / zone_sz_ >= nr_zones_) {
+    errno = EINVAL;
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(zone_mtx_);
+  struct zbd_zone *z = GetZone(pos);
+  if (append && !zbd_zone_full(z)) {
+    pos = *pos_out = z->wp;
+  }
+  if (zbd_zone_full(z) || pos != z->wp ||
+      pos + size > z->start + z->capacity) {
+    errno = EIO;
+    return false;
+  }
+  if (!OpenImplicitly(z)) return false;
+
+  z->wp += size;
+  if (z->wp == z->start + z->capacity) {
+    LeaveActive(z);
+    z->cond = ZBD_ZONE_COND_FULL;
+    z->wp = z->start + z->len;
+  }
+  return true;
+}
+
+int EmulatedBackend::Write(char *data, uint32_t size, uint64_t pos) {
+  /* claim [pos, pos + size) under the lock, copy the data outside of it */
+  if (!ClaimWrite(&pos, size)) return -1;
+
+  if (IsMemory()) {
+    memcpy(mem_ + pos, data, size);
+    return size;
+  }
+  return pwrite(fd_, data, size, pos);
+}
+
+int EmulatedBackend::Writev(const struct iovec *iov, int iovcnt, uint32_t size,
+                            uint64_t pos) {
+  if (!ClaimWrite(&pos, size)) return -1;
+
+  if (IsMemory()) {
+    for (int i = 0; i < iovcnt; i++) {
+      memcpy(mem_ + pos, iov[i].iov_base, iov[i].iov_len);
+      pos += iov[i].iov_len;
+    }
+    return size;
+  }
+  return pwritev(fd_, iov, iovcnt, pos);
+}
+
+int EmulatedBackend::SubmitRead(char *buf, uint32_t size, uint64_t pos,
+                                IOHandle *handle) {
+  uint64_t dev_size = zone_sz_ * nr_zones_;
+  if (IsMemory() || !ring_.IsReady() || pos + size > dev_size) {
+    return ZonedBlockDeviceBackend::SubmitRead(buf, size, pos, handle);
+  }
+  return ring_.SubmitRead(fd_, buf, size, pos, handle);
+}
+
+int EmulatedBackend::SubmitWrite(char *data, uint32_t size, uint64_t pos,
+                                 IOHandle *handle) {
+  if (IsMemory() || !ring_.IsReady()) {
+    return ZonedBlockDeviceBackend::SubmitWrite(data, size, pos, handle);
+  }
+  if (!ClaimWrite(&pos, size)) {
+    handle->Complete(-errno);
+    return -errno;
+  }
+  return ring_.SubmitWrite(fd_, data, size, pos, handle);
+}
+
+int EmulatedBackend::SubmitWritev(const struct iovec *iov, int iovcnt,
+                                  uint32_t size, uint64_t pos,
+                                  IOHandle *handle) {
+  if (IsMemory() || !ring_.IsReady()) {
+    return ZonedBlockDeviceBackend::SubmitWritev(iov, iovcnt, size, pos,
+                                                 handle);
+  }
+  if (!ClaimWrite(&pos, size)) {
+    handle->Complete(-errno);
+    return -errno;
+  }
+  return ring_.SubmitWritev(fd_, iov, iovcnt, pos, handle);
+}
+
+int EmulatedBackend::ZoneAppend(char *data, uint32_t size, uint64_t zone_start,
+                                uint64_t *placed) {
+  /* only the placement is serialized, the copies run side by side */
+  uint64_t pos = zone_start;
+  if (!ClaimWrite(&pos, size, true)) return -errno;
+  *placed = pos;
+
+  if (IsMemory()) {
+    memcpy(mem_ + pos, data, size);
+    return size;
+  }
+  int ret = pwrite(fd_, data, size, pos);
+  return ret < 0 ? -errno : ret;
+}
+
+/**
+ * The zone conditions of a file backed device are kept in a small side file,
+ * so a clean shutdown can be reopened like a real device. Open zones come
+ * back closed, as after a power cycle.
+ */
+struct EmulatedZoneState {
+  uint64_t wp;
+  uint32_t cond;
+  uint32_t reserved;
+};
+static const uint64_t EMU_STATE_MAGIC = 0x5a4e53454d550001;
+
+void EmulatedBackend::LoadState() {
+  std::ifstream in(StateFile(), std::ios::binary);
+  if (!in.is_open()) return;
+
+  uint64_t magic = 0, zone_sz = 0, zone_cap = 0;
+  uint32_t nr_zones = 0;
+  in.read((char *)&magic, sizeof(magic));
+  in.read((char *)&zone_sz, sizeof(zone_sz));
+  in.read((char *)&zone_cap, sizeof(zone_cap));
+  in.read((char *)&nr_zones, sizeof(nr_zones));
+  if (!in.good() || magic != EMU_STATE_MAGIC || zone_sz != zone_sz_ ||
+      zone_cap != zone_cap_ || nr_zones != nr_zones_) {
+    printf("[EmulatedBackend] ignore zone state of another geometry: %s\n",
+           StateFile().c_str());
+    return;
+  }
+
+  for (auto &z : zones_) {
+    EmulatedZoneState state;
+    in.read((char *)&state, sizeof(state));
+    if (!in.good()) break;
+    z.wp = state.wp;
+    z.cond = state.cond;
+    if (zbd_zone_imp_open(&z) || zbd_zone_exp_open(&z)) {
+      z.cond = ZBD_ZONE_COND_CLOSED;
+    }
+    if (IsActiveCond(z.cond)) nr_active_++;
+  }
+}
+
+void EmulatedBackend::SaveState() {
+  std::ofstream out(StateFile(), std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) return;
+
+  uint64_t magic = EMU_STATE_MAGIC;
+  out.write((char *)&magic, sizeof(magic));
+  out.write((char *)&zone_sz_, sizeof(zone_sz_));
+  out.write((char *)&zone_cap_, sizeof(zone_cap_));
+  out.write((char *)&nr_zones_, sizeof(nr_zones_));
+  for (auto &z : zones_) {
+    EmulatedZoneState state{z.wp, z.cond, 0};
+    out.write((char *)&state, sizeof(state));
+  }
+}
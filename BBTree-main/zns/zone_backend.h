@@ -5,6 +5,7 @@
 #include <libzbd/zbd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -17,6 +18,8 @@
 #include <utility>
 #include <vector>
 
+#include "io_ring.h"
+
 // https://stackoverflow.com/questions/71274207/how-to-bold-text-in-c-program
 #ifndef COLOR_MACRO
 #define COLOR_MACRO
@@ -106,6 +109,42 @@ class ZonedBlockDeviceBackend {
   virtual IOStatus Close(uint64_t start) = 0;
   virtual int Read(char *buf, int size, uint64_t pos, bool direct) = 0;
   virtual int Write(char *data, uint32_t size, uint64_t pos) = 0;
+  /* write the pieces back to back from pos, size is their total */
+  virtual int Writev(const struct iovec *iov, int iovcnt, uint32_t size,
+                     uint64_t pos) = 0;
+  /**
+   * asynchronous direct read/write, the result (bytes or -errno) goes to
+   * handle. Without an io_uring the request completes before returning.
+   * @return 0 if the request is submitted
+   */
+  virtual int SubmitRead(char *buf, uint32_t size, uint64_t pos,
+                         IOHandle *handle) {
+    int ret = Read(buf, size, pos, true);
+    handle->Complete(ret < 0 ? -errno : ret);
+    return ret < 0 ? -errno : 0;
+  }
+  virtual int SubmitWrite(char *data, uint32_t size, uint64_t pos,
+                          IOHandle *handle) {
+    int ret = Write(data, size, pos);
+    handle->Complete(ret < 0 ? -errno : ret);
+    return ret < 0 ? -errno : 0;
+  }
+  /* iov must stay alive until handle->Wait() too */
+  virtual int SubmitWritev(const struct iovec *iov, int iovcnt, uint32_t size,
+                           uint64_t pos, IOHandle *handle) {
+    int ret = Writev(iov, iovcnt, size, pos);
+    handle->Complete(ret < 0 ? -errno : ret);
+    return ret < 0 ? -errno : 0;
+  }
+  /**
+   * zone append: the device places the data at the write pointer of the
+   * zone starting at zone_start and returns the address in placed, so
+   * several writers can append to one zone at once.
+   * @return bytes written, or -errno. -EOPNOTSUPP if there is no append
+   */
+  virtual int ZoneAppend(char *, uint32_t, uint64_t, uint64_t *) {
+    return -EOPNOTSUPP;
+  }
   virtual int InvalidateCache(uint64_t pos, uint64_t size) = 0;
   virtual bool ZoneIsSwr(std::unique_ptr<ZoneList> &zones,
                          unsigned int idx) = 0;
@@ -134,6 +173,7 @@ class ZonedBlockDeviceBackend {
 enum class ZbdBackendType {
   kBlockDev,
   kZoneFS,
+  kEmulated,
 };
 
 class ZbdlibBackend : public ZonedBlockDeviceBackend {
@@ -142,6 +182,15 @@ class ZbdlibBackend : public ZonedBlockDeviceBackend {
   int read_f_;
   int read_direct_f_;
   int write_f_;
+  IORing ring_;
+  // zone append by NVMe passthrough, nsid_ is 0 if the device is no NVMe
+  // namespace. Larger appends take the serialized path
+  uint32_t nsid_ = 0;
+  uint32_t lba_size_ = 0;
+  uint32_t zone_append_max_ = 0;
+
+  /* the passthrough can send the zone append command */
+  void ProbeZoneAppend(const zbd_info &info);
 
  public:
   explicit ZbdlibBackend(std::string bdevname);
@@ -159,6 +208,13 @@ class ZbdlibBackend : public ZonedBlockDeviceBackend {
   IOStatus Close(uint64_t start);
   int Read(char *buf, int size, uint64_t pos, bool direct);
   int Write(char *data, uint32_t size, uint64_t pos);
+  int Writev(const struct iovec *iov, int iovcnt, uint32_t size, uint64_t pos);
+  int SubmitRead(char *buf, uint32_t size, uint64_t pos, IOHandle *handle);
+  int SubmitWrite(char *data, uint32_t size, uint64_t pos, IOHandle *handle);
+  int SubmitWritev(const struct iovec *iov, int iovcnt, uint32_t size,
+                   uint64_t pos, IOHandle *handle);
+  int ZoneAppend(char *data, uint32_t size, uint64_t zone_start,
+                 uint64_t *placed);
   int InvalidateCache(uint64_t pos, uint64_t size);
 
   bool ZoneIsSwr(std::unique_ptr<ZoneList> &zones, unsigned int idx) {
@@ -227,4 +283,124 @@ class ZbdlibBackend : public ZonedBlockDeviceBackend {
   std::string ErrorToString(int err);
 };
 
+/**
+ * Emulated zoned device, used to run without ZNS hardware.
+ * "emu:mem" keeps the zones in anonymous memory, "emu:/path/to/file" keeps
+ * them in a regular file. The geometry can be overridden at build time.
+ */
+#define EMULATED_DEVICE_PREFIX "emu:"
+#define EMULATED_MEMORY_DEVICE "mem"
+
+#ifndef EMU_NR_ZONES
+#define EMU_NR_ZONES (64)
+#endif
+#ifndef EMU_ZONE_SIZE_MB
+#define EMU_ZONE_SIZE_MB (64)
+#endif
+#ifndef EMU_ZONE_CAPACITY_MB
+#define EMU_ZONE_CAPACITY_MB (EMU_ZONE_SIZE_MB)
+#endif
+#ifndef EMU_MAX_ACTIVE_ZONES
+#define EMU_MAX_ACTIVE_ZONES (14)
+#endif
+#ifndef EMU_MAX_OPEN_ZONES
+#define EMU_MAX_OPEN_ZONES (14)
+#endif
+#define EMU_BLOCK_SIZE (4096)
+
+class EmulatedBackend : public ZonedBlockDeviceBackend {
+ private:
+  std::string filename_;
+  int fd_;
+  char *mem_;
+  bool readonly_;
+  uint64_t zone_cap_;
+  unsigned int max_active_;
+  unsigned int max_open_;
+  unsigned int nr_active_;
+  unsigned int nr_open_;
+  /* zone conditions and write pointers, guarded by zone_mtx_ */
+  std::vector<struct zbd_zone> zones_;
+  std::mutex zone_mtx_;
+  /* only used by a file backed device */
+  IORing ring_;
+
+ public:
+  explicit EmulatedBackend(std::string path);
+  ~EmulatedBackend();
+
+  IOStatus Open(bool readonly, bool exclusive, unsigned int *max_active_zones,
+                unsigned int *max_open_zones);
+  std::unique_ptr<ZoneList> ListZones();
+  IOStatus Reset(uint64_t start, bool *offline, uint64_t *max_capacity);
+  IOStatus Finish(uint64_t start);
+  IOStatus Close(uint64_t start);
+  int Read(char *buf, int size, uint64_t pos, bool direct);
+  int Write(char *data, uint32_t size, uint64_t pos);
+  int Writev(const struct iovec *iov, int iovcnt, uint32_t size, uint64_t pos);
+  int SubmitRead(char *buf, uint32_t size, uint64_t pos, IOHandle *handle);
+  int SubmitWrite(char *data, uint32_t size, uint64_t pos, IOHandle *handle);
+  int SubmitWritev(const struct iovec *iov, int iovcnt, uint32_t size,
+                   uint64_t pos, IOHandle *handle);
+  int ZoneAppend(char *data, uint32_t size, uint64_t zone_start,
+                 uint64_t *placed);
+  int InvalidateCache(uint64_t pos, uint64_t size);
+
+  bool ZoneIsSwr(std::unique_ptr<ZoneList> &zones, unsigned int idx) {
+    struct zbd_zone *z = &((struct zbd_zone *)zones->GetData())[idx];
+    return zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR;
+  };
+
+  bool ZoneIsOffline(std::unique_ptr<ZoneList> &zones, unsigned int idx) {
+    struct zbd_zone *z = &((struct zbd_zone *)zones->GetData())[idx];
+    return zbd_zone_offline(z);
+  };
+
+  bool ZoneIsWritable(std::unique_ptr<ZoneList> &zones, unsigned int idx) {
+    struct zbd_zone *z = &((struct zbd_zone *)zones->GetData())[idx];
+    return !(zbd_zone_full(z) || zbd_zone_offline(z) || zbd_zone_rdonly(z));
+  };
+
+  bool ZoneIsActive(std::unique_ptr<ZoneList> &zones, unsigned int idx) {
+    struct zbd_zone *z = &((struct zbd_zone *)zones->GetData())[idx];
+    return zbd_zone_imp_open(z) || zbd_zone_exp_open(z) || zbd_zone_closed(z);
+  };
+
+  bool ZoneIsOpen(std::unique_ptr<ZoneList> &zones, unsigned int idx) {
+    struct zbd_zone *z = &((struct zbd_zone *)zones->GetData())[idx];
+    return zbd_zone_imp_open(z) || zbd_zone_exp_open(z);
+  };
+
+  uint64_t ZoneStart(std::unique_ptr<ZoneList> &zones, unsigned int idx) {
+    struct zbd_zone *z = &((struct zbd_zone *)zones->GetData())[idx];
+    return zbd_zone_start(z);
+  };
+
+  uint64_t ZoneMaxCapacity(std::unique_ptr<ZoneList> &zones, unsigned int idx) {
+    struct zbd_zone *z = &((struct zbd_zone *)zones->GetData())[idx];
+    return zbd_zone_capacity(z);
+  };
+
+  uint64_t ZoneWp(std::unique_ptr<ZoneList> &zones, unsigned int idx) {
+    struct zbd_zone *z = &((struct zbd_zone *)zones->GetData())[idx];
+    return zbd_zone_wp(z);
+  };
+
+  std::string GetFilename() { return EMULATED_DEVICE_PREFIX + filename_; }
+
+ private:
+  bool IsMemory() { return fd_ < 0; }
+  struct zbd_zone *GetZone(uint64_t pos) { return &zones_[pos / zone_sz_]; }
+  bool IsActiveCond(unsigned int cond);
+  void LeaveActive(struct zbd_zone *z);
+  bool OpenImplicitly(struct zbd_zone *z);
+  /* move the write pointer over [pos, pos + size), false with errno set.
+   * with append the data goes to the write pointer, returned in pos */
+  bool ClaimWrite(uint64_t *pos, uint32_t size, bool append = false);
+  void DropData(uint64_t pos, uint64_t size);
+  std::string StateFile() { return filename_ + ".zones"; }
+  void LoadState();
+  void SaveState();
+};
+
 // #endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
\ No newline at end of file
@@ -36,6 +36,21 @@ Zone::Zone(ZonedBlockDevice *zbd, ZonedBlockDeviceBackend *zbd_be,
   if (zbd_be->ZoneIsWritable(zones, idx)) {
     capacity_ = max_capacity_ - used_capacity_;
   }
+  uint64_t pages = zbd_be->GetZoneSize() / ZNS_PAGE_SIZE;
+  bitmap_words_ = (pages + 63) / 64;
+  valid_bitmap_.reset(new std::atomic<uint64_t>[bitmap_words_]);
+  // pages written before start up are taken as valid
+  uint64_t written = (wp_ - start_) / ZNS_PAGE_SIZE;
+  for (uint64_t i = 0; i < bitmap_words_; i++) {
+    uint64_t bits = 0;
+    if (written >= (i + 1) * 64) {
+      bits = ~0ULL;
+    } else if (written > i * 64) {
+      bits = (1ULL << (written - i * 64)) - 1;
+    }
+    valid_bitmap_[i].store(bits, std::memory_order_relaxed);
+  }
+  used_capacity_ = written * ZNS_PAGE_SIZE;
 }
 void Zone::Counts() {
   zbd_->AddWriteCount(write_count_);
@@ -62,6 +77,45 @@ uint64_t Zone::GetMaxCapacity() { return max_capacity_; }
 uint64_t Zone::GetNextPageId() { return wp_ / ZNS_PAGE_SIZE; }
 uint64_t Zone::GetZoneNr() { return start_ / zbd_->GetZoneSize(); }
 
+bool Zone::MarkValid(uint64_t offset) {
+  uint64_t idx = (offset - start_) / ZNS_PAGE_SIZE;
+  uint64_t mask = 1ULL << (idx % 64);
+  uint64_t old = valid_bitmap_[idx / 64].fetch_or(mask);
+  if (old & mask) return false;
+  used_capacity_.fetch_add(ZNS_PAGE_SIZE);
+  return true;
+}
+
+bool Zone::MarkInvalid(uint64_t offset) {
+  uint64_t idx = (offset - start_) / ZNS_PAGE_SIZE;
+  uint64_t mask = 1ULL << (idx % 64);
+  uint64_t old = valid_bitmap_[idx / 64].fetch_and(~mask);
+  if (!(old & mask)) return false;
+  used_capacity_.fetch_sub(ZNS_PAGE_SIZE);
+  invalid_pages_.fetch_add(1);
+  return true;
+}
+
+void Zone::ClearValid() {
+  for (uint64_t i = 0; i < bitmap_words_; i++) {
+    valid_bitmap_[i].store(0);
+  }
+  used_capacity_ = 0;
+  invalid_pages_ = 0;
+}
+
+bool Zone::IsValid(uint64_t offset) {
+  uint64_t idx = (offset - start_) / ZNS_PAGE_SIZE;
+  return valid_bitmap_[idx / 64].load() & (1ULL << (idx % 64));
+}
+
+double Zone::GetLiveRatio() {
+  uint64_t valid = GetValidPages();
+  uint64_t used = valid + GetInvalidPages();
+  if (used == 0) return 1.0;
+  return valid * 1.0 / used;
+}
+
 void Zone::EncodeJson(std::ostream &json_stream) {
   json_stream << "{";
   json_stream << "\"start\":" << start_ << ",";
@@ -80,6 +134,10 @@ IOStatus Zone::Reset() {
   assert(!IsUsed());
   assert(IsBusy());
 
+  bool was_empty = IsEmpty();
+  bool was_full = IsFull();
+  bool was_active = open_ || !(was_empty || was_full);
+
   IOStatus ios = zbd_be_->Reset(start_, &offline, &max_capacity);
   if (ios != OK()) return ios;
 
@@ -89,6 +147,7 @@ IOStatus Zone::Reset() {
     max_capacity_ = capacity_ = max_capacity;
 
   wp_ = start_;
+  zbd_->ZoneReset(this, was_active, was_full, was_empty);
 
   return OK();
 }
@@ -96,11 +155,16 @@ IOStatus Zone::Reset() {
 IOStatus Zone::Finish() {
   assert(IsBusy());
 
+  bool was_full = IsFull();
+  bool was_active = open_ || !(IsEmpty() || was_full);
+
   IOStatus ios = zbd_be_->Finish(start_);
   if (ios != OK()) return ios;
 
   capacity_ = 0;
   wp_ = start_ + zbd_->GetZoneSize();
+  finish_seq_ = zbd_->NextFinishSeq();
+  zbd_->ZoneFinished(this, was_active, was_full);
 
   Counts();
   return OK();
@@ -112,6 +176,11 @@ IOStatus Zone::Close() {
   if (!(IsEmpty() || IsFull())) {
     IOStatus ios = zbd_be_->Close(start_);
     if (ios != OK()) return ios;
+    // still active, but no longer counts against the open limit
+    if (open_) {
+      open_ = false;
+      zbd_->ZoneClosed();
+    }
   }
 
   return OK();
@@ -172,6 +241,76 @@ IOStatus Zone::Append(char *data, uint32_t size) {
   return OK();
 }
 
+IOStatus Zone::AsyncAppend(char *data, uint32_t size, IOHandle *handle) {
+  if (capacity_ < size) return NoSpace("Not enough capacity for append");
+  if ((uint64_t)data & 0xfff) return IOError("Addr must align to 4KB");
+  assert((size % zbd_->GetBlockSize()) == 0);
+
+  int ret = zbd_be_->SubmitWrite(data, size, wp_, handle);
+  if (ret < 0) return IOError(strerror(-ret));
+
+  wp_ += size;
+  capacity_ -= size;
+  write_bytes_ += size;
+  write_count_++;
+  return OK();
+}
+
+IOStatus Zone::AsyncAppendv(const struct iovec *iov, int iovcnt,
+                           IOHandle *handle) {
+  uint32_t size = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if ((uint64_t)iov[i].iov_base & 0xfff) {
+      return IOError("Addr must align to 4KB");
+    }
+    size += iov[i].iov_len;
+  }
+  if (capacity_ < size) return NoSpace("Not enough capacity for append");
+  assert((size % zbd_->GetBlockSize()) == 0);
+
+  int ret = zbd_be_->SubmitWritev(iov, iovcnt, size, wp_, handle);
+  if (ret < 0) return IOError(strerror(-ret));
+
+  wp_ += size;
+  capacity_ -= size;
+  write_bytes_ += size;
+  write_count_++;
+  return OK();
+}
+
+IOStatus Zone::AsyncRead(char *data, uint32_t size, uint64_t offset,
+                         IOHandle *handle) {
+  int ret = zbd_be_->SubmitRead(data, size, offset, handle);
+  if (ret < 0) return IOError(strerror(-ret));
+
+  read_count_++;
+  return OK();
+}
+
+IOStatus Zone::ZoneAppend(char *data, uint32_t size, uint64_t *placed) {
+  if ((uint64_t)data & 0xfff) return IOError("Addr must align to 4KB");
+  assert((size % zbd_->GetBlockSize()) == 0);
+
+  int ret = zbd_be_->ZoneAppend(data, size, start_, placed);
+  if (ret == -EOPNOTSUPP) {
+    std::lock_guard<std::mutex> lock(append_mtx_);
+    *placed = wp_;
+    return Append(data, size);
+  }
+  if (ret < 0) return IOError(strerror(-ret));
+  if (ret != (int)size) return IOError("Append failed");
+
+  std::lock_guard<std::mutex> lock(append_mtx_);
+  // appends complete out of order, wp_ follows the furthest one
+  if (*placed + size > wp_) {
+    wp_ = *placed + size;
+    capacity_ = start_ + max_capacity_ - wp_;
+  }
+  write_bytes_ += size;
+  write_count_++;
+  return OK();
+}
+
 uint64_t Zone::GetReadCount() { return read_count_; };
 uint64_t Zone::GetWriteCount() { return write_count_; };
 
@@ -222,7 +361,13 @@ void Zone::PrintZbd() {
 }
 
 ZonedBlockDevice::ZonedBlockDevice(std::string path) {
-  zbd_be_ = std::unique_ptr<ZbdlibBackend>(new ZbdlibBackend(path));
+  std::string prefix = EMULATED_DEVICE_PREFIX;
+  if (path.compare(0, prefix.size(), prefix) == 0) {
+    zbd_be_ = std::unique_ptr<EmulatedBackend>(
+        new EmulatedBackend(path.substr(prefix.size())));
+  } else {
+    zbd_be_ = std::unique_ptr<ZbdlibBackend>(new ZbdlibBackend(path));
+  }
 }
 
 IOStatus ZonedBlockDevice::Open(bool readonly, bool exclusive) {
@@ -232,8 +377,8 @@ IOStatus ZonedBlockDevice::Open(bool readonly, bool exclusive) {
   // Status s;
   uint64_t i = 0;
   uint64_t m = 0;
-  // Reserve one zone for metadata and another one for extent migration
-  int reserved_zones = 0;
+  // Reserve one zone for metadata
+  int reserved_zones = ZENFS_META_ZONES;
 
   if (!readonly && !exclusive)
     return InvalidArgument("Write opens must be exclusive");
@@ -277,10 +422,15 @@ IOStatus ZonedBlockDevice::Open(bool readonly, bool exclusive) {
           return Corruption("Failed to set busy flag of zone " +
                             std::to_string(newZone->GetZoneNr()));
         }
+        io_zones.push_back(newZone);
+        // kept out of the zone accounting, it is reserved by the limits
+        if (meta_zone_ == nullptr) {
+          meta_zone_ = newZone;
+          continue;
+        }
         if (newZone->IsFull()) {
           full_io_zones_++;
         }
-        io_zones.push_back(newZone);
         if (zbd_be_->ZoneIsActive(zone_rep, i)) {
           active_io_zones_++;
           if (zbd_be_->ZoneIsOpen(zone_rep, i)) {
@@ -289,6 +439,17 @@ IOStatus ZonedBlockDevice::Open(bool readonly, bool exclusive) {
             }
           }
         }
+        if (newZone->IsEmpty() && !newZone->IsFull()) {
+          free_zones_.push_back(newZone);
+        } else if (!newZone->IsFull() && !readonly) {
+          // almost full leftovers give their active zone back right away
+          if (BelowFinishThreshold(newZone)) {
+            IOStatus status = newZone->Finish();
+            if (status != OK()) return status;
+          } else {
+            resume_zones_.push_back(newZone);
+          }
+        }
         IOStatus status = newZone->CheckRelease();
         if (status != OK()) {
           return status;
@@ -307,28 +468,92 @@ IOStatus ZonedBlockDevice::Open(bool readonly, bool exclusive) {
   return OK();
 }
 
+bool ZonedBlockDevice::BelowFinishThreshold(Zone *zone) {
+  return zone->GetCapacityLeft() * 100 <
+         zone->GetMaxCapacity() * finish_threshold_;
+}
+
 /**
- * @brief return not full zone which may not be the minium zone id
+ * @brief the partially written zones left from the last run go first, they
+ * are active already. An empty zone is opened only while both the active and
+ * the open zone limit have room, so a writer never hits them on the device.
+ * O(1) but for the leftovers that get finished on the way.
  */
 IOStatus ZonedBlockDevice::AllocateEmptyZone(Zone **zone_out) {
   IOStatus s;
-  Zone *allocated_zone = nullptr;
-  for (const auto z : io_zones) {
-    if (z->Acquire()) {
-      // if (z->IsEmpty()) {
-      if (!z->IsFull()) {
-        allocated_zone = z;
-        break;
-      } else {
-        s = z->CheckRelease();
-        if (s != OK()) return s;
-      }
+  *zone_out = nullptr;
+  std::lock_guard<std::mutex> lock(zone_mtx_);
+  if (open_io_zones_ >= max_nr_open_io_zones_) return OK();
+
+  while (!resume_zones_.empty()) {
+    Zone *z = resume_zones_.front();
+    resume_zones_.pop_front();
+    if (!z->Acquire()) continue;
+    // reset or filled up since start up
+    if (z->IsEmpty() || z->IsFull()) {
+      s = z->CheckRelease();
+      if (s != OK()) return s;
+      continue;
+    }
+    if (BelowFinishThreshold(z)) {
+      s = z->Finish();
+      if (s != OK()) return s;
+      s = z->CheckRelease();
+      if (s != OK()) return s;
+      continue;
     }
+    z->open_ = true;
+    open_io_zones_++;
+    *zone_out = z;
+    return OK();
+  }
+
+  if (active_io_zones_ >= max_nr_active_io_zones_) return OK();
+  // a zone the cleaner just reset may still be busy, it goes to the back
+  for (size_t n = free_zones_.size(); n > 0; n--) {
+    Zone *z = free_zones_.front();
+    free_zones_.pop_front();
+    if (!z->Acquire()) {
+      free_zones_.push_back(z);
+      continue;
+    }
+    assert(z->IsEmpty());
+    z->open_ = true;
+    active_io_zones_++;
+    open_io_zones_++;
+    *zone_out = z;
+    return OK();
   }
-  *zone_out = allocated_zone;
   return OK();
 }
 
+void ZonedBlockDevice::ZoneFinished(Zone *zone, bool was_active,
+                                    bool was_full) {
+  if (zone == meta_zone_) return;
+  if (was_active) active_io_zones_--;
+  if (zone->open_) {
+    zone->open_ = false;
+    open_io_zones_--;
+  }
+  if (!was_full) full_io_zones_++;
+}
+
+void ZonedBlockDevice::ZoneReset(Zone *zone, bool was_active, bool was_full,
+                                 bool was_empty) {
+  if (zone == meta_zone_) return;
+  if (was_active) active_io_zones_--;
+  if (was_full) full_io_zones_--;
+  // an empty zone nobody holds is in free_zones_ already
+  bool queued = was_empty && !zone->open_;
+  if (zone->open_) {
+    zone->open_ = false;
+    open_io_zones_--;
+  }
+  if (zone->IsFull() || queued) return;
+  std::lock_guard<std::mutex> lock(zone_mtx_);
+  free_zones_.push_back(zone);
+}
+
 Zone *ZonedBlockDevice::GetZoneFromOffset(uint64_t offset) {
   return io_zones[offset / zbd_be_->GetZoneSize()];
 }
@@ -355,19 +580,29 @@ uint64_t ZonedBlockDevice::GetUsedSpace() {
 uint64_t ZonedBlockDevice::GetReclaimableSpace() {
   uint64_t reclaimable = 0;
   for (const auto z : io_zones) {
-    if (z->IsFull()) reclaimable += (z->used_capacity_);
+    if (z->IsFull()) reclaimable += (z->max_capacity_ - z->used_capacity_);
   }
   return reclaimable;
 }
 
-uint64_t ZonedBlockDevice::GetActiveZones() {
-  uint64_t active = 0;
+double ZonedBlockDevice::GetLiveRatio() {
+  uint64_t valid = 0;
+  uint64_t used = 0;
   for (const auto z : io_zones) {
-    // if ((!z->Is)) active++;
+    valid += z->GetValidPages();
+    used += z->GetValidPages() + z->GetInvalidPages();
   }
-  return active;
+  if (used == 0) return 1.0;
+  return valid * 1.0 / used;
+}
+
+uint32_t ZonedBlockDevice::GetFreeZones() {
+  std::lock_guard<std::mutex> lock(zone_mtx_);
+  return free_zones_.size() + resume_zones_.size();
 }
 
+uint64_t ZonedBlockDevice::GetActiveZones() { return active_io_zones_.load(); }
+
 ZonedBlockDevice::~ZonedBlockDevice() {
   for (const auto z : io_zones) {
     delete z;
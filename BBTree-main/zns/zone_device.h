@@ -1,5 +1,7 @@
 
 #pragma once
+#include <deque>
+
 #include "assert.h"
 #include "zone_backend.h"
 
@@ -16,6 +18,16 @@ std::string CalSize(uint64_t size);
 
 /* Minimum of number of zones that makes sense */
 #define ZENFS_MIN_ZONES (32)
+/* the first zones hold the metadata of the store, they are never handed out */
+#define ZENFS_META_ZONES (1)
+/**
+ * a partially written zone with less than this percent of its capacity left
+ * is finished instead of handed out again, it would hold an active zone for
+ * little space
+ */
+#ifndef ZONE_FINISH_THRESHOLD
+#define ZONE_FINISH_THRESHOLD (10)
+#endif
 
 class ZonedBlockDevice;
 
@@ -33,7 +45,19 @@ class Zone {
   uint64_t capacity_; /* remaining capacity */
   uint64_t max_capacity_;
   uint64_t wp_;
+  /* bytes still referenced by the index, dropped when a page is rewritten */
   std::atomic<uint64_t> used_capacity_;
+  /* one bit per page of the zone, set while the page is referenced */
+  std::unique_ptr<std::atomic<uint64_t>[]> valid_bitmap_;
+  uint64_t bitmap_words_ = 0;
+  /* pages whose bit got cleared since the last reset */
+  std::atomic<uint64_t> invalid_pages_{0};
+  /* value of the device finish counter when the zone got full, its age */
+  uint64_t finish_seq_ = 0;
+  /* guards wp_ and capacity_ among concurrent ZoneAppend callers */
+  std::mutex append_mtx_;
+  /* handed out by AllocateEmptyZone, holds an open zone of the device */
+  bool open_ = false;
 
   uint64_t read_count_ = 0;
   uint64_t write_count_ = 0;
@@ -47,16 +71,49 @@ class Zone {
    * offset and size are both in bytes
    */
   IOStatus Read(char *data, uint32_t size, uint64_t offset, bool direct = true);
+  /**
+   * asynchronous versions, data must stay untouched until handle->Wait().
+   * AsyncAppend moves the write pointer at submission, so appends to a zone
+   * can be queued back to back.
+   */
+  IOStatus AsyncAppend(char *data, uint32_t size, IOHandle *handle);
+  /* gathers the pieces into one append, iov stays alive like data */
+  IOStatus AsyncAppendv(const struct iovec *iov, int iovcnt, IOHandle *handle);
+  IOStatus AsyncRead(char *data, uint32_t size, uint64_t offset,
+                     IOHandle *handle);
+  /**
+   * zone append, thread safe. placed is the device offset the data went to.
+   * Without device support the write goes to wp_ under append_mtx_.
+   */
+  IOStatus ZoneAppend(char *data, uint32_t size, uint64_t *placed);
 
   bool IsUsed();
   bool IsFull();
   bool IsEmpty();
+  bool IsOpen() { return open_; }
   // bool IsOffline();
+  ZonedBlockDevice *GetDevice() { return zbd_; }
   uint64_t GetZoneNr();
   uint64_t GetCapacityLeft();
   uint64_t GetMaxCapacity();
   uint64_t GetNextPageId();
 
+  /**
+   * valid page bitmap, offset is the byte offset in the zns device.
+   * @return false if the page already had the state
+   */
+  bool MarkValid(uint64_t offset);
+  bool MarkInvalid(uint64_t offset);
+  /* forget every page, the zone is about to be reset */
+  void ClearValid();
+  bool IsValid(uint64_t offset);
+  uint64_t GetValidPages() { return used_capacity_.load() / ZNS_PAGE_SIZE; }
+  uint64_t GetInvalidPages() { return invalid_pages_.load(); }
+  /* pages between the zone start and the write pointer */
+  uint64_t GetWrittenPages() { return (wp_ - start_) / ZNS_PAGE_SIZE; }
+  /* valid / (valid + invalid) pages, 1.0 for an empty zone */
+  double GetLiveRatio();
+
   uint64_t GetReadCount();
   uint64_t GetWriteCount();
 
@@ -95,11 +152,12 @@ class ZonedBlockDevice {
   std::vector<Zone *> io_zones;
   time_t start_time_;
   //   std::shared_ptr<Logger> logger_;
-  uint32_t finish_threshold_ = 0;
+  uint32_t finish_threshold_ = ZONE_FINISH_THRESHOLD;
   std::atomic<uint64_t> bytes_written_{0};
   std::atomic<uint64_t> gc_bytes_written_{0};
   std::atomic<uint64_t> write_count_{0};
   std::atomic<uint64_t> read_count_{0};
+  std::atomic<uint64_t> finish_seq_{0};
 
   std::atomic<long> active_io_zones_;
   std::atomic<long> open_io_zones_;
@@ -108,6 +166,21 @@ class ZonedBlockDevice {
   unsigned int max_nr_active_io_zones_;
   unsigned int max_nr_open_io_zones_;
 
+  /**
+   * zones for AllocateEmptyZone, guarded by zone_mtx_. free_zones_ are empty,
+   * resume_zones_ were partially written before start up and are active on
+   * the device already, they go first.
+   */
+  std::mutex zone_mtx_;
+  std::deque<Zone *> free_zones_;
+  std::deque<Zone *> resume_zones_;
+  /* stays busy, only the owner of the metadata writes to it */
+  Zone *meta_zone_ = nullptr;
+  /* position of the device among the ones striped together */
+  uint32_t device_id_ = 0;
+
+  bool BelowFinishThreshold(Zone *zone);
+
   //   std::shared_ptr<ZenFSMetrics> metrics_;
 
   void EncodeJsonZone(std::ostream &json_stream,
@@ -119,7 +192,17 @@ class ZonedBlockDevice {
 
   IOStatus Open(bool readonly, bool exclusive);
   int Read(char *buf, uint64_t offset, int n, bool direct);
+  /**
+   * hand out a zone to write to, nullptr if the device has no zone left or
+   * opening one more would exceed its active or open zone limit
+   */
   IOStatus AllocateEmptyZone(Zone **zone_out);
+  /* state changes of a zone, called by the zone itself */
+  void ZoneFinished(Zone *zone, bool was_active, bool was_full);
+  void ZoneReset(Zone *zone, bool was_active, bool was_full, bool was_empty);
+  void ZoneClosed() { open_io_zones_--; }
+  /* percent of the capacity, see ZONE_FINISH_THRESHOLD */
+  void SetFinishThreshold(uint32_t threshold) { finish_threshold_ = threshold; }
   IOStatus InvalidateCache(uint64_t pos, uint64_t size);
 
   void AddWriteCount(uint64_t count) { write_count_.fetch_add(count); };
@@ -140,10 +223,20 @@ class ZonedBlockDevice {
   uint64_t GetFreeSpace();
   uint64_t GetUsedSpace();
   uint64_t GetReclaimableSpace();
+  /* valid / (valid + invalid) pages over all zones */
+  double GetLiveRatio();
+  /* zones AllocateEmptyZone may still hand out */
+  uint32_t GetFreeZones();
   uint64_t GetBlockSize();
   uint64_t GetZoneSize();
   Zone *GetZoneFromOffset(uint64_t offset);
   Zone *GetZone(uint64_t zone_id);
+  const std::vector<Zone *> &GetIOZones() { return io_zones; }
+  Zone *GetMetaZone() { return meta_zone_; }
+  void SetDeviceId(uint32_t device_id) { device_id_ = device_id; }
+  uint32_t GetDeviceId() { return device_id_; }
+  uint64_t NextFinishSeq() { return finish_seq_.fetch_add(1) + 1; }
+  uint64_t GetFinishSeq() { return finish_seq_.load(); }
 
   uint64_t GetReadCount() { return read_count_.load(); };
   uint64_t GetWriteCount() { return write_count_.load(); };
@@ -154,6 +247,8 @@ class ZonedBlockDevice {
   uint64_t GetActiveIOZones() { return active_io_zones_.load(); };
   uint64_t GetOpenIOZones() { return open_io_zones_.load(); };
   uint64_t GetFullIOZones() { return full_io_zones_.load(); };
+  uint32_t GetMaxActiveIOZones() { return max_nr_active_io_zones_; };
+  uint32_t GetMaxOpenIOZones() { return max_nr_open_io_zones_; };
   std::string GetFilename();
 
   void PrintUsedZones();